@@ -91,14 +91,11 @@ static void initiate_authentication(PolkitAgentListener* agent_listener,
                                     gpointer user_data)
 {
 
-    /* Turn identities into an STL list */
-    std::list<std::string> idents;
+    /* Turn identities into an STL list, keeping the objects */
+    std::list<Identity> idents;
     for (GList* identhead = identities; identhead != nullptr; identhead = g_list_next(identhead))
     {
-        auto ident = static_cast<PolkitIdentity*>(identhead->data);
-        auto identstr = polkit_identity_to_string(ident);
-        idents.push_back(protect_string(identstr));
-        g_free(identstr);
+        idents.emplace_back(static_cast<PolkitIdentity*>(identhead->data));
     }
 
     /* Get a C++ shared ptr for cancellable */
@@ -111,7 +108,13 @@ static void initiate_authentication(PolkitAgentListener* agent_listener,
     auto call = [task](Authentication::State state) -> void {
         if (state == Authentication::State::CANCELLED)
         {
-            g_task_return_new_error(task.get(), agent_glib_error_quark(), 0, "Authentication Error: Cancelled");
+            g_task_return_new_error(task.get(), agent_glib_error_quark(), AGENT_GLIB_ERROR_CANCELLED,
+                                    "Authentication Error: Cancelled");
+        }
+        else if (state == Authentication::State::REJECTED)
+        {
+            g_task_return_new_error(task.get(), agent_glib_error_quark(), AGENT_GLIB_ERROR_REJECTED,
+                                    "Authentication Error: Too many authentications in progress");
         }
         else
         {
@@ -26,5 +26,14 @@
 typedef struct _AgentGlib AgentGlib;
 typedef struct _AgentGlibClass AgentGlibClass;
 
+/** Error codes in the agent_glib_error domain that go back to PolicyKit */
+typedef enum
+{
+    AGENT_GLIB_ERROR_CANCELLED, /**< The authentication was cancelled or failed */
+    AGENT_GLIB_ERROR_REJECTED   /**< Too many authentications were in progress to start it */
+} AgentGlibError;
+
+GQuark agent_glib_error_quark(void);
+
 GType agent_glib_get_type(void) G_GNUC_CONST;
 AgentGlib* agent_glib_new(Agent* parent);
@@ -20,14 +20,23 @@
 #include "agent.h"
 #include "agent-glib.h"
 
+#include <chrono>
 #include <utility>
 
+/** How long shutting down waits for replies to go out */
+static const std::chrono::milliseconds SHUTDOWN_DRAIN_TIME{500};
+/** Most jobs shutting down will run while waiting for them */
+static const unsigned int SHUTDOWN_DRAIN_JOBS = 1024;
+
 /* Initialize variables, but also register the interface with DBus which
    makes us ready to start getting messages */
 Agent::Agent(const std::shared_ptr<AuthManager>& authmanager)
     : _authmanager(authmanager)
     , _thread()
+    , _cookies(authmanager->registry())
 {
+    _thread.setName("agent");
+
     std::tie(_glib,
              _agentRegistration) = _thread.executeOnThread<std::pair<std::shared_ptr<AgentGlib>, gpointer>>([this]() {
         /* Get a session */
@@ -72,10 +81,9 @@ Agent::~Agent()
 {
     g_debug("Destroying PolicyKit Agent");
     _thread.executeOnThread<bool>([this]() {
-        while (!cancellables.empty())
+        for (auto& handle : cancellables.handles())
         {
-            auto handle = cancellables.begin()->first;
-            _authmanager->cancelAuthentication(handle);
+            _authmanager->cancelAuthenticationAsync(handle).get();
             unregisterCancellable(handle);
         }
 
@@ -83,6 +91,14 @@ Agent::~Agent()
 
         return true;
     });
+
+    /* The cancels above queue their callbacks on our thread, let them
+       run before the cancellables go away. */
+    auto result = _thread.runQueuedJobs(std::chrono::steady_clock::now() + SHUTDOWN_DRAIN_TIME, SHUTDOWN_DRAIN_JOBS);
+    if (result.starved())
+    {
+        g_warning("PolicyKit Agent shutting down with %d replies not sent", int(result.totalJobsLeft()));
+    }
 }
 
 /** This is where an auth request comes to us from PolicyKit. Here we handle
@@ -101,56 +117,120 @@ void Agent::authRequest(const std::string& action_id,
                         const std::string& message,
                         const std::string& icon_name,
                         const std::string& cookie,
-                        const std::list<std::string>& identities,
+                        const std::list<Identity>& identities,
                         const std::shared_ptr<GCancellable>& cancellable,
                         const std::function<void(Authentication::State)>& callback)
 {
-    gulong connecthandle = 0;
-    if (cancellable)
+    /* From here on the cookie is only referred to by its handle */
+    auto handle = _cookies->intern(cookie);
+    auto entry = cancellables.insert(handle);
+
+    /* A duplicate gets the same handle as the request that is already
+       tracking the cookie, everything under it belongs to that one */
+    bool owned = entry != nullptr;
+    if (owned)
+    {
+        gulong connecthandle = 0;
+        if (cancellable)
+        {
+            auto pair = new std::pair<Agent*, CookieRegistry::Handle>(this, handle);
+            connecthandle = g_cancellable_connect(cancellable.get(), G_CALLBACK(cancelStatic), pair, cancelCleanup);
+        }
+
+        g_debug("Saving cancellable: %s", cookie.c_str());
+        *entry = std::make_pair(cancellable, connecthandle);
+    }
+
+    /* We don't wait for the authentication to be built, if that
+       fails we'll hear about it on our thread from the future. */
+    auto creating = _authmanager->createAuthenticationAsync(
+        action_id, message, icon_name, handle, identities, [this, handle, owned, callback](Authentication::State state) {
+            /* When we handle the callback we need to ensure
+               that it happens on the same thread that it came
+               from, which is this one. Urgent so that PolicyKit
+               hears about it ahead of any new requests. */
+            _thread.executeOnThread(
+                [this, handle, owned, callback, state]() {
+                    if (owned)
+                    {
+                        unregisterCancellable(handle);
+                    }
+                    callback(state);
+                },
+                GLib::Priority::URGENT);
+        });
+
+    if (!owned)
     {
-        auto pair = new std::pair<Agent*, std::string>(this, cookie);
-        connecthandle = g_cancellable_connect(cancellable.get(), G_CALLBACK(cancelStatic), pair, cancelCleanup);
+        /* The auth manager has its own reference if it wants one, and
+           it will turn the duplicate down */
+        _cookies->release(handle);
     }
 
-    g_debug("Saving cancellable: %s", cookie.c_str());
-    cancellables.emplace(cookie, std::make_pair(cancellable, connecthandle));
-
-    _authmanager->createAuthentication(action_id, message, icon_name, cookie, identities,
-                                       [this, cookie, callback](Authentication::State state) {
-                                           _thread.executeOnThread<bool>([this, cookie, callback, state]() {
-                                               /* When we handle the callback we need to ensure
-                                                  that it happens on the same thread that it came
-                                                  from, which is this one. */
-                                               unregisterCancellable(cookie);
-                                               callback(state);
-                                               return true;
-                                           });
-                                       });
+    creating.then(_thread, [this, handle, owned, cookie, callback](GLib::Future<std::string> created) {
+        auto state = Authentication::State::CANCELLED;
+        try
+        {
+            created.get();
+            return true;
+        }
+        catch (AuthManager::RejectedError& e)
+        {
+            g_warning("Authentication '%s' turned away: %s", cookie.c_str(), e.what());
+            state = Authentication::State::REJECTED;
+        }
+        catch (std::runtime_error& e)
+        {
+            g_warning("Unable to create authentication '%s': %s", cookie.c_str(), e.what());
+        }
+
+        /* Only report if the authentication didn't get far enough to
+           report on its own, a duplicate never does */
+        if (!owned)
+        {
+            callback(state);
+        }
+        else if (cancellables.find(handle) != nullptr)
+        {
+            unregisterCancellable(handle);
+            callback(state);
+        }
+        return true;
+    });
 }
 
 /** Static function to do the cancel */
 void Agent::cancelStatic(GCancellable* cancel, gpointer user_data)
 {
-    auto pair = static_cast<std::pair<Agent*, std::string>*>(user_data);
-    pair->first->_authmanager->cancelAuthentication(pair->second);
+    auto pair = static_cast<std::pair<Agent*, CookieRegistry::Handle>*>(user_data);
+    auto agent = pair->first;
+    /* No need to wait, the callback will tell us when it's done */
+    agent->_authmanager->cancelAuthenticationAsync(pair->second);
 }
 
 /** Static function to clean up the data needed for cancelling */
 void Agent::cancelCleanup(gpointer data)
 {
-    auto pair = static_cast<std::pair<Agent*, std::string>*>(data);
+    auto pair = static_cast<std::pair<Agent*, CookieRegistry::Handle>*>(data);
     delete pair;
 }
 
+/** Queueing statistics for the thread the agent runs on */
+GLib::ContextThread::Stats Agent::threadStats() const
+{
+    return _thread.stats();
+}
+
 /** Disconnect from the g_cancellable */
-void Agent::unregisterCancellable(const std::string& handle)
+void Agent::unregisterCancellable(const CookieRegistry::Handle& handle)
 {
-    g_debug("Unregistering cancellable authorization: %s", handle.c_str());
+    g_debug("Unregistering cancellable authorization: %u", (unsigned int)handle.index);
     auto cancel = cancellables.find(handle);
-    if (cancel == cancellables.end())
+    if (cancel == nullptr)
     {
         return;
     }
-    g_cancellable_disconnect(cancel->second.first.get(), cancel->second.second);
-    cancellables.erase(cancel);
+    g_cancellable_disconnect(cancel->first.get(), cancel->second);
+    cancellables.erase(handle);
+    _cookies->release(handle);
 }
@@ -21,6 +21,7 @@
 
 #include "auth-manager.h"
 #include "authentication.h"
+#include "cookie-registry.h"
 #include "glib-thread.h"
 
 #include <functional>
@@ -59,10 +60,12 @@ public:
                      const std::string& message,
                      const std::string& icon_name,
                      const std::string& cookie,
-                     const std::list<std::string>& identities,
+                     const std::list<Identity>& identities,
                      const std::shared_ptr<GCancellable>& cancellable,
                      const std::function<void(Authentication::State)>& callback);
 
+    GLib::ContextThread::Stats threadStats() const;
+
 private:
     /** Auth manager used to create authorization UI's */
     std::shared_ptr<AuthManager> _authmanager;
@@ -74,11 +77,13 @@ private:
     /** Handle returned by libpolicykit to track our registration */
     gpointer _agentRegistration;
 
+    /** Cookies shared with the auth manager */
+    std::shared_ptr<CookieRegistry> _cookies;
     /** All the cancellable objects we're tracking indexed by the
         cookie that they were associated with. */
-    std::map<std::string, std::pair<std::shared_ptr<GCancellable>, gulong>> cancellables;
+    CookieRegistry::Table<std::pair<std::shared_ptr<GCancellable>, gulong>> cancellables;
 
-    void unregisterCancellable(const std::string& handle);
+    void unregisterCancellable(const CookieRegistry::Handle& handle);
 
     static void cancelStatic(GCancellable* cancel, gpointer user_data);
     static void cancelCleanup(gpointer data);
@@ -20,10 +20,43 @@
 #include "auth-manager.h"
 #include "authentication.h"
 
+#include <algorithm>
+#include <thread>
+
 #include <libnotify/notify.h>
 
-AuthManager::AuthManager()
+const unsigned int AuthManager::DEFAULT_MAX_IN_FLIGHT;
+const unsigned int AuthManager::DEFAULT_MAX_QUEUED;
+
+/** How long shutting down waits for authentications to cancel */
+static const std::chrono::milliseconds SHUTDOWN_DRAIN_TIME{500};
+/** Most jobs shutting down will run while waiting for them */
+static const unsigned int SHUTDOWN_DRAIN_JOBS = 1024;
+
+/** Sets up libnotify and the threads for the Authentications
+    \param threads Number of threads to spread Authentications across,
+        zero picks one based on the number of cores
+*/
+AuthManager::AuthManager(unsigned int threads)
+    : cookies(std::make_shared<CookieRegistry>())
+    , pool(threads)
 {
+    admission.maxInFlight = DEFAULT_MAX_IN_FLIGHT;
+    admission.maxQueued = DEFAULT_MAX_QUEUED;
+
+    thread.setName("auth-manager");
+
+    /* The bus comes up in the background, requests wait in the queue
+       until it has */
+    sessionBus = thread.executeOnThread<std::shared_ptr<SessionBus>>(
+        [this]() { return SessionBus::create([this]() { admitWaiting(); }); });
+
+    for (unsigned int i = 0; i < pool.size(); i++)
+    {
+        pool[i].setName("authentication-" + std::to_string(i));
+        exportPools.push_back(ExportPool::create(sessionBus));
+    }
+
     auto success = thread.executeOnThread<bool>([]() {
         /* Initialize Libnotify */
         auto initsuccess = notify_init("unity8-policy-kit");
@@ -69,18 +102,71 @@ AuthManager::AuthManager()
 AuthManager::~AuthManager()
 {
     thread.executeOnThread<bool>([this]() {
+        auto deadline = std::chrono::steady_clock::now() + SHUTDOWN_DRAIN_TIME;
+        CookieRegistry::Table<bool> cancelled;
+        shuttingDown = true;
+
         /* Cancel our authentications */
         while (!in_flight.empty())
         {
-            /* Use a while because we modify the list internally */
-            cancelAuthentication((*in_flight.begin()).first);
-            thread.runQueuedJobs();
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                g_warning("Shutting down with %d authentications that didn't finish cancelling",
+                          int(in_flight.size()));
+                for (auto& handle : in_flight.handles())
+                {
+                    removeAuthentication(handle);
+                }
+                break;
+            }
+
+            for (auto& handle : in_flight.handles())
+            {
+                if (cancelled.insert(handle) != nullptr)
+                {
+                    try
+                    {
+                        cancelAuthenticationAsync(handle).get();
+                    }
+                    catch (std::runtime_error& e)
+                    {
+                        g_warning("Unable to cancel authentication '%s': %s", cookies->cookie(handle).c_str(),
+                                  e.what());
+                    }
+                }
+            }
+
+            /* The cancels queue their clean up back on this thread,
+               ones that are still being built may take a moment longer */
+            thread.runQueuedJobs(deadline, SHUTDOWN_DRAIN_JOBS);
+            if (!in_flight.empty())
+            {
+                std::this_thread::yield();
+            }
         }
 
+        /* Anything finishing from here on is torn down with us */
+        stopped = true;
+
         /* Uninitialize libnotify for the system */
         notify_uninit();
+
+        sessionBus.reset();
         return true;
     });
+
+    /* Idle exports have to be destroyed on the thread that built them.
+       Queued behind the Authentications being released, which are in
+       the background, so they're all gone once this returns. */
+    for (unsigned int i = 0; i < pool.size(); i++)
+    {
+        pool[i].executeOnThread<bool>(
+            [this, i]() {
+                exportPools[i].reset();
+                return true;
+            },
+            GLib::Priority::BACKGROUND);
+    }
 }
 
 /** \brief Starts an Authentication
@@ -91,65 +177,292 @@ AuthManager::~AuthManager()
         \param identities Identities that can be used to authenticate this action
         \param finishedCallback Function to call when the user has completed the authorization
 
-        Creates the authentication object on the notification thread
-        using the buildAuthentication function. It also creates a more
-        complex callback where, when the callback is called it also removes
-        this authentication from the in_flight map which is tracking
-        Authentication objects.
+        Blocking version of createAuthenticationAsync(), it waits
+        for the authentication object to be built and started.
 */
 std::string AuthManager::createAuthentication(const std::string& action_id,
                                               const std::string& message,
                                               const std::string& icon_name,
                                               const std::string& cookie,
-                                              const std::list<std::string>& identities,
+                                              const std::list<Identity>& identities,
                                               const std::function<void(Authentication::State)>& finishedCallback)
 {
-    return thread.executeOnThread<std::string>(
-        [this, &action_id, &message, &icon_name, &cookie, &identities, &finishedCallback]() {
-            /* Build the authentication object */
-            auto auth = buildAuthentication(
-                action_id, message, icon_name, cookie, identities,
-                [this, cookie, finishedCallback](Authentication::State state) {
-                    this->thread.timeout(
-                        std::chrono::hours{0},
-                        [this, cookie]() {
-                            auto entry = in_flight.find(cookie);
-
-                            if (entry == in_flight.end())
-                            {
-                                throw std::runtime_error("Handle for Authentication '" + cookie +
-                                                         "' isn't found in 'in_flight' authentication map");
-                            }
+    return createAuthenticationAsync(action_id, message, icon_name, cookie, identities, finishedCallback).get();
+}
 
-                            in_flight.erase(entry);
-                        });
+/** \brief Starts an Authentication without waiting for it
+        \param action_id Type of action from PolicyKit
+        \param message Message to show to the user
+        \param icon_name Icon to show with the notification
+        \param cookie Unique string to track the authentication
+        \param identities Identities that can be used to authenticate this action
+        \param finishedCallback Function to call when the user has completed the authorization
 
-                    /* Up the chain */
-                    finishedCallback(state);
-                });
+        A request asking the same question as one already in flight
+        joins it rather than getting its own Authentication. If there
+        are already too many authentications running the
+        request waits its turn in the queue, or if that is full it is
+        rejected with a RejectedError through the future. Once admitted
+        it picks the least busy thread in the pool and creates the
+        authentication object there using the buildAuthentication
+        function, the object stays on that thread for its lifetime. It
+        also creates a more complex callback where, when the callback is
+        called it also removes this authentication from the in_flight
+        table which is tracking Authentication objects. The cookie is
+        interned on the way in and everything after that uses its
+        handle.
 
-            /* Throw it in our queue */
-            in_flight[cookie] = auth;
+        Returns right away with a future for the handle, any errors
+        building the authentication are reported through the future.
+*/
+GLib::Future<std::string> AuthManager::createAuthenticationAsync(
+    const std::string& action_id,
+    const std::string& message,
+    const std::string& icon_name,
+    const std::string& cookie,
+    const std::list<Identity>& identities,
+    const std::function<void(Authentication::State)>& finishedCallback)
+{
+    auto handle = cookies->intern(cookie);
+    try
+    {
+        auto future = createAuthenticationAsync(action_id, message, icon_name, handle, identities, finishedCallback);
+        cookies->release(handle);
+        return future;
+    }
+    catch (...)
+    {
+        cookies->release(handle);
+        throw;
+    }
+}
+
+/** \brief Starts an Authentication for a cookie that is already interned
+        \param cookie Handle from registry(), the caller keeps its reference
+
+        The same as the version taking the cookie string, but the
+        cookie is never looked up again. The manager takes its own
+        reference on it.
+*/
+GLib::Future<std::string> AuthManager::createAuthenticationAsync(
+    const std::string& action_id,
+    const std::string& message,
+    const std::string& icon_name,
+    const CookieRegistry::Handle& cookie,
+    const std::list<Identity>& identities,
+    const std::function<void(Authentication::State)>& finishedCallback)
+{
+    Request request;
+    auto future = request.promise.getFuture();
+
+    if (!cookies->retain(cookie))
+    {
+        request.promise.setException(
+            std::make_exception_ptr(std::runtime_error("Authentication cookie is not in the registry")));
+        return future;
+    }
+
+    request.action_id = action_id;
+    request.message = message;
+    request.icon_name = icon_name;
+    /* The Authentication needs the string for PolicyKit */
+    request.cookie = cookies->cookie(cookie);
+    request.identities = identities;
+    request.finishedCallback = finishedCallback;
+
+    try
+    {
+        onThread(
+            [this, cookie, request = std::move(request)]() mutable {
+                if (in_flight.find(cookie) != nullptr)
+                {
+                    cookies->release(cookie);
+                    request.promise.setException(std::make_exception_ptr(
+                        std::runtime_error("Authentication '" + request.cookie + "' is already in flight")));
+                    return;
+                }
+
+                admit(cookie, std::move(request));
+            },
+            GLib::Priority::NORMAL);
+    }
+    catch (...)
+    {
+        cookies->release(cookie);
+        throw;
+    }
+
+    return future;
+}
+
+/** Requests with the same key can be answered by the same user */
+static std::string identityKey(const std::list<Identity>& identities)
+{
+    std::vector<std::string> sorted;
+    for (auto& identity : identities)
+    {
+        sorted.push_back(identity.toString());
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    std::string key;
+    for (auto& identity : sorted)
+    {
+        key += '\n';
+        key += identity;
+    }
+    return key;
+}
+
+/** Decides what happens to a request that isn't in in_flight yet: it
+    joins one that is asking the same question, starts, waits for a
+    slot or is rejected. Called on our thread holding a reference to
+    the cookie, which is given back if it is rejected. */
+void AuthManager::admit(const CookieRegistry::Handle& handle, Request request)
+{
+    auto batchKey = identityKey(request.identities);
+    auto key = request.action_id + batchKey;
+    auto group = groups.find(key);
+    if (group != groups.end())
+    {
+        joinGroup(handle, group->second, std::move(request));
+        return;
+    }
 
-            auth->start();
+    /* A different action, but the same person could answer it */
+    auto now = std::chrono::steady_clock::now();
+    auto batch = batches.find(batchKey);
+    if (batch != batches.end())
+    {
+        if (now - batch->second.opened < batchWindow)
+        {
+            admission.batched++;
+            joinGroup(handle, batch->second.leader, std::move(request));
+            return;
+        }
 
-            return cookie;
+        batches.erase(batch);
+    }
+
+    /* First come, first served, so nothing jumps the queue */
+    if (waitQueue.empty() && running() < admission.maxInFlight && sessionBus->connection())
+    {
+        admission.admitted++;
+        auto entry = in_flight.insert(handle);
+        entry->group = key;
+        groups[key] = handle;
+        openBatch(*entry, handle, batchKey, now);
+        startAuthentication(handle, std::move(request));
+        return;
+    }
+
+    if (waitQueue.size() < admission.maxQueued)
+    {
+        if (waitQueue.empty() && running() < admission.maxInFlight)
+        {
+            g_debug("Authentication '%s' waiting for the session bus", request.cookie.c_str());
+        }
+        else
+        {
+            g_debug("Authentication '%s' waiting behind %d others", request.cookie.c_str(), int(running()));
+            admission.queued++;
+        }
+        auto entry = in_flight.insert(handle);
+        entry->group = key;
+        entry->waiting.reset(new Request(std::move(request)));
+        groups[key] = handle;
+        openBatch(*entry, handle, batchKey, now);
+        waitQueue.push_back(handle);
+        return;
+    }
+
+    g_warning("Rejecting authentication '%s', %d are running and %d waiting", request.cookie.c_str(), int(running()),
+              int(waitQueue.size()));
+    admission.rejected++;
+    cookies->release(handle);
+    request.promise.setException(
+        std::make_exception_ptr(RejectedError("Too many authentications in progress to start '" + request.cookie + "'")));
+}
+
+/** Builds the Authentication for an admitted request, called on our
+    thread once it has been tracked in in_flight */
+void AuthManager::startAuthentication(const CookieRegistry::Handle& handle, Request request)
+{
+    /* Track it before it exists so that a cancel can find it */
+    auto home = &pool.acquire();
+    in_flight.find(handle)->home = home;
+
+    auto promise = request.promise;
+    try
+    {
+        home->executeOnThread([this, home, handle, policy = retryPolicy, helpers = helperPool,
+                               request = std::move(request)]() mutable {
+            try
+            {
+                auto finishedCallback = request.finishedCallback;
+
+                /* Build the authentication object */
+                auto auth = buildAuthentication(request.action_id, request.message, request.icon_name,
+                                                request.cookie, request.identities,
+                                                [this, handle, finishedCallback](Authentication::State state) {
+                                                    fromPool([this, handle]() { removeAuthentication(handle); });
+
+                                                    /* Up the chain */
+                                                    finishedCallback(state);
+                                                });
+
+                /* Queued before starting so it is tracked before
+                   anything it does can remove it */
+                fromPool([this, handle, auth, home]() { attachAuthentication(handle, auth, home); });
+
+                auth->setRetryPolicy(policy);
+                auth->setHelperPool(helpers);
+                auth->start();
+
+                request.promise.setValue(request.cookie);
+            }
+            catch (...)
+            {
+                fromPool([this, handle]() { removeAuthentication(handle); });
+                request.promise.setException(std::current_exception());
+            }
         });
+    }
+    catch (...)
+    {
+        auto pending = closeGroup(handle);
+        in_flight.erase(handle);
+        cookies->release(handle);
+        pool.release(*home);
+        promise.setException(std::current_exception());
+        restartFollowers(pending);
+    }
 }
 
 /** The actual call to create the object, split out so that it can
-    be replaced in the test suite with a mock. */
+    be replaced in the test suite with a mock. Runs on the thread the
+    Authentication lives on and leases its exports from that thread's
+    pool. */
 std::shared_ptr<Authentication> AuthManager::buildAuthentication(
     const std::string& action_id,
     const std::string& message,
     const std::string& icon_name,
     const std::string& cookie,
-    const std::list<std::string>& identities,
+    const std::list<Identity>& identities,
     const std::function<void(Authentication::State)>& finishedCallback)
 {
-    return std::make_shared<Authentication>(
+    std::shared_ptr<ExportSlot> exports;
+    for (unsigned int i = 0; i < pool.size(); i++)
+    {
+        if (pool[i].isCurrentThread())
+        {
+            exports = exportPools[i]->lease();
+            break;
+        }
+    }
 
-        action_id, message, icon_name, cookie, identities, finishedCallback);
+    return std::make_shared<Authentication>(action_id, message, icon_name, cookie, identities, finishedCallback,
+                                            exports);
 }
 
 /** Cancels an Authentication that is currently running.
@@ -157,18 +470,579 @@ std::shared_ptr<Authentication> AuthManager::buildAuthentication(
 */
 bool AuthManager::cancelAuthentication(const std::string& handle)
 {
-    return thread.executeOnThread<bool>([this, &handle]() {
-        auto entry = in_flight.find(handle);
-        if (entry == in_flight.end())
+    return cancelAuthenticationAsync(handle).get();
+}
+
+/** Cancels an Authentication that is currently running without waiting
+    for the cancel to happen.
+    \param handle the handle of the Authentication object
+    \return Future that says whether the Authentication was found, ready
+        once the Authentication has been cancelled on its thread
+*/
+GLib::Future<bool> AuthManager::cancelAuthenticationAsync(const std::string& handle)
+{
+    return cancelAuthenticationAsync(cookies->find(handle));
+}
+
+/** Cancels an Authentication by the handle of its cookie, which
+    finds it without looking at the string.
+    \param handle Handle of the cookie from registry()
+    \return Future that says whether the Authentication was found, ready
+        once the Authentication has been cancelled on its thread
+*/
+GLib::Future<bool> AuthManager::cancelAuthenticationAsync(const CookieRegistry::Handle& handle)
+{
+    GLib::Promise<bool> promise;
+    auto future = promise.getFuture();
+
+    /* Urgent so that the notification goes away without waiting
+       behind any new authentications that are being built */
+    onThread(
+        [this, handle, promise]() mutable {
+            auto entry = in_flight.find(handle);
+            if (entry == nullptr)
+            {
+                g_debug("Unable to find authentication %u to cancel", (unsigned int)handle.index);
+                promise.setValue(false);
+                return;
+            }
+
+            if (entry->leader.valid())
+            {
+                /* Joined another, so only it leaves */
+                if (entry->joining)
+                {
+                    finishFollower(handle);
+                    promise.setValue(true);
+                    return;
+                }
+
+                entry->cancelRequested = true;
+                auto leader = in_flight.find(entry->leader);
+                if (leader == nullptr || !leader->auth)
+                {
+                    promise.setValue(true);
+                    return;
+                }
+
+                try
+                {
+                    auto auth = leader->auth;
+                    leader->home->executeOnThread(
+                        [auth, cookie = cookies->cookie(handle), promise]() mutable {
+                            try
+                            {
+                                auth->leave(cookie);
+                                promise.setValue(true);
+                            }
+                            catch (...)
+                            {
+                                promise.setException(std::current_exception());
+                            }
+                        },
+                        GLib::Priority::URGENT);
+                }
+                catch (...)
+                {
+                    promise.setException(std::current_exception());
+                }
+                return;
+            }
+
+            if (entry->waiting)
+            {
+                /* Never started, so it can be answered right here */
+                dropWaiting(handle);
+                promise.setValue(true);
+                return;
+            }
+
+            if (!entry->auth)
+            {
+                /* Still being built, it'll get cancelled when it's attached */
+                entry->cancelRequested = true;
+                promise.setValue(true);
+                return;
+            }
+
+            try
+            {
+                auto auth = entry->auth;
+                entry->home->executeOnThread(
+                    [auth, promise]() mutable {
+                        try
+                        {
+                            /* This should change the state which will cause it to be
+                               dropped from the in_flight table */
+                            auth->cancel();
+                            promise.setValue(true);
+                        }
+                        catch (...)
+                        {
+                            promise.setException(std::current_exception());
+                        }
+                    },
+                    GLib::Priority::URGENT);
+            }
+            catch (...)
+            {
+                promise.setException(std::current_exception());
+            }
+        },
+        GLib::Priority::URGENT);
+
+    return future;
+}
+
+/** Queueing statistics for the thread the Authentications run on */
+GLib::ContextThread::Stats AuthManager::threadStats() const
+{
+    return thread.stats();
+}
+
+/** Queueing statistics for each of the threads the Authentications
+    are spread across */
+std::vector<GLib::ContextThread::Stats> AuthManager::poolStats() const
+{
+    return pool.stats();
+}
+
+/** The cookies of the Authentications, the Agent tracks its side of
+    them with the same handles */
+std::shared_ptr<CookieRegistry> AuthManager::registry() const
+{
+    return cookies;
+}
+
+/** Changes the limits on how many authentications can run and wait
+    at once, it doesn't affect ones that are already running or waiting.
+    \param maxInFlight Most authentications to run at once, at least one
+        is always allowed
+    \param maxQueued Most requests to keep waiting before rejecting them
+*/
+void AuthManager::setAdmissionLimits(unsigned int maxInFlight, unsigned int maxQueued)
+{
+    thread.executeOnThread<bool>([this, maxInFlight, maxQueued]() {
+        admission.maxInFlight = std::max(1u, maxInFlight);
+        admission.maxQueued = maxQueued;
+
+        /* There may be room now */
+        admitWaiting();
+        return true;
+    });
+}
+
+/** Snapshot of the admission counters */
+AuthManager::AdmissionStats AuthManager::admissionStats()
+{
+    return thread.executeOnThread<AdmissionStats>([this]() {
+        auto stats = admission;
+        stats.running = running();
+        stats.waiting = waitQueue.size();
+        return stats;
+    });
+}
+
+/** Turns on batching, requests for different actions with the same
+    identities as one that started less than \p window ago join it.
+    \param window How long a batch stays open, zero turns batching off
+*/
+void AuthManager::setBatchWindow(const std::chrono::milliseconds& window)
+{
+    thread.executeOnThread<bool>([this, window]() {
+        batchWindow = window;
+        if (window.count() <= 0)
         {
-            g_debug("Unable to find authentication '%s' to cancel", handle.c_str());
-            return false;
+            batches.clear();
         }
+        return true;
+    });
+}
 
-        /* This should change the state which will cause it to be
-           dropped from the in_flight map */
-        (*entry).second->cancel();
+/** Sets how failed attempts are retried for authentications started
+    from now on, ones already running keep the policy they have */
+void AuthManager::setRetryPolicy(const Authentication::RetryPolicy& policy)
+{
+    thread.executeOnThread<bool>([this, policy]() {
+        retryPolicy = policy;
+        return true;
+    });
+}
 
+/** Has authentications started from now on use helpers from \p pool,
+    nullptr to go back to PolkitAgentSession */
+void AuthManager::setHelperPool(const std::shared_ptr<HelperPool>& pool)
+{
+    thread.executeOnThread<bool>([this, pool]() {
+        helperPool = pool;
         return true;
     });
 }
+
+/** Makes \p entry the one that later requests for other actions
+    with the same identities join, if batching */
+void AuthManager::openBatch(InFlight& entry,
+                            const CookieRegistry::Handle& handle,
+                            const std::string& key,
+                            const std::chrono::steady_clock::time_point& now)
+{
+    if (batchWindow.count() <= 0)
+    {
+        return;
+    }
+
+    entry.batch = key;
+    batches[key] = Batch{handle, now};
+}
+
+/** Number of authentications that have been admitted and not removed */
+unsigned int AuthManager::running() const
+{
+    return in_flight.size() - waitQueue.size() - followers;
+}
+
+/** Starts waiting requests, oldest first, while there's room */
+void AuthManager::admitWaiting()
+{
+    while (!shuttingDown && !waitQueue.empty() && running() < admission.maxInFlight && sessionBus->connection())
+    {
+        auto handle = waitQueue.front();
+        waitQueue.pop_front();
+
+        auto request = std::move(in_flight.find(handle)->waiting);
+        g_debug("Admitting authentication '%s'", request->cookie.c_str());
+        admission.admitted++;
+        startAuthentication(handle, std::move(*request));
+    }
+}
+
+/** Drops a request that is still waiting to be admitted, it finishes
+    as cancelled without ever having been started */
+void AuthManager::dropWaiting(const CookieRegistry::Handle& handle)
+{
+    auto request = std::move(in_flight.find(handle)->waiting);
+    auto pending = closeGroup(handle);
+    waitQueue.erase(std::find(waitQueue.begin(), waitQueue.end(), handle));
+    in_flight.erase(handle);
+    cookies->release(handle);
+
+    request->finishedCallback(Authentication::State::CANCELLED);
+    request->promise.setValue(request->cookie);
+
+    restartFollowers(pending);
+}
+
+/** Adds a request to the group led by \p leader, it is handed to the
+    leader's Authentication as soon as that exists */
+void AuthManager::joinGroup(const CookieRegistry::Handle& handle,
+                            const CookieRegistry::Handle& leader,
+                            Request request)
+{
+    g_debug("Authentication '%s' joining one already in flight", request.cookie.c_str());
+    admission.coalesced++;
+    followers++;
+
+    auto entry = in_flight.insert(handle);
+    entry->leader = leader;
+    entry->joining.reset(new Request(std::move(request)));
+
+    auto lead = in_flight.find(leader);
+    if (lead->auth)
+    {
+        attachFollower(handle);
+    }
+    else
+    {
+        lead->pending.push_back(handle);
+    }
+}
+
+/** Hands a follower to its leader's Authentication, on the leader's
+    thread. If the leader finished before it got there the follower is
+    started again on its own. */
+void AuthManager::attachFollower(const CookieRegistry::Handle& handle)
+{
+    auto entry = in_flight.find(handle);
+    auto leader = in_flight.find(entry->leader);
+    auto auth = leader->auth;
+    auto request = std::move(entry->joining);
+    auto promise = request->promise;
+
+    try
+    {
+        leader->home->executeOnThread(
+            [this, handle, auth, request = std::move(request)]() mutable {
+                auto finishedCallback = request->finishedCallback;
+                auto joined = auth->join(request->cookie, request->action_id, request->message,
+                                         [this, handle, finishedCallback](Authentication::State state) {
+                                             fromPool([this, handle]() { removeAuthentication(handle); });
+
+                                             /* Up the chain */
+                                             finishedCallback(state);
+                                         });
+
+                if (joined)
+                {
+                    request->promise.setValue(request->cookie);
+                    return;
+                }
+
+                if (stopped)
+                {
+                    request->finishedCallback(Authentication::State::CANCELLED);
+                    request->promise.setValue(request->cookie);
+                    return;
+                }
+
+                fromPool([this, handle, request = std::move(request)]() mutable {
+                    restartFollower(handle, std::move(*request));
+                });
+            },
+            GLib::Priority::URGENT);
+    }
+    catch (...)
+    {
+        finishFollower(handle);
+        promise.setException(std::current_exception());
+    }
+}
+
+/** A follower that couldn't join its leader goes back through
+    admission, unless it was cancelled on the way. The leader can't
+    take anyone else either, so it stops being joined first. */
+void AuthManager::restartFollower(const CookieRegistry::Handle& handle, Request request)
+{
+    auto entry = in_flight.find(handle);
+    if (entry == nullptr)
+    {
+        request.finishedCallback(Authentication::State::CANCELLED);
+        request.promise.setValue(request.cookie);
+        return;
+    }
+
+    std::vector<CookieRegistry::Handle> pending;
+    if (in_flight.find(entry->leader) != nullptr)
+    {
+        pending = closeGroup(entry->leader);
+    }
+
+    auto cancelled = entry->cancelRequested || shuttingDown;
+    in_flight.erase(handle);
+    followers--;
+
+    if (cancelled)
+    {
+        cookies->release(handle);
+        request.finishedCallback(Authentication::State::CANCELLED);
+        request.promise.setValue(request.cookie);
+        restartFollowers(pending);
+        return;
+    }
+
+    g_debug("Authentication '%s' missed the one it joined, starting again", request.cookie.c_str());
+    admit(handle, std::move(request));
+    restartFollowers(pending);
+}
+
+/** Restarts the followers that were still waiting on a leader that
+    went away */
+void AuthManager::restartFollowers(const std::vector<CookieRegistry::Handle>& pending)
+{
+    for (auto& handle : pending)
+    {
+        auto entry = in_flight.find(handle);
+        if (entry == nullptr || !entry->joining)
+        {
+            continue;
+        }
+
+        auto request = std::move(entry->joining);
+        restartFollower(handle, std::move(*request));
+    }
+}
+
+/** Drops a follower from in_flight, if it was never handed to the
+    leader it finishes as cancelled */
+void AuthManager::finishFollower(const CookieRegistry::Handle& handle)
+{
+    auto entry = in_flight.find(handle);
+    auto request = std::move(entry->joining);
+
+    auto leader = in_flight.find(entry->leader);
+    if (leader != nullptr)
+    {
+        leader->pending.erase(std::remove(leader->pending.begin(), leader->pending.end(), handle),
+                              leader->pending.end());
+    }
+
+    in_flight.erase(handle);
+    cookies->release(handle);
+    followers--;
+
+    if (request)
+    {
+        request->finishedCallback(Authentication::State::CANCELLED);
+        request->promise.setValue(request->cookie);
+    }
+}
+
+/** Stops new requests from joining \p handle
+    \return Followers that were waiting for its Authentication
+*/
+std::vector<CookieRegistry::Handle> AuthManager::closeGroup(const CookieRegistry::Handle& handle)
+{
+    auto entry = in_flight.find(handle);
+
+    auto group = groups.find(entry->group);
+    if (group != groups.end() && group->second == handle)
+    {
+        groups.erase(group);
+    }
+
+    auto batch = batches.find(entry->batch);
+    if (batch != batches.end() && batch->second.leader == handle)
+    {
+        batches.erase(batch);
+    }
+
+    std::vector<CookieRegistry::Handle> pending;
+    pending.swap(entry->pending);
+    return pending;
+}
+
+/** Run \p work on our thread, right away if we're already on it */
+void AuthManager::onThread(GLib::Job work, GLib::Priority priority)
+{
+    if (thread.isCurrentThread())
+    {
+        work();
+        return;
+    }
+
+    thread.executeOnThread(std::move(work), priority);
+}
+
+/** Hands \p work from a pool thread to ours. Once shutting down is
+    done with our thread there is nothing left for it to update, so
+    it is dropped rather than queued behind the teardown. */
+void AuthManager::fromPool(GLib::Job work)
+{
+    if (stopped)
+    {
+        return;
+    }
+
+    try
+    {
+        thread.executeOnThread(
+            [this, work = std::move(work)]() mutable {
+                if (!stopped)
+                {
+                    work();
+                }
+            },
+            GLib::Priority::URGENT);
+    }
+    catch (std::runtime_error& e)
+    {
+        g_warning("Dropping bookkeeping while shutting down: %s", e.what());
+    }
+}
+
+/** Records the Authentication once it has been built on its thread,
+    on our thread. If it was cancelled while being built the cancel is
+    passed along now. */
+void AuthManager::attachAuthentication(const CookieRegistry::Handle& handle,
+                                       const std::shared_ptr<Authentication>& auth,
+                                       GLib::ContextThread* home)
+{
+    auto entry = in_flight.find(handle);
+    if (entry == nullptr || entry->home != home || entry->auth)
+    {
+        /* Dropped while it was being built, it has to be freed on its thread */
+        InFlight orphan;
+        orphan.auth = auth;
+        orphan.home = home;
+        releaseAuthentication(orphan, false);
+        return;
+    }
+
+    entry->auth = auth;
+
+    if (entry->cancelRequested)
+    {
+        home->executeOnThread([auth]() { auth->cancel(); }, GLib::Priority::URGENT);
+    }
+
+    /* Anyone that joined while it was being built */
+    std::vector<CookieRegistry::Handle> pending;
+    pending.swap(entry->pending);
+    for (auto& follower : pending)
+    {
+        attachFollower(follower);
+    }
+}
+
+/** Drops an Authentication from the in_flight table and gives back
+    its cookie, called on our thread */
+void AuthManager::removeAuthentication(const CookieRegistry::Handle& handle)
+{
+    auto entry = in_flight.find(handle);
+
+    if (entry == nullptr)
+    {
+        /* Already gone, it may have been dropped while shutting down */
+        g_debug("Handle for Authentication '%u' isn't found in 'in_flight' authentication table",
+                (unsigned int)handle.index);
+        return;
+    }
+
+    if (entry->leader.valid())
+    {
+        finishFollower(handle);
+        return;
+    }
+
+    if (entry->waiting)
+    {
+        dropWaiting(handle);
+        return;
+    }
+
+    auto pending = closeGroup(handle);
+    releaseAuthentication(*entry);
+    in_flight.erase(handle);
+    cookies->release(handle);
+
+    /* Its slot can go to the next one in line */
+    admitWaiting();
+    restartFollowers(pending);
+}
+
+/** Gives back the Authentication's spot in the pool and lets go of it
+    on its own thread, where its GObjects belong
+    \param entry Authentication to release
+    \param pinned Whether it still holds a spot in the pool
+*/
+void AuthManager::releaseAuthentication(InFlight& entry, bool pinned)
+{
+    if (pinned)
+    {
+        pool.release(*entry.home);
+    }
+
+    if (!entry.auth)
+    {
+        return;
+    }
+
+    try
+    {
+        entry.home->executeOnThread([auth = std::move(entry.auth)]() mutable { auth.reset(); },
+                                    GLib::Priority::BACKGROUND);
+    }
+    catch (std::runtime_error& e)
+    {
+        g_warning("Releasing authentication off of its thread: %s", e.what());
+    }
+}
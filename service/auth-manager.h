@@ -19,14 +19,25 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <list>
 #include <map>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "authentication.h"
+#include "cookie-registry.h"
+#include "export-pool.h"
+#include "glib-thread-pool.h"
 #include "glib-thread.h"
+#include "session-bus.h"
 
 /** \brief Class that tracks all the various Authentications that can be
                 in-flight at a given time and gives them a thread to work on.
@@ -34,8 +45,25 @@
         The authentication manager is mostly a tracker and factory class for
         Authentication objects. When an authentication is requested it creates
         the object and keeps track of it until it either completes the
-        authentication or is cancelled. It also keeps a GLib mainloop around
-        that the authentication objects can all use.
+        authentication or is cancelled. It also keeps a pool of GLib mainloops
+        around that the authentication objects are spread across, each one
+        staying on the thread it was built on.
+
+        Only so many authentications are allowed to exist at once, as each
+        one has a helper process, D-Bus exports and maybe a notification.
+        Requests past that limit wait in a bounded FIFO queue for one to
+        finish, and once the queue is full new requests are rejected with
+        a RejectedError. The session bus connection is made in the
+        background when the manager starts, and remade if it closes, and
+        requests wait in the same queue while it isn't connected.
+
+        Requests for the same action and set of identities as one that is
+        already in flight join it rather than getting their own, so the
+        user is only asked once and their answer is used for each of them.
+        Joined requests don't count against the limits. Optionally requests
+        for other actions with the same identities that come in within a
+        short batching window join the first one too, so that a burst from
+        something like a package install is a single prompt.
 
         For bookkeeping purposes this class is also the one that initializes
         and uninitializes libnotify and makes sure the notification server
@@ -44,29 +72,176 @@
 class AuthManager
 {
 public:
-    AuthManager();
+    /** Reported through the future when a request is turned away
+        because too many are already waiting */
+    class RejectedError : public std::runtime_error
+    {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    /** Counters for the admission control, the totals are since the
+        AuthManager was created */
+    struct AdmissionStats
+    {
+        std::uint64_t admitted = 0;   /**< Requests that were started */
+        std::uint64_t queued = 0;     /**< Requests that had to wait for room to be started */
+        std::uint64_t rejected = 0;   /**< Requests turned away with the queue full */
+        std::uint64_t coalesced = 0;  /**< Requests that joined one already in flight */
+        std::uint64_t batched = 0;    /**< Of those, ones for a different action in the batching window */
+        unsigned int running = 0;     /**< Authentications that are currently started */
+        unsigned int waiting = 0;     /**< Requests currently in the queue */
+        unsigned int maxInFlight = 0; /**< Limit on running authentications */
+        unsigned int maxQueued = 0;   /**< Limit on waiting requests */
+    };
+
+    /** Default limit on running authentications */
+    static const unsigned int DEFAULT_MAX_IN_FLIGHT = 16;
+    /** Default limit on requests waiting to be started */
+    static const unsigned int DEFAULT_MAX_QUEUED = 32;
+
+    explicit AuthManager(unsigned int threads = 0);
     virtual ~AuthManager();
 
     virtual std::string createAuthentication(const std::string& action_id,
                                              const std::string& message,
                                              const std::string& icon_name,
                                              const std::string& cookie,
-                                             const std::list<std::string>& identities,
+                                             const std::list<Identity>& identities,
                                              const std::function<void(Authentication::State)>& finishedCallback);
     virtual bool cancelAuthentication(const std::string& handle);
 
+    GLib::Future<std::string> createAuthenticationAsync(
+        const std::string& action_id,
+        const std::string& message,
+        const std::string& icon_name,
+        const std::string& cookie,
+        const std::list<Identity>& identities,
+        const std::function<void(Authentication::State)>& finishedCallback);
+    GLib::Future<bool> cancelAuthenticationAsync(const std::string& handle);
+
+    virtual GLib::Future<std::string> createAuthenticationAsync(
+        const std::string& action_id,
+        const std::string& message,
+        const std::string& icon_name,
+        const CookieRegistry::Handle& cookie,
+        const std::list<Identity>& identities,
+        const std::function<void(Authentication::State)>& finishedCallback);
+    virtual GLib::Future<bool> cancelAuthenticationAsync(const CookieRegistry::Handle& handle);
+
+    GLib::ContextThread::Stats threadStats() const;
+    std::vector<GLib::ContextThread::Stats> poolStats() const;
+
+    std::shared_ptr<CookieRegistry> registry() const;
+
+    void setAdmissionLimits(unsigned int maxInFlight, unsigned int maxQueued);
+    AdmissionStats admissionStats();
+
+    void setBatchWindow(const std::chrono::milliseconds& window);
+
+    void setRetryPolicy(const Authentication::RetryPolicy& policy);
+    void setHelperPool(const std::shared_ptr<HelperPool>& pool);
+
 protected:
     virtual std::shared_ptr<Authentication> buildAuthentication(
         const std::string& action_id,
         const std::string& message,
         const std::string& icon_name,
         const std::string& cookie,
-        const std::list<std::string>& identities,
+        const std::list<Identity>& identities,
         const std::function<void(Authentication::State)>& finishedCallback);
 
 private:
-    /** All of the Authentication objects that currently exist */
-    std::map<std::string, std::shared_ptr<Authentication>> in_flight;
-    /** GLib thread for authentications */
+    /** Everything needed to build an Authentication */
+    struct Request
+    {
+        std::string action_id;
+        std::string message;
+        std::string icon_name;
+        std::string cookie;
+        std::list<Identity> identities;
+        std::function<void(Authentication::State)> finishedCallback;
+        GLib::Promise<std::string> promise;
+    };
+
+    /** An Authentication and the thread it is pinned to */
+    struct InFlight
+    {
+        std::shared_ptr<Authentication> auth; /**< nullptr while it is being built */
+        GLib::ContextThread* home = nullptr;  /**< Thread from the pool it lives on */
+        bool cancelRequested = false;         /**< Cancelled before it was built */
+        std::unique_ptr<Request> waiting;     /**< Set while it is waiting to be admitted */
+
+        std::string group;                           /**< Key of the group it leads, empty for followers */
+        std::string batch;                           /**< Key of the batch it leads, empty for followers */
+        CookieRegistry::Handle leader;               /**< Request it joined, invalid if it has its own */
+        std::unique_ptr<Request> joining;            /**< Set until it has been handed to the leader */
+        std::vector<CookieRegistry::Handle> pending; /**< Followers waiting for our Authentication to exist */
+    };
+
+    /** Cookies of the authentications, shared with the Agent */
+    std::shared_ptr<CookieRegistry> cookies;
+    /** All of the Authentication objects that currently exist, only
+        touched on our thread */
+    CookieRegistry::Table<InFlight> in_flight;
+    /** Requests waiting for a slot, oldest first */
+    std::deque<CookieRegistry::Handle> waitQueue;
+    /** Limits and counters, only touched on our thread */
+    AdmissionStats admission;
+    /** Set once we're going away so nothing else is started */
+    bool shuttingDown = false;
+    /** Set once shutting down is done with our thread, the pool
+        threads stop handing it work */
+    std::atomic<bool> stopped{false};
+    /** Leader of the requests for each action and identity set */
+    std::unordered_map<std::string, CookieRegistry::Handle> groups;
+    /** Entries in in_flight that joined another */
+    unsigned int followers = 0;
+
+    /** Leader of a batch and when it started taking other actions */
+    struct Batch
+    {
+        CookieRegistry::Handle leader;
+        std::chrono::steady_clock::time_point opened;
+    };
+    /** How long a batch takes other actions for, zero for not batching */
+    std::chrono::milliseconds batchWindow{0};
+    /** Open batches for each identity set */
+    std::unordered_map<std::string, Batch> batches;
+    /** Given to each Authentication as it is started */
+    Authentication::RetryPolicy retryPolicy;
+    /** Warm helpers for the Authentications, nullptr if they use PolkitAgentSession */
+    std::shared_ptr<HelperPool> helperPool;
+    /** GLib thread for the bookkeeping and libnotify, declared before
+        the pool so that it outlives anything the pool threads run */
     GLib::ContextThread thread;
+    /** GLib threads the authentications live on */
+    GLib::ContextThreadPool pool;
+    /** Session bus connection, shared by all the Authentications */
+    std::shared_ptr<SessionBus> sessionBus;
+    /** Exports for the Authentications, one pool for each thread in pool */
+    std::vector<std::shared_ptr<ExportPool>> exportPools;
+
+    void onThread(GLib::Job work, GLib::Priority priority);
+    void fromPool(GLib::Job work);
+    unsigned int running() const;
+    void admit(const CookieRegistry::Handle& handle, Request request);
+    void startAuthentication(const CookieRegistry::Handle& handle, Request request);
+    void joinGroup(const CookieRegistry::Handle& handle, const CookieRegistry::Handle& leader, Request request);
+    void attachFollower(const CookieRegistry::Handle& handle);
+    void restartFollower(const CookieRegistry::Handle& handle, Request request);
+    void restartFollowers(const std::vector<CookieRegistry::Handle>& pending);
+    void finishFollower(const CookieRegistry::Handle& handle);
+    std::vector<CookieRegistry::Handle> closeGroup(const CookieRegistry::Handle& handle);
+    void openBatch(InFlight& entry,
+                   const CookieRegistry::Handle& handle,
+                   const std::string& key,
+                   const std::chrono::steady_clock::time_point& now);
+    void admitWaiting();
+    void dropWaiting(const CookieRegistry::Handle& handle);
+    void attachAuthentication(const CookieRegistry::Handle& handle,
+                              const std::shared_ptr<Authentication>& auth,
+                              GLib::ContextThread* home);
+    void removeAuthentication(const CookieRegistry::Handle& handle);
+    void releaseAuthentication(InFlight& entry, bool pinned = true);
 };
@@ -18,10 +18,20 @@
  */
 
 #include "authentication.h"
+#include "helper-session.h"
 
 #include <glib/gi18n.h>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
-#include <regex>
+#include <iterator>
+
+const unsigned int Authentication::PREWARMED_IDENTITIES;
+
+/* Shared by every authentication */
+static GLib::Histogram retryLatency;
+static std::atomic<std::uint64_t> retryCount{0};
+static std::atomic<std::uint64_t> exhaustedCount{0};
 
 /* Make it so all our GObjects are easier to work with */
 template <typename T>
@@ -34,127 +44,378 @@ public:
     }
 };
 
-/* Handle errors into exceptions and make sure we free the
-   error as well */
-inline static void check_error(GError* error, const std::string& message)
+/* Initialize everything */
+Authentication::Authentication(const std::string& in_action_id,
+                               const std::string& in_message,
+                               const std::string& in_icon_name,
+                               const std::string& in_cookie,
+                               const std::list<Identity>& in_identities,
+                               const std::function<void(State)>& in_finishedCallback,
+                               const std::shared_ptr<ExportSlot>& in_exports)
+    : action_id(in_action_id)
+    , message(in_message)
+    , icon_name(in_icon_name)
+    , cookie(in_cookie)
+    , identities(in_identities)
+    , finishedCallback(in_finishedCallback)
+    , homeContext(g_main_context_ref_thread_default(), [](GMainContext* context) { g_main_context_unref(context); })
+    , alive(std::make_shared<Authentication*>(this))
 {
-    if (error == nullptr)
+    /* Exports come from the AuthManager's pool, which has already
+       connected to the bus so we don't have to */
+    exports = in_exports;
+    if (!exports)
     {
+        throw std::runtime_error("Authentication needs an export slot to put its menus on the bus");
+    }
+
+    sessionBus = exports->connection();
+    dbusPath = exports->path();
+    actions = exports->actions();
+    menus = exports->menus();
+}
+
+Authentication::~Authentication()
+{
+    /* This will cancel if we haven't already sent a
+       complete message to the creator */
+    cancel();
+    removeIdentityAction();
+}
+
+/** Calls \p method on the thread we were built on. If that is this
+    thread it is called right away, otherwise it is queued on our
+    context and dropped if we're destroyed before it runs. */
+void Authentication::invokeOnHome(void (Authentication::*method)())
+{
+    if (!homeContext || g_main_context_is_owner(homeContext.get()))
+    {
+        (this->*method)();
         return;
     }
-    auto fullmessage = message + ": " + error->message;
-    g_error_free(error);
-    throw std::runtime_error(fullmessage);
+
+    typedef std::pair<std::weak_ptr<Authentication*>, void (Authentication::*)()> Call;
+    g_main_context_invoke_full(homeContext.get(), G_PRIORITY_DEFAULT,
+                               [](gpointer user_data) -> gboolean {
+                                   auto call = static_cast<Call*>(user_data);
+                                   auto obj = call->first.lock();
+                                   if (obj)
+                                   {
+                                       ((*obj)->*(call->second))();
+                                   }
+                                   return G_SOURCE_REMOVE;
+                               },
+                               new Call(alive, method), [](gpointer user_data) { delete static_cast<Call*>(user_data); });
 }
 
-/* Static helpers for C callbacks */
-static void notification_closed(NotifyNotification* notification, gpointer user_data)
+/** Queues \p method to be called on our context when \p source
+    fires, dropped if we're destroyed first. Without a context it is
+    called right away and no source is attached.
+
+    \return The source, attached, or nullptr if it was called
+*/
+GSource* Authentication::attachOnHome(GSource* source, void (Authentication::*method)())
 {
-    auto obj = reinterpret_cast<Authentication*>(user_data);
-    obj->cancel();
+    if (!homeContext)
+    {
+        g_source_unref(source);
+        (this->*method)();
+        return nullptr;
+    }
+
+    typedef std::pair<std::weak_ptr<Authentication*>, void (Authentication::*)()> Call;
+    g_source_set_callback(source,
+                          [](gpointer user_data) -> gboolean {
+                              auto call = static_cast<Call*>(user_data);
+                              auto obj = call->first.lock();
+                              if (obj)
+                              {
+                                  ((*obj)->*(call->second))();
+                              }
+                              return G_SOURCE_REMOVE;
+                          },
+                          new Call(alive, method), [](gpointer user_data) { delete static_cast<Call*>(user_data); });
+    g_source_attach(source, homeContext.get());
+
+    return source;
 }
 
-static void notification_action_response(NotifyNotification* notification, char* action, gpointer user_data)
+/** Takes \p source off the context if it is there and clears it */
+void Authentication::destroySource(GSource*& source)
 {
-    auto obj = reinterpret_cast<Authentication*>(user_data);
-    obj->checkResponse();
+    if (source != nullptr)
+    {
+        g_source_destroy(source);
+        g_source_unref(source);
+        source = nullptr;
+    }
 }
 
-static void notification_action_cancel(NotifyNotification* notification, char* action, gpointer user_data)
+/** Changes how failed attempts are retried, from the next failure on */
+void Authentication::setRetryPolicy(const RetryPolicy& policy)
 {
-    auto obj = reinterpret_cast<Authentication*>(user_data);
-    obj->cancel();
+    retryPolicy = policy;
 }
 
-/* Initialize everything */
-Authentication::Authentication(const std::string& in_action_id,
-                               const std::string& in_message,
-                               const std::string& in_icon_name,
-                               const std::string& in_cookie,
-                               const std::list<std::string>& in_identities,
-                               const std::function<void(State)>& in_finishedCallback)
-    : action_id(in_action_id)
-    , message(in_message)
-    , icon_name(in_icon_name)
-    , cookie(in_cookie)
-    , identities(in_identities)
-    , finishedCallback(in_finishedCallback)
+/** Retry counters for every authentication so far, safe to call
+    from any thread */
+Authentication::RetryStats Authentication::retryStats()
+{
+    RetryStats stats;
+
+    stats.retryLatency = retryLatency.snapshot();
+    stats.retries = retryCount.load();
+    stats.exhausted = exhaustedCount.load();
+
+    return stats;
+}
+
+/** Has our sessions talk to helpers from \p pool, for the identities
+    it can authenticate. nullptr goes back to PolkitAgentSession. */
+void Authentication::setHelperPool(const std::shared_ptr<HelperPool>& pool)
 {
-    GError* error = nullptr;
+    helperPool = pool;
+}
 
-    /* Get the Bus */
-    sessionBus = shared_gobject<GDBusConnection>(g_bus_get_sync(G_BUS_TYPE_SESSION, nullptr, &error));
-    check_error(error, "Unable to get session bus");
+/** The snap decision picked an identity, the state only changes if
+    it is one of ours */
+static void identity_change_state(GSimpleAction* action, GVariant* value, gpointer user_data)
+{
+    static_cast<Authentication*>(user_data)->selectIdentity(g_variant_get_string(value, nullptr));
+}
 
-    /* Build a unique path */
-    static unsigned int authentication_count = 0;
-    auto thiscnt = ++authentication_count;
-    dbusPath = "/com/canonical/unity8/policykit/authentication" + std::to_string(thiscnt);
-    g_debug("DBus Path: %s", dbusPath.c_str());
+/** Used to start the session working, split out from the constructor
+    so that we can separate the two in the test suite. The current
+    user is the one most likely to know a password, so they're offered
+    first, then the admins and the rest in the order PolicyKit gave
+    them. Only the offered one has its session started, PAM isn't
+    asked about anyone else until the user picks them. The next few
+    get a helper waiting for their cookie, which doesn't start PAM,
+    so picking one of them is as quick as the first. */
+void Authentication::start(void)
+{
+    std::list<Candidate> admins;
+    std::list<Candidate> others;
+    for (const auto& identity : identities)
+    {
+        if (identity.isCurrentUser())
+        {
+            candidates.emplace_back(identity);
+        }
+        else if (identity.isAdmin())
+        {
+            admins.emplace_back(identity);
+        }
+        else
+        {
+            others.emplace_back(identity);
+        }
+    }
+    candidates.splice(candidates.end(), admins);
+    candidates.splice(candidates.end(), others);
 
-    /* Setup Actions */
-    actions = shared_gobject<GSimpleActionGroup>(g_simple_action_group_new());
-    auto pwaction =
-        shared_gobject<GSimpleAction>(g_simple_action_new_stateful("response", nullptr, g_variant_new_string("")));
-    g_action_map_add_action(G_ACTION_MAP(actions.get()), G_ACTION(pwaction.get()));
+    if (candidates.empty())
+    {
+        throw std::runtime_error("Authentication '" + cookie + "' has no identities to authenticate as");
+    }
 
-    actionsExport = g_dbus_connection_export_action_group(sessionBus.get(), dbusPath.c_str(),
-                                                          G_ACTION_GROUP(actions.get()), &error);
-    check_error(error, "Unable to export actions");
+    selected = &candidates.front();
+    selected->session = buildSession(selected->identity);
+    session = selected->session;
 
-    /* Setup Menus */
-    menus = shared_gobject<GMenu>(g_menu_new());
-    menusExport =
-        g_dbus_connection_export_menu_model(sessionBus.get(), dbusPath.c_str(), G_MENU_MODEL(menus.get()), &error);
-    check_error(error, "Unable to export menu model");
+    if (helperPool)
+    {
+        unsigned int prewarmed = 0;
+        for (auto candidate = std::next(candidates.begin());
+             candidate != candidates.end() && prewarmed < PREWARMED_IDENTITIES; candidate++)
+        {
+            auto user = HelperSession::userName(candidate->identity);
+            if (!user.empty())
+            {
+                helperPool->prewarm(user);
+                prewarmed++;
+            }
+        }
+    }
+
+    /* Let the user pick if there is something to pick from */
+    if (candidates.size() > 1 && actions)
+    {
+        identityAction = std::shared_ptr<GSimpleAction>(
+            g_simple_action_new_stateful("identity", G_VARIANT_TYPE_STRING,
+                                         g_variant_new_string(selected->identity.toString().c_str())),
+            [](GSimpleAction* action) { g_clear_object(&action); });
+        identityChanged =
+            g_signal_connect(identityAction.get(), "change-state", G_CALLBACK(identity_change_state), this);
+        g_action_map_add_action(G_ACTION_MAP(actions.get()), G_ACTION(identityAction.get()));
+
+        stageIdentityEntry();
+    }
 }
 
-Authentication::~Authentication()
+/** Switches to authenticating as \p identity, which has to be one of
+    ours. Its session is used if it was started, and started now if it
+    wasn't, and the menu is changed to whatever it last said. */
+void Authentication::selectIdentity(const std::string& identity)
 {
-    /* This will cancel if we haven't already sent a
-       complete message to the creator */
-    cancel();
+    if (callbackSent)
+    {
+        return;
+    }
 
-    if (menusExport != 0)
+    auto found = std::find_if(candidates.begin(), candidates.end(), [&identity](const Candidate& candidate) {
+        return candidate.identity.toString() == identity;
+    });
+    if (found == candidates.end())
     {
-        g_dbus_connection_unexport_menu_model(sessionBus.get(), menusExport);
+        g_warning("Authentication '%s' can't use identity '%s'", cookie.c_str(), identity.c_str());
+        return;
     }
-    if (actionsExport != 0)
+
+    auto candidate = &*found;
+    if (candidate == selected)
     {
-        g_dbus_connection_unexport_action_group(sessionBus.get(), actionsExport);
+        return;
+    }
+
+    g_debug("Authentication '%s' switching to '%s'", cookie.c_str(), identity.c_str());
+
+    /* A retry waiting for the one we're leaving waits for it to be
+       picked again */
+    if (retryTimer != nullptr)
+    {
+        destroySource(retryTimer);
+        selected->failed = true;
+    }
+
+    selected = candidate;
+    if (!candidate->session)
+    {
+        candidate->session = buildSession(candidate->identity);
+    }
+    else if (candidate->failed)
+    {
+        candidate->failed = false;
+        candidate->session->resetSession();
+    }
+    session = candidate->session;
+
+    if (identityAction)
+    {
+        g_simple_action_set_state(identityAction.get(), g_variant_new_string(identity.c_str()));
+    }
+
+    stageIdentityEntry();
+    stageMenuEntry(INFO_ENTRY, !candidate->info.empty(), candidate->info);
+    stageMenuEntry(ERROR_ENTRY, !candidate->error.empty(), candidate->error);
+
+    if (candidate->prompted)
+    {
+        addRequest(candidate->prompt, candidate->password);
+    }
+    else
+    {
+        stageMenuEntry(REQUEST_ENTRY, false, std::string{});
+        clearResponse();
     }
 }
 
-/** Used to start the session working, split out from the constructor
-    so that we can separate the two in the test suite. */
-void Authentication::start(void)
+/** The candidate \p session was started for, nullptr if it isn't one */
+Authentication::Candidate* Authentication::candidateFor(const Session* session)
 {
-    /** TODO: We should have an identity selector, not a requirement yet. */
-    session = buildSession(*identities.begin());
+    for (auto& candidate : candidates)
+    {
+        if (candidate.session.get() == session)
+        {
+            return &candidate;
+        }
+    }
+    return nullptr;
 }
 
-/** Build the notification object along with all the hints that are
-    required to be rather complex GVariants. */
-std::shared_ptr<NotifyNotification> Authentication::buildNotification(void)
+/** Has the menu say who we're authenticating as, if there's a choice */
+void Authentication::stageIdentityEntry()
 {
-    /* Build our notification */
-    auto notification = shared_gobject<NotifyNotification>(
-        notify_notification_new(_("Elevated permissions required"), message.c_str(), icon_name.c_str()));
-    if (!notification)
+    if (!identityAction || selected == nullptr)
     {
-        throw std::runtime_error("Unable to setup notification object");
+        return;
     }
 
-    notify_notification_set_timeout(notification.get(), NOTIFY_EXPIRES_NEVER);
-    notify_notification_add_action(notification.get(), "okay", _("Login"), notification_action_response, this,
-                                   nullptr); /* free func */
-    notify_notification_add_action(notification.get(), "cancel", _("Cancel"), notification_action_cancel, this,
-                                   nullptr); /* free func */
+    auto label = g_strdup_printf(_("Authenticate as %s"), selected->identity.displayName().c_str());
+    stageMenuEntry(IDENTITY_ENTRY, true, label);
+    g_free(label);
+}
 
-    g_signal_connect(notification.get(), "closed", G_CALLBACK(notification_closed), this);
+/** The user has answered as the selected identity, the sessions for
+    the others are cancelled. Picking one of them again starts it over. */
+void Authentication::dropUnchosen()
+{
+    for (auto& candidate : candidates)
+    {
+        if (&candidate == selected || !candidate.session)
+        {
+            continue;
+        }
+
+        g_debug("Cancelling unused session for '%s'", candidate.identity.toString().c_str());
+        candidate.session.reset();
+        candidate.prompted = false;
+        candidate.failed = false;
+        candidate.info.clear();
+        candidate.error.clear();
+    }
+}
+
+/** Takes the identity action back out of the exported actions, they
+    go back to the pool without it */
+void Authentication::removeIdentityAction()
+{
+    if (!identityAction)
+    {
+        return;
+    }
+
+    g_signal_handler_disconnect(identityAction.get(), identityChanged);
+    identityChanged = 0;
+    if (actions)
+    {
+        g_action_map_remove_action(G_ACTION_MAP(actions.get()), "identity");
+    }
+    identityAction.reset();
+}
+
+/** Build the notification object along with all the hints that are
+    required to be rather complex GVariants. */
+std::shared_ptr<Notification> Authentication::buildNotification(void)
+{
+    /* Build our notification, it talks to the server on our session
+       bus connection so its callbacks come in on our context */
+    auto notification = std::make_shared<Notification>(
+        sessionBus, notify_get_app_name(),
+        [this](const std::string& action) {
+            if (action == "okay")
+            {
+                checkResponse();
+            }
+            else
+            {
+                cancel();
+            }
+        },
+        [this]() { notificationClosed(); },
+        [this](const std::string& error) {
+            /* We're gonna handle the error here by shutting things
+               now and reporting a recoverable error */
+            cancel();
+        });
+
+    notification->update(_("Elevated permissions required"), notificationBody(displayedActions), icon_name);
+    notification->setTimeout(NOTIFY_EXPIRES_NEVER);
+    notification->addAction("okay", _("Login"));
+    notification->addAction("cancel", _("Cancel"));
 
     /* Set Notification hints */
-    notify_notification_set_hint(notification.get(), "x-canonical-snap-decisions", g_variant_new_string("true"));
+    notification->setHint("x-canonical-snap-decisions", g_variant_new_string("true"));
 
     GVariantBuilder builder;
     g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
@@ -184,7 +445,7 @@ std::shared_ptr<NotifyNotification> Authentication::buildNotification(void)
     g_variant_builder_close(&builder);
     g_variant_builder_close(&builder);
 
-    notify_notification_set_hint(notification.get(), "x-canonical-private-menu-model", g_variant_builder_end(&builder));
+    notification->setHint("x-canonical-private-menu-model", g_variant_builder_end(&builder));
 
     return notification;
 }
@@ -193,31 +454,100 @@ std::shared_ptr<NotifyNotification> Authentication::buildNotification(void)
     it connects to all the signals and passes their calls to the appropriate
     function on the Authentication object.
 
-    \param identity A PK identity string
+    \param identity A PK identity
     \param cookie An unique identifier for this authentication
 */
-std::shared_ptr<Session> Authentication::buildSession(const std::string& identity)
+std::shared_ptr<Session> Authentication::buildSession(const Identity& identity)
 {
-    g_debug("Building a new PK session");
-    auto lsession = std::make_shared<Session>(identity, cookie);
+    g_debug("Building a new PK session for '%s'", identity.toString().c_str());
+    auto lsession = newSession(identity, cookie);
 
-    lsession->request().connect([this](const std::string& prompt, bool password) { addRequest(prompt, password); });
+    /* Each identity has its own session, only the selected one's
+       shows, the others are kept until they're picked */
+    auto psession = lsession.get();
 
-    lsession->info().connect([this](const std::string& info) { setInfo(info); });
+    lsession->request().connect([this, psession](const std::string& prompt, bool password) {
+        auto candidate = candidateFor(psession);
+        if (candidate != nullptr)
+        {
+            candidate->prompted = true;
+            candidate->prompt = prompt;
+            candidate->password = password;
+        }
+        if (candidate == nullptr || candidate == selected)
+        {
+            addRequest(prompt, password);
+        }
+    });
 
-    lsession->error().connect([this](const std::string& error) { setError(error); });
+    lsession->info().connect([this, psession](const std::string& info) {
+        auto candidate = candidateFor(psession);
+        if (candidate != nullptr)
+        {
+            candidate->info = info;
+        }
+        if (candidate == nullptr || candidate == selected)
+        {
+            setInfo(info);
+        }
+    });
 
-    lsession->complete().connect([this](bool success) {
-        hideNotification();
+    lsession->error().connect([this, psession](const std::string& error) {
+        auto candidate = candidateFor(psession);
+        if (candidate != nullptr)
+        {
+            candidate->error = error;
+        }
+        if (candidate == nullptr || candidate == selected)
+        {
+            setError(error);
+        }
+    });
+
+    lsession->complete().connect([this, psession](bool success) {
+        auto candidate = candidateFor(psession);
+        if (candidate != nullptr)
+        {
+            candidate->prompted = false;
+
+            /* The user has moved on from it, whatever it says isn't
+               for them to use. It starts over if they pick it again. */
+            if (candidate != selected)
+            {
+                candidate->failed = true;
+                return;
+            }
+        }
 
         if (success)
         {
-            issueCallback(Authentication::State::SUCCESS);
+            hideNotification();
+            dropUnchosen();
+
+            /* Anyone who joined us and was shown to the user gets the
+               same answers, nobody else gets them */
+            succeeded = true;
+            for (auto& follower : followers)
+            {
+                if (follower.done)
+                {
+                    continue;
+                }
+
+                if (follower.shown)
+                {
+                    replay(follower);
+                }
+                else
+                {
+                    followerFinished(follower, State::CANCELLED);
+                }
+            }
+            finishIfDone();
         }
         else
         {
-            /* If we're not successful we'll try again */
-            session->resetSession();
+            sessionFailed();
         }
     });
 
@@ -227,6 +557,254 @@ std::shared_ptr<Session> Authentication::buildSession(const std::string& identit
     return lsession;
 }
 
+/** The user got it wrong. Tries again once the backoff has passed,
+    or cancels cleanly if that was the last attempt the policy
+    allows. The notification stays up with PAM's error in it, and the
+    retry's request updates it in place. */
+void Authentication::sessionFailed()
+{
+    forgetResponses();
+    responded = false;
+    failedAttempts++;
+
+    if (retryPolicy.maxAttempts != 0 && failedAttempts >= retryPolicy.maxAttempts)
+    {
+        g_debug("Authentication '%s' failed %u times, giving up", cookie.c_str(), failedAttempts);
+        exhaustedCount++;
+        cancel();
+        return;
+    }
+
+    /* Nothing to answer until the retry asks */
+    stageMenuEntry(REQUEST_ENTRY, false, std::string{});
+    clearResponse();
+
+    /* Doubles for each failure after the first, stopping at the limit */
+    auto delay = retryPolicy.backoff;
+    for (unsigned int i = 1; i < failedAttempts && delay < retryPolicy.maxBackoff; i++)
+    {
+        delay *= 2;
+    }
+    delay = std::min(delay, retryPolicy.maxBackoff);
+
+    if (delay.count() <= 0)
+    {
+        retrySession();
+        return;
+    }
+
+    g_debug("Retrying authentication '%s' in %d ms", cookie.c_str(), int(delay.count()));
+    destroySource(retryTimer);
+    retryTimer = attachOnHome(g_timeout_source_new(delay.count()), &Authentication::retrySession);
+}
+
+/** Starts the next attempt, the session keeps its identity and
+    cookie and only needs a new conversation with PAM */
+void Authentication::retrySession()
+{
+    destroySource(retryTimer);
+
+    if (!session || callbackSent)
+    {
+        return;
+    }
+
+    retryCount++;
+    retryStarted = g_get_monotonic_time();
+    session->resetSession();
+}
+
+/** Makes the session object, split out so that the test suite can
+    replace it with a mock. With a helper pool, users are authenticated
+    by a helper from it rather than one PolkitAgentSession starts.
+
+    \param identity A PK identity
+    \param cookie The cookie that the session will authenticate
+*/
+std::shared_ptr<Session> Authentication::newSession(const Identity& identity, const std::string& cookie)
+{
+    if (helperPool && !HelperSession::userName(identity).empty())
+    {
+        return std::make_shared<HelperSession>(helperPool, identity, cookie);
+    }
+
+    return std::make_shared<Session>(identity, cookie);
+}
+
+/** Adds another request for the same identities to this
+    authentication. The user is only asked once, and when they get it
+    right what they answered is replayed to a session for the joined
+    cookie, so that PolicyKit hears about each cookie from its own
+    helper. We don't report on our own cookie until every follower has
+    finished. A follower for a different action is added to what the
+    notification says, updating it if it is already shown.
+
+    Only requests that come in before the user answers can join. What
+    they type is for what the notification showed them at the time,
+    a request after that has to ask them itself.
+
+    \param cookie Cookie of the request joining us
+    \param action_id Action of the request joining us
+    \param message Message for that action
+    \param callback Function to call when the joined request is done
+    \return Whether it was joined, false once the user has answered
+*/
+bool Authentication::join(const std::string& cookie,
+                          const std::string& action_id,
+                          const std::string& message,
+                          const std::function<void(State)>& callback)
+{
+    if (callbackSent || answered || responded || succeeded || !responses.empty())
+    {
+        return false;
+    }
+
+    g_debug("Authentication '%s' joined by '%s'", this->cookie.c_str(), cookie.c_str());
+
+    Follower follower;
+    follower.cookie = cookie;
+    follower.action_id = action_id;
+    follower.message = message;
+    follower.callback = callback;
+    followers.push_back(follower);
+
+    if (notification && action_id != this->action_id)
+    {
+        notification->update(_("Elevated permissions required"), notificationBody(displayedActions), icon_name);
+        showNotification();
+    }
+
+    return true;
+}
+
+/** Takes a request added with join() back out, its callback is called
+    with it being cancelled. */
+void Authentication::leave(const std::string& cookie)
+{
+    for (auto& follower : followers)
+    {
+        if (follower.cookie == cookie)
+        {
+            followerFinished(follower, State::CANCELLED);
+        }
+    }
+
+    finishIfDone();
+}
+
+/** Starts a session for a follower that answers each of its requests
+    with what the user answered ours */
+void Authentication::replay(Follower& follower)
+{
+    g_debug("Replaying responses for '%s'", follower.cookie.c_str());
+
+    /* Followers are in a list so the pointer stays good while we exist */
+    auto pfollower = &follower;
+    follower.session = newSession(selected != nullptr ? selected->identity : *identities.begin(), follower.cookie);
+
+    follower.session->request().connect([this, pfollower](const std::string& prompt, bool password) {
+        if (pfollower->answered >= responses.size())
+        {
+            /* It wants more than the user told us, can't guess */
+            g_warning("Joined authentication '%s' asked for more than was answered", pfollower->cookie.c_str());
+            followerFinished(*pfollower, State::CANCELLED);
+            finishIfDone();
+            return;
+        }
+
+        pfollower->session->requestResponse(responses[pfollower->answered++]);
+    });
+
+    follower.session->complete().connect([this, pfollower](bool success) {
+        followerFinished(*pfollower, success ? State::SUCCESS : State::CANCELLED);
+        finishIfDone();
+    });
+
+    follower.session->initiate();
+}
+
+/** Calls the follower's callback, only once. The responses are
+    dropped once no follower could want them. */
+void Authentication::followerFinished(Follower& follower, State state)
+{
+    if (follower.done)
+    {
+        return;
+    }
+
+    follower.done = true;
+    if (!replayWanted())
+    {
+        forgetResponses();
+    }
+
+    if (follower.callback)
+    {
+        follower.callback(state);
+    }
+}
+
+/** Whether a follower may still need the responses replayed to it */
+bool Authentication::replayWanted() const
+{
+    return std::any_of(followers.begin(), followers.end(),
+                       [](const Follower& follower) { return follower.shown && !follower.done; });
+}
+
+/** Reports our own success once every follower has been answered */
+void Authentication::finishIfDone()
+{
+    if (!succeeded)
+    {
+        return;
+    }
+
+    for (auto& follower : followers)
+    {
+        if (!follower.done)
+        {
+            return;
+        }
+    }
+
+    forgetResponses();
+    issueCallback(Authentication::State::SUCCESS);
+}
+
+/** What the notification says, our message followed by the one for
+    each other action that has joined us
+    \param shownActions Set to the actions the body is for, ours first
+*/
+std::string Authentication::notificationBody(std::vector<std::string>& shownActions) const
+{
+    std::string body = message;
+    std::vector<std::string> actions{action_id};
+
+    for (auto& follower : followers)
+    {
+        if (follower.done || std::find(actions.begin(), actions.end(), follower.action_id) != actions.end())
+        {
+            continue;
+        }
+
+        actions.push_back(follower.action_id);
+        body += "\n" + follower.message;
+    }
+
+    shownActions = actions;
+    return body;
+}
+
+/** Clears out what the user answered, it's probably a password */
+void Authentication::forgetResponses()
+{
+    for (auto& response : responses)
+    {
+        std::fill(response.begin(), response.end(), '\0');
+    }
+    responses.clear();
+}
+
 /** Show a notification to the user, may include building it if it
     has been built previously. */
 void Authentication::showNotification()
@@ -243,18 +821,12 @@ void Authentication::showNotification()
 
     g_debug("Showing Notification");
 
-    try
-    {
-        GError* error = nullptr;
-        notify_notification_show(notification.get(), &error);
-        check_error(error, "Unable to show notification");
-    }
-    catch (std::runtime_error& e)
-    {
-        /* We're gonna handle the error here by shutting things
-           now and reporting a recoverable error */
-        cancel();
-    }
+    /* The snap decision reads the menu as soon as it gets this */
+    flushMenu();
+
+    /* Doesn't wait on the server, if it can't show it we hear about
+       it through the error callback */
+    notification->show();
 }
 
 /** Hide a notification. This includes closing it if open and free'ing
@@ -262,20 +834,21 @@ void Authentication::showNotification()
     and remove all the items from the menu. */
 void Authentication::hideNotification()
 {
-    /* Close the notification */
+    /* Close the notification, the close goes out without waiting */
     if (notification)
     {
-        notify_notification_close(notification.get(), nullptr);
+        notification->close();
     }
     notification.reset();
+    answered = false;
 
-    /* Clear the menu */
-    if (menus)
-    {
-        g_menu_remove_all(G_MENU(menus.get()));
-    }
+    clearMenu();
+    clearResponse();
+}
 
-    /* Clear the response */
+/** Empties the response action so the next answer starts blank */
+void Authentication::clearResponse()
+{
     if (actions)
     {
         auto action = g_action_map_lookup_action(G_ACTION_MAP(actions.get()), "response"); /* No transfer */
@@ -286,12 +859,35 @@ void Authentication::hideNotification()
     }
 }
 
+/** The notification server closed our notification. Before the user
+    has answered that is them dismissing it. After they've answered it
+    is the server taking down a snap decision that was acted on, the
+    next request shows a new one. */
+void Authentication::notificationClosed()
+{
+    if (answered)
+    {
+        notification.reset();
+        return;
+    }
+
+    cancel();
+}
+
 /** Cancel the authentication. Hide the notification if visiable and call
     the callback. */
 void Authentication::cancel()
 {
     g_debug("Notification Cancelled");
+    destroySource(retryTimer);
     hideNotification();
+
+    for (auto& follower : followers)
+    {
+        followerFinished(follower, Authentication::State::CANCELLED);
+    }
+    forgetResponses();
+
     issueCallback(Authentication::State::CANCELLED);
 }
 
@@ -306,36 +902,38 @@ void Authentication::checkResponse()
 
     g_debug("Notification response: %s", response.c_str());
 
-    hideNotification();
-
-    session->requestResponse(response);
-}
+    /* The notification stays up for the next request to update in
+       place, what we said about this one is done with */
+    answered = true;
+    clearResponse();
+    stageMenuEntry(INFO_ENTRY, false, std::string{});
+    stageMenuEntry(ERROR_ENTRY, false, std::string{});
 
-/** Find a menu item in a menu that has a specific value on an attribute */
-int findMenuItem(std::shared_ptr<GMenu>& menu, const std::string& type, const std::string& value)
-{
-    int index = -1;
-    for (int i = 0; i < g_menu_model_get_n_items(G_MENU_MODEL(menu.get())); i++)
+    /* Answering is picking who to be, the others aren't needed */
+    if (selected != nullptr)
     {
-        auto vtext =
-            g_menu_model_get_item_attribute_value(G_MENU_MODEL(menu.get()), i, type.c_str(), G_VARIANT_TYPE_STRING);
-
-        if (vtext == nullptr)
-        {
-            continue;
-        }
-
-        auto text = std::string(g_variant_get_string(vtext, nullptr));
-        g_variant_unref(vtext);
+        selected->prompted = false;
+        selected->info.clear();
+        selected->error.clear();
+    }
+    dropUnchosen();
 
-        if (text == value)
-        {
-            index = i;
-            break;
-        }
+    /* The ones joined now, for an action the notification said it
+       was for, are who the user is answering for. No more can join.
+       It is only kept if one of them needs it. */
+    responded = true;
+    for (auto& follower : followers)
+    {
+        follower.shown = std::find(displayedActions.begin(), displayedActions.end(), follower.action_id) !=
+                         displayedActions.end();
+    }
+    if (replayWanted())
+    {
+        responses.push_back(response);
     }
 
-    return index;
+    session->requestResponse(response);
+    std::fill(response.begin(), response.end(), '\0');
 }
 
 /** Set the info string to show the user. If there is no info menu item
@@ -343,25 +941,7 @@ int findMenuItem(std::shared_ptr<GMenu>& menu, const std::string& type, const st
     will be updated to be the new string */
 void Authentication::setInfo(const std::string& info)
 {
-    int index = findMenuItem(menus, "x-canonical-unity8-policy-kit-type", "info");
-
-    std::shared_ptr<GMenuItem> item;
-
-    if (index == -1)
-    {
-        /* Build it */
-        item = shared_gobject<GMenuItem>(g_menu_item_new(info.c_str(), nullptr));
-        g_menu_item_set_attribute_value(item.get(), "x-canonical-unity8-policy-kit-type", g_variant_new_string("info"));
-    }
-    else
-    {
-        /* Update it */
-        item = shared_gobject<GMenuItem>(g_menu_item_new_from_model(G_MENU_MODEL(menus.get()), index));
-        g_menu_item_set_label(item.get(), info.c_str());
-        g_menu_remove(menus.get(), index);
-    }
-
-    g_menu_prepend_item(menus.get(), item.get());
+    stageMenuEntry(INFO_ENTRY, true, info);
 }
 
 /** Set the error string to show the user. If there is no error menu item
@@ -369,87 +949,187 @@ void Authentication::setInfo(const std::string& info)
     will be updated to be the new string */
 void Authentication::setError(const std::string& error)
 {
-    int index = findMenuItem(menus, "x-canonical-unity8-policy-kit-type", "error");
-
-    std::shared_ptr<GMenuItem> item;
+    stageMenuEntry(ERROR_ENTRY, true, error);
+}
 
-    if (index == -1)
+/** Changes what one entry of the menu should be and has the menu
+    updated when we're back to the main loop. The entries always go
+    info, error then request, so where one goes comes from which of
+    those before it are in the menu rather than searching the items. */
+void Authentication::stageMenuEntry(MenuEntryType type, bool present, const std::string& label, bool password)
+{
+    auto& entry = menuEntries[type];
+    if (entry.present == present && entry.label == label && entry.password == password)
     {
-        /* Build it */
-        item = shared_gobject<GMenuItem>(g_menu_item_new(error.c_str(), nullptr));
-        g_menu_item_set_attribute_value(item.get(), "x-canonical-unity8-policy-kit-type",
-                                        g_variant_new_string("error"));
+        return;
     }
-    else
+
+    entry.present = present;
+    entry.label = label;
+    entry.password = password;
+    entry.dirty = true;
+
+    if (menuFlush != nullptr)
     {
-        /* Update it */
-        item = shared_gobject<GMenuItem>(g_menu_item_new_from_model(G_MENU_MODEL(menus.get()), index));
-        g_menu_item_set_label(item.get(), error.c_str());
-        g_menu_remove(menus.get(), index);
+        return;
     }
 
-    int location = 0;
-    if (g_menu_model_get_n_items(G_MENU_MODEL(menus.get())) > 1)
+    menuFlush = attachOnHome(g_idle_source_new(), &Authentication::flushMenu);
+}
+
+/** Puts the staged entries into the menu. All of the changes are made
+    together so the export sends them to the snap decision as one. */
+void Authentication::flushMenu()
+{
+    destroySource(menuFlush);
+
+    if (!menus)
     {
-        location = 1;
+        return;
     }
 
-    g_menu_insert_item(menus.get(), location, item.get());
-}
+    int position = 0;
+    for (std::size_t type = 0; type < menuEntries.size(); type++)
+    {
+        auto& entry = menuEntries[type];
+        if (entry.dirty)
+        {
+            entry.dirty = false;
+
+            if (entry.inMenu)
+            {
+                g_menu_remove(menus.get(), position);
+            }
+            entry.inMenu = entry.present;
+            if (entry.present)
+            {
+                auto item = buildMenuItem(static_cast<MenuEntryType>(type), entry);
+                g_menu_insert_item(menus.get(), position, item.get());
+            }
+        }
 
-/** A regex to see if the incoming request is for a password */
-static const std::regex passwordDetector{"\\s*[Pp]assword:?\\s*"};
+        if (entry.inMenu)
+        {
+            position++;
+        }
+    }
+}
 
-/** Add a request for information from the user. This is a menu item in
-    the menu model. If there isn't an item, it is created here, else it
-    is updated to include this request. */
-void Authentication::addRequest(const std::string& request, bool password)
+/** Empties the menu, along with anything staged for it */
+void Authentication::clearMenu()
 {
-    /* If we're showing one and we get a request, uhm,
-       that is weird. But let's just clear it and start
-       again. */
-    if (notification)
+    destroySource(menuFlush);
+
+    for (auto& entry : menuEntries)
     {
-        hideNotification();
+        entry = MenuEntry{};
     }
 
-    /* Fix menu item */
-    int index = findMenuItem(menus, "x-canonical-type", "com.canonical.snapdecision.textfield");
-
-    std::string label;
-    if (std::regex_match(request, passwordDetector))
+    if (menus)
     {
-        label = _("Password");  // TODO: Add Username (Password for Joe)
-        password = true;        /* Force to password even if PAM doesn't think so */
+        g_menu_remove_all(G_MENU(menus.get()));
     }
-    else
+}
+
+/** The menu item for an entry */
+std::shared_ptr<GMenuItem> Authentication::buildMenuItem(MenuEntryType type, const MenuEntry& entry)
+{
+    if (type == IDENTITY_ENTRY)
     {
-        label = request;
+        /* The choices go with it, the action's state says which is
+           picked and changing it picks another */
+        GVariantBuilder choices;
+        g_variant_builder_init(&choices, G_VARIANT_TYPE("a(ss)"));
+        for (const auto& candidate : candidates)
+        {
+            g_variant_builder_add(&choices, "(ss)", candidate.identity.toString().c_str(),
+                                  candidate.identity.displayName().c_str());
+        }
+
+        auto item = shared_gobject<GMenuItem>(g_menu_item_new(entry.label.c_str(), "pk.identity"));
+        g_menu_item_set_attribute_value(item.get(), "x-canonical-unity8-policy-kit-type",
+                                        g_variant_new_string("identity"));
+        g_menu_item_set_attribute_value(item.get(), "x-canonical-unity8-policy-kit-identities",
+                                        g_variant_builder_end(&choices));
+        return item;
     }
 
-    if (index == -1)
+    if (type == REQUEST_ENTRY)
     {
-        /* Build it */
-        auto item = shared_gobject<GMenuItem>(g_menu_item_new(label.c_str(), "pk.response"));
+        auto item = shared_gobject<GMenuItem>(g_menu_item_new(entry.label.c_str(), "pk.response"));
         g_menu_item_set_attribute_value(item.get(), "x-canonical-type",
                                         g_variant_new_string("com.canonical.snapdecision.textfield"));
         g_menu_item_set_attribute_value(item.get(), "x-echo-mode-password",
-                                        g_variant_new_boolean(password ? TRUE : FALSE));
-        g_menu_append_item(menus.get(), item.get());
+                                        g_variant_new_boolean(entry.password ? TRUE : FALSE));
+        return item;
     }
-    else
+
+    auto item = shared_gobject<GMenuItem>(g_menu_item_new(entry.label.c_str(), nullptr));
+    g_menu_item_set_attribute_value(item.get(), "x-canonical-unity8-policy-kit-type",
+                                    g_variant_new_string(type == INFO_ENTRY ? "info" : "error"));
+    return item;
+}
+
+/** Add a request for information from the user. This is a menu item in
+    the menu model. If there isn't an item, it is created here, else it
+    is updated to include this request. A notification that is still up
+    from the last request is updated in place rather than closed and
+    built again, so each step of a conversation replaces the last. */
+void Authentication::addRequest(const std::string& request, bool password)
+{
+    if (retryStarted != 0)
     {
-        /* Update it */
-        auto item = shared_gobject<GMenuItem>(g_menu_item_new_from_model(G_MENU_MODEL(menus.get()), index));
-        g_menu_item_set_label(item.get(), label.c_str());
-        g_menu_item_set_attribute_value(item.get(), "x-echo-mode-password",
-                                        g_variant_new_boolean(password ? TRUE : FALSE));
-        g_menu_remove(menus.get(), index);
-        g_menu_insert_item(menus.get(), index, item.get());
+        retryLatency.record(g_get_monotonic_time() - retryStarted);
+        retryStarted = 0;
     }
 
-    /* Build it and show it */
-    notification = buildNotification();
+    answered = false;
+    clearResponse();
+
+    auto prompt = PromptClassifier::classify(request);
+    g_debug("Request '%s' is for a %s", request.c_str(), PromptClassifier::typeName(prompt.type));
+
+    /* Secrets are hidden even if PAM doesn't think so, but anything
+       PAM wants hidden stays hidden. A prompt that is only the word
+       gets our label for it. */
+    std::string label = request;
+    switch (prompt.type)
+    {
+        case PromptClassifier::Type::PASSWORD:
+            password = true;
+            if (prompt.bare)
+            {
+                label = _("Password");  // TODO: Add Username (Password for Joe)
+            }
+            break;
+        case PromptClassifier::Type::PIN:
+            password = true;
+            if (prompt.bare)
+            {
+                label = _("PIN");
+            }
+            break;
+        case PromptClassifier::Type::OTP:
+            if (prompt.bare)
+            {
+                label = _("Verification code");
+            }
+            break;
+        case PromptClassifier::Type::USERNAME:
+            if (prompt.bare)
+            {
+                label = _("Username");
+            }
+            break;
+        case PromptClassifier::Type::FINGERPRINT:
+        case PromptClassifier::Type::UNKNOWN:
+            break;
+    }
+
+    stageIdentityEntry();
+    stageMenuEntry(REQUEST_ENTRY, true, label, password);
+
+    /* Show it, replacing the one that is up if there is one */
     showNotification();
 }
 
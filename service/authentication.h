@@ -19,14 +19,23 @@
 
 #pragma once
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <list>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <gio/gio.h>
 #include <libnotify/notify.h>
 
+#include "export-pool.h"
+#include "helper-pool.h"
+#include "histogram.h"
+#include "notification.h"
+#include "prompt-classifier.h"
 #include "session-iface.h"
 
 class Authentication
@@ -36,30 +45,71 @@ public:
     enum class State
     {
         CANCELLED, /**< Authentication was cancelled */
-        SUCCESS    /**< Authentication succeeded */
+        SUCCESS,   /**< Authentication succeeded */
+        REJECTED   /**< Authentication was never started, too many were in progress */
+    };
+
+    /** What to do when the user gets it wrong. Each failed attempt
+        starts a new PAM conversation, after waiting the backoff if
+        there is one, until there have been maxAttempts of them and
+        the authentication is cancelled. */
+    struct RetryPolicy
+    {
+        unsigned int maxAttempts = 3;                /**< Attempts before giving up, 0 for no limit */
+        std::chrono::milliseconds backoff{0};        /**< Wait before the second attempt, doubled for each after */
+        std::chrono::milliseconds maxBackoff{30000}; /**< Longest wait between attempts */
+    };
+
+    /** Counters for retries, for all authentications */
+    struct RetryStats
+    {
+        GLib::Histogram::Snapshot retryLatency; /**< Microseconds from starting a retry to its first prompt */
+        std::uint64_t retries = 0;              /**< Failed attempts that were tried again */
+        std::uint64_t exhausted = 0;            /**< Authentications cancelled after their last attempt failed */
     };
 
     Authentication(const std::string& in_action_id,
                    const std::string& in_message,
                    const std::string& in_icon_name,
                    const std::string& in_cookie,
-                   const std::list<std::string>& in_identities,
-                   const std::function<void(State)>& in_finishedCallback);
+                   const std::list<Identity>& in_identities,
+                   const std::function<void(State)>& in_finishedCallback,
+                   const std::shared_ptr<ExportSlot>& in_exports);
     virtual ~Authentication();
 
+    /** How many identities after the offered one get a helper waiting
+        for them, so picking one doesn't wait on a helper starting */
+    static const unsigned int PREWARMED_IDENTITIES = 2;
+
     virtual void start();
     virtual void cancel();
     virtual void checkResponse();
+    virtual void selectIdentity(const std::string& identity);
 
     /* Update Functions */
     virtual void setInfo(const std::string& info);
     virtual void setError(const std::string& error);
     virtual void addRequest(const std::string& request, bool password);
 
+    /* Coalescing */
+    virtual bool join(const std::string& cookie,
+                      const std::string& action_id,
+                      const std::string& message,
+                      const std::function<void(State)>& callback);
+    virtual void leave(const std::string& cookie);
+
+    void invokeOnHome(void (Authentication::*method)());
+
+    void setRetryPolicy(const RetryPolicy& policy);
+    static RetryStats retryStats();
+
+    void setHelperPool(const std::shared_ptr<HelperPool>& pool);
+
 protected:
     /* Build Functions */
-    virtual std::shared_ptr<NotifyNotification> buildNotification(void);
-    virtual std::shared_ptr<Session> buildSession(const std::string& identity);
+    virtual std::shared_ptr<Notification> buildNotification(void);
+    virtual std::shared_ptr<Session> buildSession(const Identity& identity);
+    virtual std::shared_ptr<Session> newSession(const Identity& identity, const std::string& cookie);
 
     /* Notification Control */
     virtual void showNotification();
@@ -69,30 +119,135 @@ protected:
     virtual void issueCallback(State state);
 
 private:
+    /** Another request for the same action and identities that is
+        answered by what the user tells us */
+    struct Follower
+    {
+        std::string cookie;                  /**< Cookie of the joined request */
+        std::string action_id;               /**< Action of the joined request, may not be ours */
+        std::string message;                 /**< Message for the joined request's action */
+        std::function<void(State)> callback; /**< Function to call when it is done */
+        std::shared_ptr<Session> session;    /**< Session replaying the responses, once started */
+        std::size_t answered = 0;            /**< Number of responses given to the session */
+        bool shown = false;                  /**< Was in the notification when the user answered */
+        bool done = false;                   /**< Callback has been called */
+    };
+
+    /** An identity the user can pick, with its session if one has
+        been started. What the session has said is kept so that it
+        can be shown when the identity is picked. */
+    struct Candidate
+    {
+        explicit Candidate(const Identity& identity)
+            : identity(identity)
+        {
+        }
+
+        Identity identity;                /**< Who it authenticates as */
+        std::shared_ptr<Session> session; /**< nullptr until it is started */
+        bool prompted = false;            /**< The session is waiting on an answer to prompt */
+        std::string prompt;               /**< What it last asked */
+        bool password = false;            /**< Whether the answer to prompt is hidden */
+        std::string info;                 /**< Last info from PAM */
+        std::string error;                /**< Last error from PAM */
+        bool failed = false;              /**< The session finished without being used, reset when picked */
+    };
+
+    /** The kinds of item in the menu, in the order they're shown */
+    enum MenuEntryType
+    {
+        IDENTITY_ENTRY, /**< Which identity to authenticate as, when there is a choice */
+        INFO_ENTRY,     /**< Information from PAM */
+        ERROR_ENTRY,    /**< Error from PAM */
+        REQUEST_ENTRY,  /**< Text field for what PAM asked for */
+        MENU_ENTRIES
+    };
+
+    /** What one kind of item should say, and whether the menu does */
+    struct MenuEntry
+    {
+        bool present = false;  /**< Should be in the menu */
+        std::string label;     /**< Text of the item */
+        bool password = false; /**< Text field hides what is typed, requests only */
+        bool dirty = false;    /**< Changed since the menu was last updated */
+        bool inMenu = false;   /**< Is in the menu right now */
+    };
+
+    void stageMenuEntry(MenuEntryType type, bool present, const std::string& label, bool password = false);
+    void flushMenu();
+    void clearMenu();
+    std::shared_ptr<GMenuItem> buildMenuItem(MenuEntryType type, const MenuEntry& entry);
+
+    GSource* attachOnHome(GSource* source, void (Authentication::*method)());
+    static void destroySource(GSource*& source);
+
+    void sessionFailed();
+    void retrySession();
+
+    Candidate* candidateFor(const Session* session);
+    void stageIdentityEntry();
+    void dropUnchosen();
+    void removeIdentityAction();
+
+    void replay(Follower& follower);
+    void followerFinished(Follower& follower, State state);
+    void finishIfDone();
+    bool replayWanted() const;
+    void forgetResponses();
+    void clearResponse();
+    void notificationClosed();
+    std::string notificationBody(std::vector<std::string>& shownActions) const;
+
     /* Passed in parameters */
     std::string action_id;                       /**< Type of action from PolicyKit */
     std::string message;                         /**< Message to show to the user */
     std::string icon_name;                       /**< Icon to show with the notification */
     std::string cookie;                          /**< Unique string to track the authentication */
-    std::list<std::string> identities;           /**< Identities that can be used to authenticate this action */
+    std::list<Identity> identities;              /**< Identities that can be used to authenticate this action */
     std::function<void(State)> finishedCallback; /**< Function to call when the user has completed the authorization */
 
     /* Internal State */
     bool callbackSent = false; /**< Ensure that we only call the callback once. */
-    guint actionsExport = 0;   /**< ID returned by GDBus for the export of the action group */
-    guint menusExport = 0;     /**< ID returned by GDBus for the export of the menus */
+    bool answered = false;     /**< The session has the user's answer, the notification is left up for the next
+                                    request */
 
     /* Stuff we build */
-    std::string dbusPath; /**< Unique path we built for this authentication object for exporting things on DBus */
+    std::shared_ptr<ExportSlot> exports; /**< Exported action group and menus, leased from a pool */
+    std::string dbusPath; /**< Path the exports are at on DBus */
     std::shared_ptr<GDBusConnection>
         sessionBus; /**< Reference to the session bus so we can ensure it lives as long as we do */
-    std::shared_ptr<NotifyNotification> notification; /**< If we have a notification shown, this is the reference to
+    std::shared_ptr<Notification> notification;       /**< If we have a notification shown, this is the reference to
                                                           it. May be nullptr. */
     std::shared_ptr<GSimpleActionGroup> actions;      /**< Action group containing the response action */
     std::shared_ptr<GMenu> menus; /**< The menu model to export to the snap decision. May include info or error items
                                       as well as the response item. */
 
-    std::shared_ptr<Session> session; /**< The PolicyKit session that asks us for information */
+    std::array<MenuEntry, MENU_ENTRIES> menuEntries; /**< What the menu says, and what it should say */
+    GSource* menuFlush = nullptr;                    /**< Idle to update the menu, if there are staged changes */
+
+    std::shared_ptr<Session> session; /**< The PolicyKit session that asks us for information, the selected one's */
+
+    std::list<Candidate> candidates; /**< Identities in the order they're offered, the likely ones first */
+    Candidate* selected = nullptr;   /**< The one being authenticated as, in candidates */
+    std::shared_ptr<GSimpleAction>
+        identityAction;          /**< Action the snap decision picks an identity with, if there's a choice */
+    gulong identityChanged = 0; /**< Handler for identityAction changing state */
+
+    std::shared_ptr<HelperPool> helperPool; /**< Warm helpers to use instead of PolkitAgentSession, may be nullptr */
+
+    RetryPolicy retryPolicy;         /**< How failed attempts are tried again */
+    unsigned int failedAttempts = 0; /**< Attempts the user has gotten wrong so far */
+    GSource* retryTimer = nullptr;   /**< Backoff before the next attempt, if we're waiting on one */
+    gint64 retryStarted = 0;         /**< Monotonic time the last retry started, 0 once it has prompted */
+
+    std::list<Follower> followers;             /**< Requests that joined this one */
+    std::vector<std::string> responses;        /**< What the user answered, only kept while a follower needs it */
+    bool responded = false;                    /**< The user has answered in this attempt, nothing more can join */
+    std::vector<std::string> displayedActions; /**< Actions the notification was last sent saying it is for */
+    bool succeeded = false;                    /**< Our session completed, waiting on the followers */
+
+    std::shared_ptr<GMainContext> homeContext; /**< Context we were built on, where all our GObjects belong */
+    std::shared_ptr<Authentication*> alive;    /**< Lets callbacks queued for homeContext know if we're gone */
 
 protected:
     /** Null constructor for mocking in the test suite */
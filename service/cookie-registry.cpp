@@ -0,0 +1,148 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "cookie-registry.h"
+
+#include <stdexcept>
+
+/** Takes a reference on \p cookie, interning it if this is the first
+    \return Handle for the cookie, the same one for every reference
+*/
+CookieRegistry::Handle CookieRegistry::intern(const std::string& cookie)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = index.find(cookie);
+    if (found != index.end())
+    {
+        auto& entry = entries[found->second];
+        entry.references++;
+
+        Handle handle;
+        handle.index = found->second;
+        handle.generation = entry.generation;
+        return handle;
+    }
+
+    std::uint32_t slot;
+    if (!freeEntries.empty())
+    {
+        slot = freeEntries.back();
+        freeEntries.pop_back();
+    }
+    else
+    {
+        slot = entries.size();
+        entries.emplace_back();
+    }
+
+    auto& entry = entries[slot];
+    entry.cookie = cookie;
+    entry.generation++;
+    if (entry.generation == 0)
+    {
+        entry.generation++;
+    }
+    entry.references = 1;
+    index.emplace(cookie, slot);
+
+    Handle handle;
+    handle.index = slot;
+    handle.generation = entry.generation;
+    return handle;
+}
+
+/** Looks up \p cookie without taking a reference
+    \return Its Handle, or an invalid one if it isn't interned
+*/
+CookieRegistry::Handle CookieRegistry::find(const std::string& cookie) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    Handle handle;
+    auto found = index.find(cookie);
+    if (found != index.end())
+    {
+        handle.index = found->second;
+        handle.generation = entries[found->second].generation;
+    }
+    return handle;
+}
+
+/** Takes another reference on a cookie that is already interned,
+    without looking at the string
+    \return Whether \p handle was still interned
+*/
+bool CookieRegistry::retain(const Handle& handle)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (handle.index >= entries.size() || entries[handle.index].generation != handle.generation ||
+        entries[handle.index].references == 0)
+    {
+        return false;
+    }
+
+    entries[handle.index].references++;
+    return true;
+}
+
+/** Gives back a reference taken with intern() or retain(), the cookie is
+    forgotten when the last one is released */
+void CookieRegistry::release(const Handle& handle)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (handle.index >= entries.size() || entries[handle.index].generation != handle.generation ||
+        entries[handle.index].references == 0)
+    {
+        throw std::logic_error("Releasing a cookie that isn't interned");
+    }
+
+    auto& entry = entries[handle.index];
+    if (--entry.references != 0)
+    {
+        return;
+    }
+
+    index.erase(entry.cookie);
+    entry.cookie.clear();
+    freeEntries.push_back(handle.index);
+}
+
+/** The cookie string for \p handle, empty if it isn't interned */
+std::string CookieRegistry::cookie(const Handle& handle) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (handle.index >= entries.size() || entries[handle.index].generation != handle.generation ||
+        entries[handle.index].references == 0)
+    {
+        return {};
+    }
+
+    return entries[handle.index].cookie;
+}
+
+/** Number of cookies that are interned */
+std::size_t CookieRegistry::size() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return index.size();
+}
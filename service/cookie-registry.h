@@ -0,0 +1,200 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** \brief Interns PolicyKit cookies into small handles
+
+    PolicyKit tracks each authentication with a cookie string, and both
+    the Agent and the AuthManager need to find their state for a cookie
+    every time something happens to it. Rather than each keeping a map
+    keyed by the string, the cookie is hashed once when the request
+    comes in and everything after that uses the Handle, which indexes
+    straight into a Table.
+
+    Handles are an index and a generation. Each user of a cookie takes
+    a reference with intern() and gives it back with release(), once
+    the last one is gone the index is reused with a new generation so
+    a stale Handle won't find the next cookie's state.
+
+    The registry is shared between threads and locks internally, the
+    Tables are owned by a single thread and don't.
+*/
+class CookieRegistry
+{
+public:
+    /** Compact reference to an interned cookie */
+    struct Handle
+    {
+        std::uint32_t index = 0;
+        std::uint32_t generation = 0; /**< Zero is never a valid generation */
+
+        bool valid() const
+        {
+            return generation != 0;
+        }
+
+        bool operator==(const Handle& other) const
+        {
+            return index == other.index && generation == other.generation;
+        }
+
+        bool operator!=(const Handle& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    /** \brief State attached to interned cookies
+
+        Dense storage indexed by Handle, a lookup is an index and a
+        generation compare. Grows to the largest index it has been
+        given and then stops allocating.
+    */
+    template <typename T>
+    class Table
+    {
+    public:
+        /** The value for \p handle, nullptr if there isn't one */
+        T* find(const Handle& handle)
+        {
+            if (handle.index >= slots.size() || slots[handle.index].generation != handle.generation ||
+                !handle.valid())
+            {
+                return nullptr;
+            }
+            return &slots[handle.index].value;
+        }
+
+        /** Adds a default value for \p handle, replacing any there was
+            for a previous generation
+            \return The new value, or nullptr if \p handle already has one
+        */
+        T* insert(const Handle& handle)
+        {
+            if (!handle.valid())
+            {
+                return nullptr;
+            }
+
+            if (handle.index >= slots.size())
+            {
+                slots.resize(handle.index + 1);
+            }
+
+            auto& slot = slots[handle.index];
+            if (slot.generation == handle.generation)
+            {
+                return nullptr;
+            }
+
+            if (slot.generation == 0)
+            {
+                count++;
+            }
+
+            slot.generation = handle.generation;
+            slot.value = T();
+            return &slot.value;
+        }
+
+        /** Drops the value for \p handle
+            \return Whether there was one
+        */
+        bool erase(const Handle& handle)
+        {
+            if (find(handle) == nullptr)
+            {
+                return false;
+            }
+
+            auto& slot = slots[handle.index];
+            slot.generation = 0;
+            slot.value = T();
+            count--;
+            return true;
+        }
+
+        /** Every handle that has a value */
+        std::vector<Handle> handles() const
+        {
+            std::vector<Handle> all;
+            all.reserve(count);
+            for (std::uint32_t i = 0; i < slots.size(); i++)
+            {
+                if (slots[i].generation != 0)
+                {
+                    Handle handle;
+                    handle.index = i;
+                    handle.generation = slots[i].generation;
+                    all.push_back(handle);
+                }
+            }
+            return all;
+        }
+
+        std::size_t size() const
+        {
+            return count;
+        }
+
+        bool empty() const
+        {
+            return count == 0;
+        }
+
+    private:
+        struct Slot
+        {
+            std::uint32_t generation = 0;
+            T value;
+        };
+
+        std::vector<Slot> slots;
+        std::size_t count = 0;
+    };
+
+    Handle intern(const std::string& cookie);
+    Handle find(const std::string& cookie) const;
+    bool retain(const Handle& handle);
+    void release(const Handle& handle);
+
+    std::string cookie(const Handle& handle) const;
+    std::size_t size() const;
+
+private:
+    struct Entry
+    {
+        std::string cookie;
+        std::uint32_t generation = 0;
+        std::uint32_t references = 0;
+    };
+
+    mutable std::mutex lock;
+    std::unordered_map<std::string, std::uint32_t> index;
+    std::vector<Entry> entries;
+    /** Indexes of entries with no references */
+    std::vector<std::uint32_t> freeEntries;
+};
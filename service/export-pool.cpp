@@ -0,0 +1,958 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "export-pool.h"
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+const char* const ExportTree::ROOT_PATH = "/com/canonical/unity8/policykit";
+const unsigned int ExportPool::DEFAULT_MAX_IDLE;
+
+static const char* const ACTIONS_INTERFACE = "org.gtk.Actions";
+static const char* const MENUS_INTERFACE = "org.gtk.Menus";
+
+/* The interfaces as GIO defines them in gdbusactiongroup.c and gmenuexporter.c */
+static const char* const INTERFACES_XML =
+    "<node>"
+    "  <interface name='org.gtk.Actions'>"
+    "    <method name='List'>"
+    "      <arg type='as' name='list' direction='out'/>"
+    "    </method>"
+    "    <method name='Describe'>"
+    "      <arg type='s' name='action_name' direction='in'/>"
+    "      <arg type='(bgav)' name='description' direction='out'/>"
+    "    </method>"
+    "    <method name='DescribeAll'>"
+    "      <arg type='a{s(bgav)}' name='descriptions' direction='out'/>"
+    "    </method>"
+    "    <method name='Activate'>"
+    "      <arg type='s' name='action_name' direction='in'/>"
+    "      <arg type='av' name='parameter' direction='in'/>"
+    "      <arg type='a{sv}' name='platform_data' direction='in'/>"
+    "    </method>"
+    "    <method name='SetState'>"
+    "      <arg type='s' name='action_name' direction='in'/>"
+    "      <arg type='v' name='value' direction='in'/>"
+    "      <arg type='a{sv}' name='platform_data' direction='in'/>"
+    "    </method>"
+    "    <signal name='Changed'>"
+    "      <arg type='as' name='removals'/>"
+    "      <arg type='a{sb}' name='enable_changes'/>"
+    "      <arg type='a{sv}' name='state_changes'/>"
+    "      <arg type='a{s(bgav)}' name='additions'/>"
+    "    </signal>"
+    "  </interface>"
+    "  <interface name='org.gtk.Menus'>"
+    "    <method name='Start'>"
+    "      <arg type='au' name='groups' direction='in'/>"
+    "      <arg type='a(uuaa{sv})' name='content' direction='out'/>"
+    "    </method>"
+    "    <method name='End'>"
+    "      <arg type='au' name='groups' direction='in'/>"
+    "    </method>"
+    "    <signal name='Changed'>"
+    "      <arg type='a(uuuuaa{sv})' name='changes'/>"
+    "    </signal>"
+    "  </interface>"
+    "</node>";
+
+/* Handle errors into exceptions and make sure we free the
+   error as well */
+inline static void check_error(GError* error, const std::string& message)
+{
+    if (error == nullptr)
+    {
+        return;
+    }
+    auto fullmessage = message + ": " + error->message;
+    g_error_free(error);
+    throw std::runtime_error(fullmessage);
+}
+
+/** Parsed once, the interface infos are shared by every node */
+static GDBusNodeInfo* interfaces_info()
+{
+    static GDBusNodeInfo* info = []() {
+        GError* error = nullptr;
+        auto parsed = g_dbus_node_info_new_for_xml(INTERFACES_XML, &error);
+        check_error(error, "Unable to parse export interfaces");
+        return parsed;
+    }();
+    return info;
+}
+
+/* ------------------------------
+   org.gtk.Actions
+   ------------------------------ */
+
+/** Builds the (bgav) description of an action
+    \return Floating reference, or nullptr if there's no such action
+*/
+static GVariant* describe_action(GActionGroup* group, const gchar* name)
+{
+    gboolean enabled = FALSE;
+    const GVariantType* paramType = nullptr;
+    GVariant* state = nullptr;
+
+    if (!g_action_group_query_action(group, name, &enabled, &paramType, nullptr, nullptr, &state))
+    {
+        return nullptr;
+    }
+
+    GVariantBuilder states;
+    g_variant_builder_init(&states, G_VARIANT_TYPE("av"));
+    if (state != nullptr)
+    {
+        g_variant_builder_add(&states, "v", state);
+        g_variant_unref(state);
+    }
+
+    auto signature = paramType != nullptr ? g_variant_type_dup_string(paramType) : g_strdup("");
+    auto description = g_variant_new("(bg@av)", enabled, signature, g_variant_builder_end(&states));
+    g_free(signature);
+
+    return description;
+}
+
+static void handle_actions(ExportTree::Node& node, GDBusMethodInvocation* invocation)
+{
+    auto group = G_ACTION_GROUP(node.actions.get());
+    std::string method = g_dbus_method_invocation_get_method_name(invocation);
+    auto parameters = g_dbus_method_invocation_get_parameters(invocation);
+
+    if (method == "List")
+    {
+        auto names = g_action_group_list_actions(group);
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", names));
+        g_strfreev(names);
+    }
+    else if (method == "Describe")
+    {
+        const gchar* name = nullptr;
+        g_variant_get(parameters, "(&s)", &name);
+
+        auto description = describe_action(group, name);
+        if (description == nullptr)
+        {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                  "Unknown action '%s'", name);
+            return;
+        }
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(@(bgav))", description));
+    }
+    else if (method == "DescribeAll")
+    {
+        GVariantBuilder all;
+        g_variant_builder_init(&all, G_VARIANT_TYPE("a{s(bgav)}"));
+
+        auto names = g_action_group_list_actions(group);
+        for (auto name = names; *name != nullptr; name++)
+        {
+            auto description = describe_action(group, *name);
+            if (description != nullptr)
+            {
+                g_variant_builder_add(&all, "{s@(bgav)}", *name, description);
+            }
+        }
+        g_strfreev(names);
+
+        g_dbus_method_invocation_return_value(invocation, g_variant_new("(@a{s(bgav)})", g_variant_builder_end(&all)));
+    }
+    else if (method == "Activate")
+    {
+        const gchar* name = nullptr;
+        GVariant* paramList = nullptr;
+        GVariant* platform = nullptr;
+        g_variant_get(parameters, "(&s@av@a{sv})", &name, &paramList, &platform);
+
+        GVariant* param = nullptr;
+        if (g_variant_n_children(paramList) > 0)
+        {
+            g_variant_get_child(paramList, 0, "v", &param);
+        }
+
+        if (g_action_group_has_action(group, name))
+        {
+            g_action_group_activate_action(group, name, param);
+            g_dbus_method_invocation_return_value(invocation, nullptr);
+        }
+        else
+        {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                  "Unknown action '%s'", name);
+        }
+
+        if (param != nullptr)
+        {
+            g_variant_unref(param);
+        }
+        g_variant_unref(paramList);
+        g_variant_unref(platform);
+    }
+    else if (method == "SetState")
+    {
+        const gchar* name = nullptr;
+        GVariant* value = nullptr;
+        GVariant* platform = nullptr;
+        g_variant_get(parameters, "(&sv@a{sv})", &name, &value, &platform);
+
+        auto stateType = g_action_group_get_action_state_type(group, name);
+        if (stateType != nullptr && g_variant_is_of_type(value, stateType))
+        {
+            g_action_group_change_action_state(group, name, value);
+            g_dbus_method_invocation_return_value(invocation, nullptr);
+        }
+        else
+        {
+            g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                  "Unable to set the state of action '%s'", name);
+        }
+
+        g_variant_unref(value);
+        g_variant_unref(platform);
+    }
+    else
+    {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "Unknown method '%s'", method.c_str());
+    }
+}
+
+/** The four parts of an org.gtk.Actions Changed signal */
+struct ActionChanges
+{
+    GVariantBuilder removals;
+    GVariantBuilder enables;
+    GVariantBuilder states;
+    GVariantBuilder additions;
+
+    ActionChanges()
+    {
+        g_variant_builder_init(&removals, G_VARIANT_TYPE("as"));
+        g_variant_builder_init(&enables, G_VARIANT_TYPE("a{sb}"));
+        g_variant_builder_init(&states, G_VARIANT_TYPE("a{sv}"));
+        g_variant_builder_init(&additions, G_VARIANT_TYPE("a{s(bgav)}"));
+    }
+
+    void emit(ExportTree::Node* node)
+    {
+        g_dbus_connection_emit_signal(node->bus.get(), nullptr, node->path.c_str(), ACTIONS_INTERFACE, "Changed",
+                                      g_variant_new("(asa{sb}a{sv}a{s(bgav)})", &removals, &enables, &states,
+                                                    &additions),
+                                      nullptr);
+    }
+};
+
+static void action_added(GActionGroup* group, gchar* name, gpointer user_data)
+{
+    auto description = describe_action(group, name);
+    if (description == nullptr)
+    {
+        return;
+    }
+
+    ActionChanges changes;
+    g_variant_builder_add(&changes.additions, "{s@(bgav)}", name, description);
+    changes.emit(static_cast<ExportTree::Node*>(user_data));
+}
+
+static void action_removed(GActionGroup* group, gchar* name, gpointer user_data)
+{
+    ActionChanges changes;
+    g_variant_builder_add(&changes.removals, "s", name);
+    changes.emit(static_cast<ExportTree::Node*>(user_data));
+}
+
+static void action_enabled_changed(GActionGroup* group, gchar* name, gboolean enabled, gpointer user_data)
+{
+    ActionChanges changes;
+    g_variant_builder_add(&changes.enables, "{sb}", name, enabled);
+    changes.emit(static_cast<ExportTree::Node*>(user_data));
+}
+
+static void action_state_changed(GActionGroup* group, gchar* name, GVariant* value, gpointer user_data)
+{
+    ActionChanges changes;
+    g_variant_builder_add(&changes.states, "{sv}", name, value);
+    changes.emit(static_cast<ExportTree::Node*>(user_data));
+}
+
+/* ------------------------------
+   org.gtk.Menus
+   ------------------------------ */
+
+/** Adds the attributes of \p count items starting at \p position to
+    an aa{sv} builder */
+static void add_menu_items(GVariantBuilder* items, GMenuModel* model, gint position, gint count)
+{
+    for (gint i = position; i < position + count; i++)
+    {
+        GVariantBuilder item;
+        g_variant_builder_init(&item, G_VARIANT_TYPE("a{sv}"));
+
+        auto iter = g_menu_model_iterate_item_attributes(model, i);
+        const gchar* name = nullptr;
+        GVariant* value = nullptr;
+        while (g_menu_attribute_iter_get_next(iter, &name, &value))
+        {
+            g_variant_builder_add(&item, "{sv}", name, value);
+            g_variant_unref(value);
+        }
+        g_object_unref(iter);
+
+        g_variant_builder_add(items, "a{sv}", &item);
+    }
+}
+
+/** Sends the menu changes that have built up as one Changed signal */
+static void emit_menu_changes(ExportTree::Node* node)
+{
+    if (node->menuFlush != nullptr)
+    {
+        g_source_destroy(node->menuFlush);
+        g_source_unref(node->menuFlush);
+        node->menuFlush = nullptr;
+    }
+
+    if (node->menuChanges.empty())
+    {
+        return;
+    }
+
+    GVariantBuilder changes;
+    g_variant_builder_init(&changes, G_VARIANT_TYPE("a(uuuuaa{sv})"));
+    for (const auto& change : node->menuChanges)
+    {
+        g_variant_builder_add_value(&changes, change.get());
+    }
+    node->menuChanges.clear();
+
+    g_dbus_connection_emit_signal(node->bus.get(), nullptr, node->path.c_str(), MENUS_INTERFACE, "Changed",
+                                  g_variant_new("(@a(uuuuaa{sv}))", g_variant_builder_end(&changes)), nullptr);
+}
+
+/** A watch on a menu subscriber's name, so it can find the subscriber
+    when the name goes away */
+struct MenuWatch
+{
+    ExportTree::Node* node;
+    std::string sender;
+};
+
+/* The subscriber is gone without calling End, on the node's context
+   where the watch was made. The watch is removed before the node. */
+static void menu_subscriber_vanished(GDBusConnection* connection, const gchar* name, gpointer user_data)
+{
+    auto watch = static_cast<MenuWatch*>(user_data);
+    auto node = watch->node;
+
+    auto found = node->menuSubscribers.find(watch->sender);
+    if (found == node->menuSubscribers.end())
+    {
+        return;
+    }
+
+    g_debug("Menu subscriber '%s' went away from '%s'", name, node->path.c_str());
+    auto id = found->second.watch;
+    node->menuSubscribers.erase(found);
+    g_bus_unwatch_name(id); /* Frees watch */
+}
+
+/** Counts a Start from \p sender, watching its name on the first */
+static void add_menu_subscriber(ExportTree::Node& node, const std::string& sender)
+{
+    auto& subscriber = node.menuSubscribers[sender];
+    subscriber.starts++;
+
+    if (subscriber.watch != 0 || sender.empty())
+    {
+        return;
+    }
+
+    subscriber.watch = g_bus_watch_name_on_connection(
+        node.bus.get(), sender.c_str(), G_BUS_NAME_WATCHER_FLAGS_NONE, nullptr, /* appeared */
+        menu_subscriber_vanished, new MenuWatch{&node, sender},
+        [](gpointer user_data) { delete static_cast<MenuWatch*>(user_data); });
+}
+
+/** Counts an End from \p sender, it is dropped after its last one */
+static void remove_menu_subscriber(ExportTree::Node& node, const std::string& sender)
+{
+    auto found = node.menuSubscribers.find(sender);
+    if (found == node.menuSubscribers.end())
+    {
+        return;
+    }
+
+    if (--found->second.starts > 0)
+    {
+        return;
+    }
+
+    auto id = found->second.watch;
+    node.menuSubscribers.erase(found);
+    if (id != 0)
+    {
+        g_bus_unwatch_name(id);
+    }
+}
+
+/** Forgets everyone reading the menu, and the changes waiting for them */
+static void clear_menu_subscribers(ExportTree::Node& node)
+{
+    for (auto& subscriber : node.menuSubscribers)
+    {
+        if (subscriber.second.watch != 0)
+        {
+            g_bus_unwatch_name(subscriber.second.watch);
+        }
+    }
+    node.menuSubscribers.clear();
+
+    if (node.menuFlush != nullptr)
+    {
+        g_source_destroy(node.menuFlush);
+        g_source_unref(node.menuFlush);
+        node.menuFlush = nullptr;
+    }
+    node.menuChanges.clear();
+}
+
+static void handle_menus(ExportTree::Node& node, GDBusMethodInvocation* invocation)
+{
+    auto model = G_MENU_MODEL(node.menus.get());
+    std::string method = g_dbus_method_invocation_get_method_name(invocation);
+    auto parameters = g_dbus_method_invocation_get_parameters(invocation);
+    auto sender = g_dbus_method_invocation_get_sender(invocation);
+
+    GVariantIter* groups = nullptr;
+    guint32 group = 0;
+    bool rootGroup = false;
+
+    if (method != "Start" && method != "End")
+    {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+                                              "Unknown method '%s'", method.c_str());
+        return;
+    }
+
+    /* We only have group zero, the root menu */
+    g_variant_get(parameters, "(au)", &groups);
+    while (g_variant_iter_next(groups, "u", &group))
+    {
+        if (group != 0)
+        {
+            continue;
+        }
+
+        rootGroup = true;
+        if (method == "Start")
+        {
+            add_menu_subscriber(node, sender != nullptr ? sender : "");
+        }
+        else
+        {
+            remove_menu_subscriber(node, sender != nullptr ? sender : "");
+        }
+    }
+    g_variant_iter_free(groups);
+
+    if (method == "End")
+    {
+        g_dbus_method_invocation_return_value(invocation, nullptr);
+        return;
+    }
+
+    /* Changes still waiting go out first, the reply has them already */
+    emit_menu_changes(&node);
+
+    GVariantBuilder content;
+    g_variant_builder_init(&content, G_VARIANT_TYPE("a(uuaa{sv})"));
+    if (rootGroup)
+    {
+        GVariantBuilder items;
+        g_variant_builder_init(&items, G_VARIANT_TYPE("aa{sv}"));
+        add_menu_items(&items, model, 0, g_menu_model_get_n_items(model));
+        g_variant_builder_add(&content, "(uu@aa{sv})", 0, 0, g_variant_builder_end(&items));
+    }
+
+    g_dbus_method_invocation_return_value(invocation, g_variant_new("(@a(uuaa{sv}))", g_variant_builder_end(&content)));
+}
+
+/* Each change to the menu is queued with the items as they are now,
+   and everything changed in one main loop iteration goes out together */
+static void menu_items_changed(GMenuModel* model, gint position, gint removed, gint added, gpointer user_data)
+{
+    auto node = static_cast<ExportTree::Node*>(user_data);
+    if (node->menuSubscribers.empty())
+    {
+        return;
+    }
+
+    GVariantBuilder items;
+    g_variant_builder_init(&items, G_VARIANT_TYPE("aa{sv}"));
+    add_menu_items(&items, model, position, added);
+
+    auto change = g_variant_new("(uuuu@aa{sv})", 0, 0, position, removed, g_variant_builder_end(&items));
+    node->menuChanges.emplace_back(g_variant_ref_sink(change), [](GVariant* change) { g_variant_unref(change); });
+
+    if (node->menuFlush != nullptr)
+    {
+        return;
+    }
+
+    /* The slot destroys the source before the node goes */
+    node->menuFlush = g_idle_source_new();
+    g_source_set_callback(node->menuFlush,
+                          [](gpointer user_data) -> gboolean {
+                              emit_menu_changes(static_cast<ExportTree::Node*>(user_data));
+                              return G_SOURCE_REMOVE;
+                          },
+                          node, nullptr); /* free func */
+    g_source_attach(node->menuFlush, node->context.get());
+}
+
+/* ------------------------------
+   ExportTree
+   ------------------------------ */
+
+/* One tree for each connection, a path can only be registered once */
+static std::mutex trees_lock;
+static std::map<GDBusConnection*, std::weak_ptr<ExportTree>> trees;
+
+/** The tree for \p bus, registering it if nothing has yet */
+std::shared_ptr<ExportTree> ExportTree::forConnection(const std::shared_ptr<GDBusConnection>& bus)
+{
+    std::lock_guard<std::mutex> guard(trees_lock);
+
+    auto found = trees.find(bus.get());
+    if (found != trees.end())
+    {
+        auto tree = found->second.lock();
+        if (tree)
+        {
+            return tree;
+        }
+    }
+
+    /* Deleting takes the lock so a new tree can't try to register
+       the root before the old one has unregistered it */
+    auto key = bus.get();
+    auto tree = std::shared_ptr<ExportTree>(new ExportTree(bus), [key](ExportTree* tree) {
+        std::lock_guard<std::mutex> guard(trees_lock);
+        delete tree;
+
+        auto found = trees.find(key);
+        if (found != trees.end() && found->second.expired())
+        {
+            trees.erase(found);
+        }
+    });
+    trees[key] = tree;
+    return tree;
+}
+
+/** Registers the subtree, the callbacks all come in on our thread */
+ExportTree::ExportTree(const std::shared_ptr<GDBusConnection>& in_bus)
+    : bus(in_bus)
+{
+    thread.setName("dbus-exports");
+
+    thread.executeOnThread<bool>([this]() {
+        static const GDBusSubtreeVTable vtable = {enumerate, introspect, dispatch};
+        GError* error = nullptr;
+
+        registration = g_dbus_connection_register_subtree(bus.get(), ROOT_PATH, &vtable,
+                                                          G_DBUS_SUBTREE_FLAGS_DISPATCH_TO_UNENUMERATED_NODES, this,
+                                                          nullptr, &error);
+        check_error(error, "Unable to register export subtree");
+        return true;
+    });
+}
+
+ExportTree::~ExportTree()
+{
+    thread.executeOnThread<bool>([this]() {
+        if (registration != 0)
+        {
+            g_dbus_connection_unregister_subtree(bus.get(), registration);
+        }
+        return true;
+    });
+}
+
+/** Makes \p node visible at its path */
+void ExportTree::add(const std::shared_ptr<Node>& node)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!nodes.emplace(node->name, node).second)
+    {
+        throw std::runtime_error("Export '" + node->name + "' already exists");
+    }
+}
+
+/** Takes the node at \p name off the bus */
+void ExportTree::remove(const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    nodes.erase(name);
+}
+
+/** The node at \p name, nullptr if there isn't one */
+std::shared_ptr<ExportTree::Node> ExportTree::find(const std::string& name) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto found = nodes.find(name);
+    if (found == nodes.end())
+    {
+        return {};
+    }
+    return found->second;
+}
+
+/** Number of nodes that are exported */
+std::size_t ExportTree::size() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return nodes.size();
+}
+
+gchar** ExportTree::enumerate(GDBusConnection* connection,
+                              const gchar* sender,
+                              const gchar* object_path,
+                              gpointer user_data)
+{
+    auto tree = static_cast<ExportTree*>(user_data);
+    std::lock_guard<std::mutex> guard(tree->lock);
+
+    auto names = g_new0(gchar*, tree->nodes.size() + 1);
+    std::size_t i = 0;
+    for (auto& node : tree->nodes)
+    {
+        names[i++] = g_strdup(node.first.c_str());
+    }
+    return names;
+}
+
+GDBusInterfaceInfo** ExportTree::introspect(GDBusConnection* connection,
+                               const gchar* sender,
+                               const gchar* object_path,
+                               const gchar* node,
+                               gpointer user_data)
+{
+    auto tree = static_cast<ExportTree*>(user_data);
+
+    /* The root has no interfaces of its own */
+    if (node == nullptr)
+    {
+        return g_new0(GDBusInterfaceInfo*, 1);
+    }
+
+    if (!tree->find(node))
+    {
+        return nullptr;
+    }
+
+    auto info = interfaces_info();
+    auto interfaces = g_new0(GDBusInterfaceInfo*, 3);
+    interfaces[0] = g_dbus_interface_info_ref(info->interfaces[0]);
+    interfaces[1] = g_dbus_interface_info_ref(info->interfaces[1]);
+    return interfaces;
+}
+
+const GDBusInterfaceVTable* ExportTree::dispatch(GDBusConnection* connection,
+                                                 const gchar* sender,
+                                                 const gchar* object_path,
+                                                 const gchar* interface_name,
+                                                 const gchar* node,
+                                                 gpointer* out_user_data,
+                                                 gpointer user_data)
+{
+    static const GDBusInterfaceVTable vtable = {methodCall, nullptr, nullptr};
+
+    if (node == nullptr ||
+        (g_strcmp0(interface_name, ACTIONS_INTERFACE) != 0 && g_strcmp0(interface_name, MENUS_INTERFACE) != 0))
+    {
+        return nullptr;
+    }
+
+    *out_user_data = user_data;
+    return &vtable;
+}
+
+/** A method call passed to the context of the node it is for */
+struct NodeCall
+{
+    std::shared_ptr<ExportTree::Node> node;
+    GDBusMethodInvocation* invocation;
+};
+
+/** Finds the node and passes the call over to its context, where it
+    is handled and replied to */
+void ExportTree::methodCall(GDBusConnection* connection,
+                            const gchar* sender,
+                            const gchar* object_path,
+                            const gchar* interface_name,
+                            const gchar* method_name,
+                            GVariant* parameters,
+                            GDBusMethodInvocation* invocation,
+                            gpointer user_data)
+{
+    auto tree = static_cast<ExportTree*>(user_data);
+
+    std::shared_ptr<Node> node;
+    auto rootlen = std::strlen(ROOT_PATH);
+    if (std::strncmp(object_path, ROOT_PATH, rootlen) == 0 && object_path[rootlen] == '/')
+    {
+        node = tree->find(object_path + rootlen + 1);
+    }
+
+    if (!node)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_OBJECT,
+                                              "No export at '%s'", object_path);
+        return;
+    }
+
+    auto context = node->context;
+    g_main_context_invoke_full(context.get(), G_PRIORITY_DEFAULT,
+                               [](gpointer user_data) -> gboolean {
+                                   auto call = static_cast<NodeCall*>(user_data);
+                                   auto invocation = call->invocation;
+                                   call->invocation = nullptr;
+
+                                   if (!call->node->exported)
+                                   {
+                                       g_dbus_method_invocation_return_error(
+                                           invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_OBJECT,
+                                           "Export '%s' was removed", call->node->path.c_str());
+                                   }
+                                   else if (g_strcmp0(g_dbus_method_invocation_get_interface_name(invocation),
+                                                      ACTIONS_INTERFACE) == 0)
+                                   {
+                                       handle_actions(*call->node, invocation);
+                                   }
+                                   else
+                                   {
+                                       handle_menus(*call->node, invocation);
+                                   }
+                                   return G_SOURCE_REMOVE;
+                               },
+                               new NodeCall{node, invocation},
+                               [](gpointer user_data) {
+                                   auto call = static_cast<NodeCall*>(user_data);
+                                   /* Dropped without running, still needs a reply */
+                                   if (call->invocation != nullptr)
+                                   {
+                                       g_dbus_method_invocation_return_error(call->invocation, G_DBUS_ERROR,
+                                                                             G_DBUS_ERROR_FAILED,
+                                                                             "Export is shutting down");
+                                   }
+                                   delete call;
+                               });
+}
+
+/* ------------------------------
+   ExportSlot
+   ------------------------------ */
+
+/** Builds the action group and menu and adds them to the tree for \p bus
+    \param bus Session bus connection to export on
+    \param name Path segment to export at, must not be in use
+*/
+ExportSlot::ExportSlot(const std::shared_ptr<GDBusConnection>& bus, const std::string& name)
+    : tree(ExportTree::forConnection(bus))
+    , node(std::make_shared<ExportTree::Node>())
+{
+    node->name = name;
+    node->path = std::string(ExportTree::ROOT_PATH) + "/" + name;
+    node->bus = bus;
+    node->context = std::shared_ptr<GMainContext>(g_main_context_ref_thread_default(),
+                                                  [](GMainContext* context) { g_main_context_unref(context); });
+    g_debug("DBus Path: %s", node->path.c_str());
+
+    /* Setup Actions */
+    node->actions = std::shared_ptr<GSimpleActionGroup>(g_simple_action_group_new(),
+                                                        [](GSimpleActionGroup* group) { g_clear_object(&group); });
+    auto pwaction = g_simple_action_new_stateful("response", nullptr, g_variant_new_string(""));
+    g_action_map_add_action(G_ACTION_MAP(node->actions.get()), G_ACTION(pwaction));
+    g_object_unref(pwaction);
+
+    auto actions = node->actions.get();
+    actionSignals.push_back(g_signal_connect(actions, "action-added", G_CALLBACK(action_added), node.get()));
+    actionSignals.push_back(g_signal_connect(actions, "action-removed", G_CALLBACK(action_removed), node.get()));
+    actionSignals.push_back(
+        g_signal_connect(actions, "action-enabled-changed", G_CALLBACK(action_enabled_changed), node.get()));
+    actionSignals.push_back(
+        g_signal_connect(actions, "action-state-changed", G_CALLBACK(action_state_changed), node.get()));
+
+    /* Setup Menus */
+    node->menus = std::shared_ptr<GMenu>(g_menu_new(), [](GMenu* menu) { g_clear_object(&menu); });
+    menuSignal = g_signal_connect(node->menus.get(), "items-changed", G_CALLBACK(menu_items_changed), node.get());
+
+    tree->add(node);
+}
+
+ExportSlot::~ExportSlot()
+{
+    for (auto signal : actionSignals)
+    {
+        g_signal_handler_disconnect(node->actions.get(), signal);
+    }
+    g_signal_handler_disconnect(node->menus.get(), menuSignal);
+
+    clear_menu_subscribers(*node);
+
+    node->exported = false;
+    tree->remove(node->name);
+}
+
+/** Clears the menu and the response so the next user starts fresh.
+    The next one is at the same path, and a client still subscribed to
+    it won't call Start again, so the subscribers are kept and hear
+    about the menu being emptied now. */
+void ExportSlot::reset()
+{
+    g_menu_remove_all(node->menus.get());
+    emit_menu_changes(node.get());
+
+    auto action = g_action_map_lookup_action(G_ACTION_MAP(node->actions.get()), "response"); /* No transfer */
+    if (action != nullptr && G_IS_SIMPLE_ACTION(action))
+    {
+        g_simple_action_set_state(G_SIMPLE_ACTION(action), g_variant_new_string(""));
+    }
+}
+
+const std::string& ExportSlot::path() const
+{
+    return node->path;
+}
+
+std::shared_ptr<GDBusConnection> ExportSlot::connection() const
+{
+    return node->bus;
+}
+
+std::shared_ptr<GSimpleActionGroup> ExportSlot::actions() const
+{
+    return node->actions;
+}
+
+std::shared_ptr<GMenu> ExportSlot::menus() const
+{
+    return node->menus;
+}
+
+/** A path segment that no other slot in the process has used */
+std::string ExportSlot::nextName()
+{
+    static std::atomic<unsigned int> slotCount{0};
+    return "authentication" + std::to_string(++slotCount);
+}
+
+/* ------------------------------
+   ExportPool
+   ------------------------------ */
+
+/** Builds an empty pool, slots are made as they're needed
+    \param bus Session bus to export the slots on
+    \param maxIdle Most slots to keep when they aren't leased
+*/
+std::shared_ptr<ExportPool> ExportPool::create(const std::shared_ptr<SessionBus>& bus, unsigned int maxIdle)
+{
+    return std::shared_ptr<ExportPool>(new ExportPool(bus, maxIdle));
+}
+
+ExportPool::ExportPool(const std::shared_ptr<SessionBus>& in_bus, unsigned int in_maxIdle)
+    : maxIdle(in_maxIdle)
+    , sessionBus(in_bus)
+{
+}
+
+/** Hands out an idle slot, or exports a new one if there aren't any.
+    The slot comes back to the pool when the last reference to it is
+    dropped, or is destroyed if the pool is gone by then. */
+std::shared_ptr<ExportSlot> ExportPool::lease()
+{
+    auto current = sessionBus->connection();
+    if (!current)
+    {
+        throw std::runtime_error("Session bus isn't connected");
+    }
+
+    if (current != bus)
+    {
+        idleSlots.clear();
+        bus = current;
+    }
+
+    std::unique_ptr<ExportSlot> slot;
+    if (!idleSlots.empty())
+    {
+        slot = std::move(idleSlots.back());
+        idleSlots.pop_back();
+    }
+    else
+    {
+        slot = std::unique_ptr<ExportSlot>(new ExportSlot(bus, ExportSlot::nextName()));
+        createdSlots++;
+    }
+
+    std::weak_ptr<ExportPool> weakpool = shared_from_this();
+    return std::shared_ptr<ExportSlot>(slot.release(), [weakpool](ExportSlot* slot) {
+        auto pool = weakpool.lock();
+        if (pool)
+        {
+            pool->giveBack(slot);
+        }
+        else
+        {
+            delete slot;
+        }
+    });
+}
+
+/** Number of slots waiting to be leased */
+std::size_t ExportPool::idle() const
+{
+    return idleSlots.size();
+}
+
+/** Number of slots this pool has exported */
+std::uint64_t ExportPool::created() const
+{
+    return createdSlots;
+}
+
+/** Takes back a slot from a lease */
+void ExportPool::giveBack(ExportSlot* slot)
+{
+    std::unique_ptr<ExportSlot> returned(slot);
+
+    if (idleSlots.size() >= maxIdle || returned->connection() != bus)
+    {
+        return;
+    }
+
+    returned->reset();
+    idleSlots.push_back(std::move(returned));
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <gio/gio.h>
+
+#include "glib-thread.h"
+#include "session-bus.h"
+
+/** \brief Serves the menus and actions of every Authentication on DBus
+
+    Rather than registering an action group and a menu model with
+    GDBus for each Authentication, one subtree is registered at
+    ROOT_PATH for the connection and it implements the org.gtk.Actions
+    and org.gtk.Menus interfaces itself. Each exported Node is a path
+    segment under the root, adding or removing one is a map insert or
+    erase and GDBus's object table stays the same size however many
+    authentications are running.
+
+    GDBus calls the subtree on the tree's own thread, which looks up
+    the node and passes the call to the context the node was added
+    on. The action group and the menu are only ever touched there.
+
+    Our menus are flat, items with links to other menu models are
+    exported with only their attributes. Changes to a menu are sent
+    from an idle on its context, so everything changed in one main
+    loop iteration is one Changed signal.
+*/
+class ExportTree
+{
+public:
+    /** Object path that everything is exported under */
+    static const char* const ROOT_PATH;
+
+    /** \brief A client that has called Start on a node's menu */
+    struct MenuSubscriber
+    {
+        unsigned int starts = 0; /**< Starts it hasn't ended yet */
+        guint watch = 0;         /**< Watch on its name, so it is dropped when it goes away */
+    };
+
+    /** \brief An action group and menu exported at one path */
+    struct Node
+    {
+        std::string name;                                                /**< Path segment under ROOT_PATH */
+        std::string path;                                                /**< Full object path */
+        std::shared_ptr<GDBusConnection> bus;                            /**< Connection to send signals on */
+        std::shared_ptr<GMainContext> context;                           /**< Context the actions and menus belong to */
+        std::shared_ptr<GSimpleActionGroup> actions;                     /**< Actions served as org.gtk.Actions */
+        std::shared_ptr<GMenu> menus;                                    /**< Menu served as org.gtk.Menus */
+        bool exported = true;                                            /**< Cleared on context when it is removed */
+        std::unordered_map<std::string, MenuSubscriber> menuSubscribers; /**< Clients reading the menu, by sender */
+        std::vector<std::shared_ptr<GVariant>> menuChanges;              /**< Menu changes waiting to be sent as one */
+        GSource* menuFlush = nullptr;                                    /**< Idle that sends menuChanges, if any */
+    };
+
+    static std::shared_ptr<ExportTree> forConnection(const std::shared_ptr<GDBusConnection>& bus);
+    ~ExportTree();
+
+    ExportTree(const ExportTree&) = delete;
+    ExportTree& operator=(const ExportTree&) = delete;
+
+    void add(const std::shared_ptr<Node>& node);
+    void remove(const std::string& name);
+    std::shared_ptr<Node> find(const std::string& name) const;
+
+    std::size_t size() const;
+
+private:
+    explicit ExportTree(const std::shared_ptr<GDBusConnection>& bus);
+
+    static gchar** enumerate(GDBusConnection* connection,
+                             const gchar* sender,
+                             const gchar* object_path,
+                             gpointer user_data);
+    static GDBusInterfaceInfo** introspect(GDBusConnection* connection,
+                                           const gchar* sender,
+                                           const gchar* object_path,
+                                           const gchar* node,
+                                           gpointer user_data);
+    static const GDBusInterfaceVTable* dispatch(GDBusConnection* connection,
+                                                const gchar* sender,
+                                                const gchar* object_path,
+                                                const gchar* interface_name,
+                                                const gchar* node,
+                                                gpointer* out_user_data,
+                                                gpointer user_data);
+    static void methodCall(GDBusConnection* connection,
+                           const gchar* sender,
+                           const gchar* object_path,
+                           const gchar* interface_name,
+                           const gchar* method_name,
+                           GVariant* parameters,
+                           GDBusMethodInvocation* invocation,
+                           gpointer user_data);
+
+    std::shared_ptr<GDBusConnection> bus;
+    mutable std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<Node>> nodes; /**< Exported nodes by path segment */
+    guint registration = 0;                                        /**< ID of the subtree registration */
+    GLib::ContextThread thread;                                    /**< Where GDBus calls the subtree */
+};
+
+/** \brief An action group and menu model exported on the session bus
+
+    The snap decision for an Authentication reads its menu and sets
+    its response through these. The slot holds the "response" action
+    and adds both to the ExportTree under a unique name when it is
+    built, and removes them when it is destroyed. It must be destroyed
+    on the thread it was built on.
+*/
+class ExportSlot
+{
+public:
+    ExportSlot(const std::shared_ptr<GDBusConnection>& bus, const std::string& name);
+    ~ExportSlot();
+
+    ExportSlot(const ExportSlot&) = delete;
+    ExportSlot& operator=(const ExportSlot&) = delete;
+
+    void reset();
+
+    const std::string& path() const;
+    std::shared_ptr<GDBusConnection> connection() const;
+    std::shared_ptr<GSimpleActionGroup> actions() const;
+    std::shared_ptr<GMenu> menus() const;
+
+    static std::string nextName();
+
+private:
+    std::shared_ptr<ExportTree> tree;
+    std::shared_ptr<ExportTree::Node> node;
+    std::vector<gulong> actionSignals; /**< Handlers forwarding action changes to DBus */
+    gulong menuSignal = 0;             /**< Handler forwarding menu changes to DBus */
+};
+
+/** \brief Keeps exported slots around between Authentications
+
+    Building a slot means building the GObjects and adding them to the
+    ExportTree. Instead of doing that for every Authentication the
+    slots are leased from here and come back when the lease is
+    dropped, cleared out and ready for the next one. Once there are
+    as many slots as there are concurrent Authentications leasing one
+    doesn't allocate anything. When the session bus reconnects the idle
+    slots are for the old connection, so they're dropped.
+
+    The action group and menu belong to the thread that built them,
+    so a pool belongs to a single thread: it must only be used, and
+    leases dropped, on the thread it was created on.
+*/
+class ExportPool : public std::enable_shared_from_this<ExportPool>
+{
+public:
+    /** Most idle slots kept by default, more than that are destroyed */
+    static const unsigned int DEFAULT_MAX_IDLE = 8;
+
+    static std::shared_ptr<ExportPool> create(const std::shared_ptr<SessionBus>& bus,
+                                              unsigned int maxIdle = DEFAULT_MAX_IDLE);
+
+    ExportPool(const ExportPool&) = delete;
+    ExportPool& operator=(const ExportPool&) = delete;
+
+    std::shared_ptr<ExportSlot> lease();
+
+    std::size_t idle() const;
+    std::uint64_t created() const;
+
+private:
+    ExportPool(const std::shared_ptr<SessionBus>& bus, unsigned int maxIdle);
+
+    void giveBack(ExportSlot* slot);
+
+    unsigned int maxIdle;
+    std::shared_ptr<SessionBus> sessionBus; /**< Where the connection for new slots comes from */
+    std::shared_ptr<GDBusConnection> bus;   /**< Connection the idle slots are exported on */
+    std::vector<std::unique_ptr<ExportSlot>> idleSlots;
+    std::uint64_t createdSlots = 0;
+};
@@ -0,0 +1,229 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+#include "job.h"
+
+namespace GLib
+{
+
+template <typename T>
+class Future;
+template <typename T>
+class Promise;
+
+/** Shared state between a Promise and its Future */
+template <typename T>
+class FutureState
+{
+    friend class Future<T>;
+    friend class Promise<T>;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool ready = false;
+    std::unique_ptr<T> value;
+    std::exception_ptr error;
+    /** Run once when the state becomes ready, may be empty */
+    Job continuation;
+
+    void complete(std::unique_ptr<T> in_value, std::exception_ptr in_error)
+    {
+        Job cont;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (ready)
+            {
+                throw std::logic_error("Promise already satisfied");
+            }
+            value = std::move(in_value);
+            error = in_error;
+            ready = true;
+            cont = std::move(continuation);
+        }
+        cond.notify_all();
+
+        /* Call outside the lock, it's going to look at the value */
+        if (cont)
+        {
+            cont();
+        }
+    }
+};
+
+/** \brief Result of work that has been queued on a ContextThread
+
+    A lightweight future that can either be waited on with get(),
+    or, without ever blocking, have a continuation scheduled on a
+    ContextThread with then(). A Future has a single consumer, so
+    only one of get() or then() should be used on it.
+
+    Void results aren't supported, use a bool like the rest of the
+    ContextThread interfaces do.
+*/
+template <typename T>
+class Future
+{
+    friend class Promise<T>;
+
+    std::shared_ptr<FutureState<T>> state;
+
+    explicit Future(const std::shared_ptr<FutureState<T>>& in_state)
+        : state(in_state)
+    {
+    }
+
+public:
+    Future() = default;
+
+    /** Whether this future is attached to a promise */
+    bool valid() const
+    {
+        return (bool)state;
+    }
+
+    /** Whether get() would return without blocking */
+    bool isReady() const
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        return state->ready;
+    }
+
+    /** Waits for the value and returns it, rethrowing any exception
+        that was thrown by the work. Never call this on the thread that
+        is supposed to satisfy the promise. */
+    T get()
+    {
+        std::unique_lock<std::mutex> guard(state->lock);
+        state->cond.wait(guard, [this]() { return state->ready; });
+
+        if (state->error)
+        {
+            std::rethrow_exception(state->error);
+        }
+        return std::move(*state->value);
+    }
+
+    /** Schedules \p func on \p thread once this future is ready. It
+        is passed a ready Future so that it can look at errors as well
+        as values, calling get() on it won't block.
+
+        \param thread ContextThread to run the continuation on
+        \param func Function taking a Future<T> and returning a value
+        \return A Future for the value returned by \p func
+    */
+    template <typename Thread, typename F>
+    auto then(Thread& thread, F func) -> Future<decltype(func(std::declval<Future<T>>()))>
+    {
+        using U = decltype(func(std::declval<Future<T>>()));
+
+        Promise<U> next;
+        auto nextFuture = next.getFuture();
+        /* Weak so that a promise that is never satisfied doesn't keep
+           itself alive through its own continuation */
+        std::weak_ptr<FutureState<T>> weakState = state;
+
+        Job cont = [&thread, weakState, next, func]() mutable {
+            auto ready = Future<T>(weakState.lock());
+            try
+            {
+                thread.executeOnThread([ready, next, func]() mutable {
+                    try
+                    {
+                        next.setValue(func(ready));
+                    }
+                    catch (...)
+                    {
+                        next.setException(std::current_exception());
+                    }
+                });
+            }
+            catch (std::runtime_error& e)
+            {
+                /* The thread is shutting down, there's nowhere
+                   left to run the continuation. */
+                next.setException(std::current_exception());
+            }
+        };
+
+        bool alreadyReady = false;
+        {
+            std::lock_guard<std::mutex> guard(state->lock);
+            alreadyReady = state->ready;
+            if (!alreadyReady)
+            {
+                state->continuation = std::move(cont);
+            }
+        }
+
+        if (alreadyReady)
+        {
+            cont();
+        }
+
+        return nextFuture;
+    }
+};
+
+/** \brief The producing side of a Future */
+template <typename T>
+class Promise
+{
+    std::shared_ptr<FutureState<T>> state;
+
+public:
+    Promise()
+        : state(std::make_shared<FutureState<T>>())
+    {
+    }
+
+    Future<T> getFuture()
+    {
+        return Future<T>(state);
+    }
+
+    void setValue(T value)
+    {
+        state->complete(std::unique_ptr<T>(new T(std::move(value))), nullptr);
+    }
+
+    void setException(std::exception_ptr error)
+    {
+        state->complete(nullptr, error);
+    }
+};
+
+/** Builds a Future that already has a value */
+template <typename T>
+Future<T> makeReadyFuture(T value)
+{
+    Promise<T> promise;
+    promise.setValue(std::move(value));
+    return promise.getFuture();
+}
+
+}  // ns GLib
@@ -0,0 +1,139 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "glib-thread-pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+namespace GLib
+{
+
+/** Most threads we'll make by default, authentications spend their
+    time waiting on the user so there is no point in one per core on
+    a big machine */
+static const unsigned int DEFAULT_MAX_THREADS = 4;
+
+/** Builds the pool
+    \param size Number of threads, zero for defaultSize()
+*/
+ContextThreadPool::ContextThreadPool(unsigned int size)
+{
+    if (size == 0)
+    {
+        size = defaultSize();
+    }
+
+    for (unsigned int i = 0; i < size; i++)
+    {
+        auto member = std::unique_ptr<Member>(new Member);
+        member->thread = std::unique_ptr<ContextThread>(new ContextThread());
+        members.push_back(std::move(member));
+    }
+}
+
+ContextThreadPool::~ContextThreadPool()
+{
+    /* Let each one finish up, in reverse order of creation */
+    while (!members.empty())
+    {
+        members.pop_back();
+    }
+}
+
+/** Number of threads to use when none is given, one per core up
+    to a small limit */
+unsigned int ContextThreadPool::defaultSize()
+{
+    auto cores = std::thread::hardware_concurrency();
+    return std::max(1u, std::min(cores, DEFAULT_MAX_THREADS));
+}
+
+/** Picks the least loaded thread and pins one more object to it.
+    Load is the number of pinned objects plus the number of jobs
+    waiting in the thread's queue, so a thread that is behind gets
+    skipped even if it has few objects.
+    \return The thread to build the object on
+*/
+ContextThread& ContextThreadPool::acquire()
+{
+    auto count = members.size();
+    auto start = next.fetch_add(1, std::memory_order_relaxed) % count;
+
+    Member* best = nullptr;
+    std::uint64_t bestLoad = 0;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        auto& member = members[(start + i) % count];
+        auto load = member->pinned.load(std::memory_order_relaxed) + member->thread->queueDepth();
+        if (best == nullptr || load < bestLoad)
+        {
+            best = member.get();
+            bestLoad = load;
+        }
+    }
+
+    best->pinned++;
+    return *best->thread;
+}
+
+/** Unpins an object from a thread returned by acquire() */
+void ContextThreadPool::release(ContextThread& thread)
+{
+    for (auto& member : members)
+    {
+        if (member->thread.get() == &thread)
+        {
+            member->pinned--;
+            return;
+        }
+    }
+
+    throw std::logic_error("Releasing a thread that isn't in the pool");
+}
+
+unsigned int ContextThreadPool::size() const
+{
+    return members.size();
+}
+
+/** Number of objects pinned to the thread at \p index */
+unsigned int ContextThreadPool::pinned(unsigned int index) const
+{
+    return members.at(index)->pinned.load();
+}
+
+ContextThread& ContextThreadPool::operator[](unsigned int index)
+{
+    return *members.at(index)->thread;
+}
+
+/** Snapshot of the statistics of every thread in the pool */
+std::vector<ContextThread::Stats> ContextThreadPool::stats() const
+{
+    std::vector<ContextThread::Stats> all;
+    for (auto& member : members)
+    {
+        all.push_back(member->thread->stats());
+    }
+    return all;
+}
+
+}  // ns GLib
@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "glib-thread.h"
+
+namespace GLib
+{
+
+/** \brief A set of ContextThreads to spread long lived work across
+
+    Objects that are tied to a GMainContext, like anything that
+    connects GObject signals, can't move between threads once they've
+    been built. So rather than stealing queued work from each other
+    the threads in the pool compete for new work when it is placed:
+    acquire() hands out the thread with the least pinned work and the
+    shortest queue, so an idle thread picks up the next object and a
+    thread that is stuck waiting on a slow D-Bus call gets left alone.
+
+    Whoever acquires a thread must release() it when the object pinned
+    to it is gone.
+*/
+class ContextThreadPool
+{
+public:
+    explicit ContextThreadPool(unsigned int size = 0);
+    ~ContextThreadPool();
+
+    ContextThreadPool(const ContextThreadPool&) = delete;
+    ContextThreadPool& operator=(const ContextThreadPool&) = delete;
+
+    ContextThread& acquire();
+    void release(ContextThread& thread);
+
+    unsigned int size() const;
+    unsigned int pinned(unsigned int index) const;
+    ContextThread& operator[](unsigned int index);
+
+    std::vector<ContextThread::Stats> stats() const;
+
+    static unsigned int defaultSize();
+
+private:
+    struct Member
+    {
+        std::unique_ptr<ContextThread> thread;
+        /** Objects currently pinned to the thread */
+        std::atomic<unsigned int> pinned{0};
+    };
+
+    std::vector<std::unique_ptr<Member>> members;
+    /** Where to start looking so that ties are spread around */
+    std::atomic<unsigned int> next{0};
+};
+
+}  // ns GLib
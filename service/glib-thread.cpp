@@ -18,11 +18,36 @@
  */
 
 #include "glib-thread.h"
+#include "glib-watchdog.h"
+
+#include <limits>
 
 namespace GLib
 {
 
-ContextThread::ContextThread(std::function<void()> beforeLoop, std::function<void()> afterLoop)
+/** The most jobs we'll run in a single dispatch before giving the
+    other sources on the context a chance to run */
+static const unsigned int JOB_BATCH_SIZE = 64;
+
+/** How long the destructor will keep running leftover work */
+static const std::chrono::milliseconds SHUTDOWN_DRAIN_TIME{500};
+/** Most jobs the destructor will run before giving up */
+static const unsigned int SHUTDOWN_DRAIN_JOBS = 4096;
+
+const unsigned int ContextThread::PRIORITIES;
+
+/** The ContextThread whose loop is running on this thread, for the
+    poll function which doesn't get any user data */
+static thread_local ContextThread* pollOwner = nullptr;
+
+/** A GSource that knows which ContextThread it belongs to */
+struct JobSource
+{
+    GSource source;
+    ContextThread* thread;
+};
+
+ContextThread::ContextThread(Job beforeLoop, Job afterLoop)
 {
     _cancel = std::shared_ptr<GCancellable>(g_cancellable_new(), [](GCancellable* cancel) {
         if (cancel != nullptr)
@@ -33,10 +58,10 @@ ContextThread::ContextThread(std::function<void()> beforeLoop, std::function<voi
     });
     std::promise<std::pair<std::shared_ptr<GMainContext>, std::shared_ptr<GMainLoop>>> context_promise;
 
-    /* NOTE: We copy afterLoop but reference beforeLoop. We're blocking so we
+    /* NOTE: We move afterLoop but reference beforeLoop. We're blocking so we
        know that beforeLoop will stay valid long enough, but we can't say the
        same for afterLoop */
-    _thread = std::thread([&context_promise, &beforeLoop, afterLoop, this]() {
+    _thread = std::thread([&context_promise, &beforeLoop, afterLoop = std::move(afterLoop), this]() mutable {
         /* Build up the context and loop for the async events and a place
            for GDBus to send its events back to */
         auto context = std::shared_ptr<GMainContext>(
@@ -46,6 +71,10 @@ ContextThread::ContextThread(std::function<void()> beforeLoop, std::function<voi
 
         g_main_context_push_thread_default(context.get());
 
+        /* Beat the heart for the watchdog each time we come out of poll */
+        pollOwner = this;
+        g_main_context_set_poll_func(context.get(), heartbeatPoll);
+
         beforeLoop();
 
         /* Free's the constructor to continue */
@@ -74,14 +103,61 @@ ContextThread::ContextThread(std::function<void()> beforeLoop, std::function<voi
     {
         throw std::runtime_error("Unable to create GLib Thread");
     }
+
+    /* One source for all of the jobs on this thread, it sleeps until
+       wakeup() sets its ready time. */
+    static GSourceFuncs jobSourceFuncs = {
+        nullptr,           /* prepare */
+        nullptr,           /* check */
+        jobSourceDispatch, /* dispatch */
+        nullptr,           /* finalize */
+        nullptr,           /* closure_callback */
+        nullptr            /* closure_marshal */
+    };
+
+    _jobSource = std::shared_ptr<GSource>(g_source_new(&jobSourceFuncs, sizeof(JobSource)), [](GSource* src) {
+        g_source_destroy(src);
+        g_source_unref(src);
+    });
+    reinterpret_cast<JobSource*>(_jobSource.get())->thread = this;
+    g_source_set_name(_jobSource.get(), "ContextThread job queue");
+    g_source_set_ready_time(_jobSource.get(), -1);
+    g_source_attach(_jobSource.get(), _context.get());
+
+    /* And one for all of the timeouts, armed for the next timer
+       that is due in the wheel. */
+    static GSourceFuncs timerSourceFuncs = {
+        nullptr,             /* prepare */
+        nullptr,             /* check */
+        timerSourceDispatch, /* dispatch */
+        nullptr,             /* finalize */
+        nullptr,             /* closure_callback */
+        nullptr              /* closure_marshal */
+    };
+
+    _timerSource = std::shared_ptr<GSource>(g_source_new(&timerSourceFuncs, sizeof(JobSource)), [](GSource* src) {
+        g_source_destroy(src);
+        g_source_unref(src);
+    });
+    reinterpret_cast<JobSource*>(_timerSource.get())->thread = this;
+    g_source_set_name(_timerSource.get(), "ContextThread timers");
+    g_source_set_ready_time(_timerSource.get(), -1);
+    g_source_attach(_timerSource.get(), _context.get());
+
+    Watchdog::instance().watch(this);
 }
 
 ContextThread::~ContextThread()
 {
     if (!isCancelled())
     {
-        runQueuedJobs();
+        auto result = runQueuedJobs(std::chrono::steady_clock::now() + SHUTDOWN_DRAIN_TIME, SHUTDOWN_DRAIN_JOBS);
+        if (result.starved())
+        {
+            g_warning("GLib thread shutting down with %d jobs still queued", int(result.totalJobsLeft()));
+        }
     }
+    Watchdog::instance().unwatch(this);
     quit();
 }
 
@@ -114,55 +190,406 @@ std::shared_ptr<GCancellable> ContextThread::getCancellable()
     return _cancel;
 }
 
-void ContextThread::simpleSource(std::function<GSource*()> srcBuilder, std::function<void()> work)
+void ContextThread::executeOnThread(Job work, Priority priority)
 {
     if (isCancelled())
     {
         throw std::runtime_error("Trying to execute work on a GLib thread that is shutting down.");
     }
 
-    /* Copy the work so that we can reuse it */
-    /* Lifecycle is handled with the source pointer when we attach
-       it to the context. */
-    auto heapWork = new std::function<void()>(work);
+    enqueue(std::move(work), priority);
+    wakeup();
+}
+
+/** Put a job in the queue for its priority */
+void ContextThread::enqueue(Job work, Priority priority)
+{
+    /* Counted before it is pushed so that the consumer can't take
+       the count below zero */
+    auto depth = ++_currentDepth;
+    _queueDepth.record(depth);
+    auto max = _maxDepth.load(std::memory_order_relaxed);
+    while (depth > max && !_maxDepth.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+    {
+    }
+
+    auto lane = static_cast<unsigned int>(priority);
+    _laneDepth[lane]++;
 
-    auto source = std::shared_ptr<GSource>(srcBuilder(), [](GSource* src) { g_clear_pointer(&src, g_source_unref); });
-    g_source_set_callback(source.get(),
-                          [](gpointer data) {
-                              auto heapWork = static_cast<std::function<void()>*>(data);
-                              (*heapWork)();
-                              return G_SOURCE_REMOVE;
-                          },
-                          heapWork,
-                          [](gpointer data) {
-                              auto heapWork = static_cast<std::function<void()>*>(data);
-                              delete heapWork;
-                          });
+    QueuedJob job;
+    job.work = std::move(work);
+    job.queued = g_get_monotonic_time();
+    _jobs[lane].push(std::move(job));
+}
 
-    g_source_attach(source.get(), _context.get());
+/** Take the next job from the most urgent queue that has one */
+bool ContextThread::popJob(QueuedJob& job)
+{
+    for (unsigned int lane = 0; lane < PRIORITIES; lane++)
+    {
+        if (_jobs[lane].pop(job))
+        {
+            _laneDepth[lane]--;
+            _currentDepth--;
+            return true;
+        }
+    }
+    return false;
 }
 
-void ContextThread::executeOnThread(std::function<void()> work)
+/** Whether all of the queues are empty */
+bool ContextThread::jobsEmpty() const
 {
-    simpleSource(g_idle_source_new, work);
+    for (auto& queue : _jobs)
+    {
+        if (!queue.empty())
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-void ContextThread::timeout(const std::chrono::milliseconds& length, std::function<void()> work)
+/** Run a job that has been taken off the queue and record how it went */
+void ContextThread::runJob(QueuedJob& job)
 {
-    simpleSource([length]() { return g_timeout_source_new(length.count()); }, work);
+    auto start = g_get_monotonic_time();
+    _dispatchLatency.record(start - job.queued);
+
+    /* Restored after as we may be nested in another job's drain */
+    auto outer = _running.exchange(job.work.type());
+
+    job.work();
+    job.work = nullptr;
+
+    _running.store(outer);
+    _runTime.record(g_get_monotonic_time() - start);
 }
 
-void ContextThread::timeoutSeconds(const std::chrono::seconds& length, std::function<void()> work)
+/** Make sure the job source will dispatch. Only the first job
+    after a drain started needs to wake the context, everyone else
+    rides along in the same dispatch. */
+void ContextThread::wakeup()
 {
-    simpleSource([length]() { return g_timeout_source_new_seconds(length.count()); }, work);
+    if (!_wakeupPending.exchange(true))
+    {
+        g_source_set_ready_time(_jobSource.get(), 0);
+    }
 }
 
+/** Runs the queued jobs, called on the thread by the job source */
+void ContextThread::drainJobs()
+{
+    /* Clear the flag before looking at the queue so that anything
+       pushed after we've looked will wake us up again. */
+    g_source_set_ready_time(_jobSource.get(), -1);
+    _wakeupPending.store(false);
+
+    QueuedJob job;
+    for (unsigned int i = 0; i < JOB_BATCH_SIZE && popJob(job); i++)
+    {
+        runJob(job);
+    }
+
+    /* Either we hit the batch limit or a producer is in the middle
+       of adding a job, come back on the next iteration. */
+    if (!jobsEmpty())
+    {
+        wakeup();
+    }
+}
+
+gboolean ContextThread::jobSourceDispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+    reinterpret_cast<JobSource*>(source)->thread->drainJobs();
+    return G_SOURCE_CONTINUE;
+}
+
+/** Ticks on our timer wheel are milliseconds of monotonic time, the
+    same clock GSource ready times use. Expiries are rounded up so that
+    a timer never fires before its full length has passed. */
+static std::uint64_t expiryTick(gint64 now, gint64 length)
+{
+    if (length <= 0)
+    {
+        /* Due now, on the next dispatch */
+        return now / 1000;
+    }
+    return (now + length + 999) / 1000;
+}
+
+/** Runs \p work on the thread after \p length has passed.
+    \param priority Queue the work goes in once the timer fires
+    \return Handle for cancelTimeout()
+*/
+TimerWheel::Handle ContextThread::timeout(const std::chrono::milliseconds& length, Job work, Priority priority)
+{
+    auto now = g_get_monotonic_time();
+    return addTimer(now / 1000, expiryTick(now, length.count() * 1000), std::move(work), priority);
+}
+
+/** Runs \p work on the thread after \p length has passed, rounded up
+    to a whole second so that all the second based timeouts that are
+    close to each other fire on the same wakeup.
+    \param priority Queue the work goes in once the timer fires
+    \return Handle for cancelTimeout()
+*/
+TimerWheel::Handle ContextThread::timeoutSeconds(const std::chrono::seconds& length, Job work, Priority priority)
+{
+    auto now = g_get_monotonic_time();
+    auto expiry = expiryTick(now, length.count() * G_USEC_PER_SEC);
+    return addTimer(now / 1000, ((expiry + 999) / 1000) * 1000, std::move(work), priority);
+}
+
+/** Stops a timeout from running, safe to call from any thread.
+    \return Whether the timeout was pending, false if it has already fired
+*/
+bool ContextThread::cancelTimeout(const TimerWheel::Handle& handle)
+{
+    /* Declared before the guard so that it is destroyed after the lock
+       is released, whatever it captured may use the timers too */
+    Job work;
+
+    std::lock_guard<std::mutex> guard(_timerLock);
+    if (!_timers.cancel(handle, work))
+    {
+        return false;
+    }
+    armTimers();
+    return true;
+}
+
+TimerWheel::Handle ContextThread::addTimer(std::uint64_t now, std::uint64_t expiry, Job work, Priority priority)
+{
+    if (isCancelled())
+    {
+        throw std::runtime_error("Trying to execute work on a GLib thread that is shutting down.");
+    }
+
+    std::lock_guard<std::mutex> guard(_timerLock);
+    auto handle = _timers.add(now, expiry, std::move(work), static_cast<unsigned int>(priority));
+    armTimers();
+    return handle;
+}
+
+/** Point the timer source at the next tick the wheel needs, must be
+    called with the timer lock held. Unless \p force is set the source
+    is only touched when that tick changes. */
+void ContextThread::armTimers(bool force)
+{
+    auto next = _timers.nextExpiry();
+    if (next == _timerArmed && !force)
+    {
+        return;
+    }
+
+    _timerArmed = next;
+    g_source_set_ready_time(_timerSource.get(), next == TimerWheel::NEVER ? -1 : gint64(next) * 1000);
+}
+
+/** Moves the timers that are due onto the job queues for their
+    priority, called on the thread by the timer source */
+void ContextThread::fireTimers()
+{
+    std::lock_guard<std::mutex> guard(_timerLock);
+    _timers.advance(g_get_monotonic_time() / 1000);
+
+    Job work;
+    unsigned int priority;
+    bool queued = false;
+    while (_timers.popExpired(work, priority))
+    {
+        enqueue(std::move(work), static_cast<Priority>(priority));
+        queued = true;
+    }
+
+    if (queued)
+    {
+        wakeup();
+    }
+
+    /* The source stays ready until its ready time is changed */
+    armTimers(true);
+}
+
+gboolean ContextThread::timerSourceDispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+    reinterpret_cast<JobSource*>(source)->thread->fireTimers();
+    return G_SOURCE_CONTINUE;
+}
+
+/** Runs everything on the context that is ready, for as long as
+    that takes. Prefer the bounded version. */
 void ContextThread::runQueuedJobs()
 {
-    while (g_main_context_pending(_context.get()))
+    runQueuedJobs(std::chrono::steady_clock::time_point::max(), std::numeric_limits<unsigned int>::max());
+}
+
+/** Runs the queued jobs, the timeouts that are due and the other
+    sources on the context that are ready, until there are none left
+    or the budget runs out.
+
+    Jobs are taken off the queues directly rather than waiting for the
+    job source, so this works from inside a job too, where GLib won't
+    dispatch the job source again. If called off of the thread it hops
+    onto the thread as an URGENT job to do the work.
+
+    \param deadline Time after which no more work is started
+    \param maxJobs Most jobs and sources to run
+    \return What was run and what was left
+*/
+ContextThread::DrainResult ContextThread::runQueuedJobs(std::chrono::steady_clock::time_point deadline,
+                                                       unsigned int maxJobs)
+{
+    if (std::this_thread::get_id() != _thread.get_id())
+    {
+        return executeOnThread<DrainResult>([this, deadline, maxJobs]() { return runQueuedJobs(deadline, maxJobs); },
+                                            Priority::URGENT);
+    }
+
+    DrainResult result;
+    QueuedJob job;
+
+    while (true)
+    {
+        if (result.dispatched >= maxJobs || std::chrono::steady_clock::now() >= deadline)
+        {
+            result.outOfBudget = true;
+            break;
+        }
+
+        if (!popJob(job))
+        {
+            fireTimers();
+            if (!popJob(job))
+            {
+                /* Our source may be waiting on a dispatch that can't
+                   happen if we're inside it, the queues are empty so
+                   it has nothing to do. */
+                g_source_set_ready_time(_jobSource.get(), -1);
+                _wakeupPending.store(false);
+                if (!jobsEmpty())
+                {
+                    wakeup();
+                    continue;
+                }
+
+                if (!g_main_context_pending(_context.get()))
+                {
+                    break;
+                }
+
+                g_main_context_iteration(_context.get(), FALSE);
+                result.dispatched++;
+                continue;
+            }
+        }
+
+        runJob(job);
+        result.dispatched++;
+    }
+
+    for (unsigned int lane = 0; lane < PRIORITIES; lane++)
+    {
+        result.jobsLeft[lane] = _laneDepth[lane].load();
+    }
+    {
+        std::lock_guard<std::mutex> guard(_timerLock);
+        result.timersLeft = _timers.size();
+    }
+    result.sourcesPending = result.outOfBudget && g_main_context_pending(_context.get());
+
+    return result;
+}
+
+/** Snapshot of the thread's statistics, safe to call from any thread */
+ContextThread::Stats ContextThread::stats() const
+{
+    Stats stats;
+
+    stats.dispatchLatency = _dispatchLatency.snapshot();
+    stats.runTime = _runTime.snapshot();
+    stats.queueDepth = _queueDepth.snapshot();
+    stats.currentDepth = _currentDepth.load();
+    stats.maxDepth = _maxDepth.load();
+    stats.stalls = _stalls.load();
+
+    return stats;
+}
+
+/** Jobs in the queue right now, cheaper than stats() */
+std::uint64_t ContextThread::queueDepth() const
+{
+    return _currentDepth.load(std::memory_order_relaxed);
+}
+
+/** Whether the caller is running on this thread */
+bool ContextThread::isCurrentThread() const
+{
+    return std::this_thread::get_id() == _thread.get_id();
+}
+
+/** Sets the name the thread is reported with */
+void ContextThread::setName(const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(_nameLock);
+    _name = name;
+}
+
+std::string ContextThread::name() const
+{
+    std::lock_guard<std::mutex> guard(_nameLock);
+    return _name;
+}
+
+/** Times the Watchdog has caught this thread stalled */
+std::uint64_t ContextThread::stalls() const
+{
+    return _stalls.load();
+}
+
+/** Called by the Watchdog to see if the loop has been busy for longer
+    than \p threshold microseconds. Each stall is only reported once.
+    \param running Set to the type of the job that is running
+    \return Whether this is a new stall
+*/
+bool ContextThread::checkStall(gint64 now, gint64 threshold, const std::type_info*& running)
+{
+    if (_polling.load())
     {
-        g_main_context_iteration(_context.get(), FALSE);
+        return false;
     }
+
+    auto beat = _heartbeat.load();
+    if (beat == 0 || now - beat < threshold || beat == _stallReported)
+    {
+        return false;
+    }
+
+    _stallReported = beat;
+    _stalls++;
+    running = _running.load();
+    return true;
+}
+
+/** Poll function for our context that keeps the heartbeat */
+gint ContextThread::heartbeatPoll(GPollFD* fds, guint nfds, gint timeout)
+{
+    auto thread = pollOwner;
+    if (thread != nullptr)
+    {
+        thread->_polling.store(true);
+    }
+
+    auto result = g_poll(fds, nfds, timeout);
+
+    if (thread != nullptr)
+    {
+        thread->_heartbeat.store(g_get_monotonic_time());
+        thread->_polling.store(false);
+    }
+
+    return result;
 }
 
 }  // ns GLib
@@ -17,34 +17,236 @@
  *   Ted Gould <ted.gould@canonical.com>
  */
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <thread>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
 
 #include <gio/gio.h>
 
+#include "glib-future.h"
+#include "histogram.h"
+#include "job-queue.h"
+#include "job.h"
+#include "timer-wheel.h"
+
 #pragma once
 
 namespace GLib
 {
 
+/** \brief Result of a blocking executeOnThread()
+
+    Lives on the stack of the thread that is waiting, so a blocking
+    hop doesn't need a shared state on the heap like std::promise
+    does. The waiting thread can't return until run() is done with it.
+*/
+template <typename T>
+class BlockingResult
+{
+    std::mutex lock;
+    std::condition_variable cond;
+    bool ready = false;
+    bool hasValue = false;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+    std::exception_ptr error;
+
+public:
+    ~BlockingResult()
+    {
+        if (hasValue)
+        {
+            reinterpret_cast<T*>(&value)->~T();
+        }
+    }
+
+    /** Run the work and store its result, called on the target thread */
+    template <typename F>
+    void run(F& work)
+    {
+        try
+        {
+            new (&value) T(work());
+            hasValue = true;
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        /* Notify with the lock held, once it's released the waiter
+           may return and take us off its stack. */
+        std::lock_guard<std::mutex> guard(lock);
+        ready = true;
+        cond.notify_one();
+    }
+
+    /** Wait for run() and return the result or rethrow its error */
+    T get()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this]() { return ready; });
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        return std::move(*reinterpret_cast<T*>(&value));
+    }
+};
+
+/** \brief Which lane of a ContextThread's queue work goes in
+
+    Each priority has its own queue and the thread always takes work
+    from the most urgent queue that has any. Work that tears things
+    down or reports results should be URGENT so it doesn't wait behind
+    a burst of new requests, BACKGROUND is for work that can wait
+    until the thread is otherwise idle.
+*/
+enum class Priority
+{
+    URGENT,
+    NORMAL,
+    BACKGROUND
+};
+
 class ContextThread
 {
+public:
+    /** \brief What the thread has been up to
+
+        Latencies and run times are in microseconds, queue depths in
+        jobs. Only jobs that go through the queue are counted, work
+        that executeOnThread() runs inline isn't.
+    */
+    struct Stats
+    {
+        /** Time from a job being queued until it started running */
+        Histogram::Snapshot dispatchLatency;
+        /** Time each job took to run */
+        Histogram::Snapshot runTime;
+        /** Length of the queue each time a job was added to it */
+        Histogram::Snapshot queueDepth;
+        /** Jobs in the queue right now */
+        std::uint64_t currentDepth = 0;
+        /** Longest the queue has ever been */
+        std::uint64_t maxDepth = 0;
+        /** Times the Watchdog has caught the loop stalled */
+        std::uint64_t stalls = 0;
+    };
+
+    /** Number of Priority values */
+    static const unsigned int PRIORITIES = 3;
+
+    /** \brief What a bounded runQueuedJobs() got done and what it didn't */
+    struct DrainResult
+    {
+        /** Jobs and other sources that were run */
+        unsigned int dispatched = 0;
+        /** Jobs still queued, indexed by Priority */
+        std::uint64_t jobsLeft[PRIORITIES] = {0};
+        /** Timeouts that haven't fired yet */
+        std::size_t timersLeft = 0;
+        /** Other sources on the context were still ready to dispatch */
+        bool sourcesPending = false;
+        /** Stopped by the deadline or the job limit rather than
+            running out of work */
+        bool outOfBudget = false;
+
+        /** Whether there was nothing left that was ready to run */
+        bool drained() const
+        {
+            return totalJobsLeft() == 0 && !sourcesPending;
+        }
+
+        /** Whether work was left behind because the budget ran out */
+        bool starved() const
+        {
+            return outOfBudget && !drained();
+        }
+
+        std::uint64_t totalJobsLeft() const
+        {
+            std::uint64_t total = 0;
+            for (auto left : jobsLeft)
+            {
+                total += left;
+            }
+            return total;
+        }
+    };
+
+private:
+    /** A job and when it was queued */
+    struct QueuedJob
+    {
+        Job work;
+        gint64 queued = 0;
+    };
+
     std::thread _thread;
     std::shared_ptr<GMainContext> _context;
     std::shared_ptr<GMainLoop> _loop;
     std::shared_ptr<GCancellable> _cancel;
 
+    /** Jobs waiting to be run on the thread, one queue per Priority */
+    JobQueue<QueuedJob> _jobs[PRIORITIES];
+    /** Length of each of the queues */
+    std::atomic<std::uint64_t> _laneDepth[PRIORITIES] = {};
+    /** Set when the job source has been woken up and hasn't yet
+        started draining the queue. */
+    std::atomic<bool> _wakeupPending{false};
+    /** Long lived source that drains the job queue when woken up */
+    std::shared_ptr<GSource> _jobSource;
+
+    Histogram _dispatchLatency;
+    Histogram _runTime;
+    Histogram _queueDepth;
+    std::atomic<std::uint64_t> _currentDepth{0};
+    std::atomic<std::uint64_t> _maxDepth{0};
+
+    /** When the loop last came back from polling, in monotonic time */
+    std::atomic<gint64> _heartbeat{0};
+    /** Whether the loop is waiting in poll, where it can't stall */
+    std::atomic<bool> _polling{false};
+    /** Type of the job that is running, nullptr between jobs */
+    std::atomic<const std::type_info*> _running{nullptr};
+    std::atomic<std::uint64_t> _stalls{0};
+    /** Heartbeat of the last stall reported, only used by the Watchdog */
+    gint64 _stallReported = 0;
+    /** Name used when reporting on this thread */
+    std::string _name = "ContextThread";
+    mutable std::mutex _nameLock;
+
+    /** Protects the timer wheel and the timer source's ready time */
+    std::mutex _timerLock;
+    /** Every pending timeout, in milliseconds of monotonic time */
+    TimerWheel _timers;
+    /** Tick the timer source is set to wake up at */
+    std::uint64_t _timerArmed = TimerWheel::NEVER;
+    /** Long lived source that fires the timers that are due */
+    std::shared_ptr<GSource> _timerSource;
+
 public:
-    ContextThread(std::function<void()> beforeLoop = [] {}, std::function<void()> afterLoop = [] {});
+    ContextThread(Job beforeLoop = [] {}, Job afterLoop = [] {});
     ~ContextThread();
 
     void quit();
     bool isCancelled();
     std::shared_ptr<GCancellable> getCancellable();
 
-    void executeOnThread(std::function<void()> work);
-    template <typename T>
-    auto executeOnThread(std::function<T()> work) -> T
+    void executeOnThread(Job work, Priority priority = Priority::NORMAL);
+    template <typename T, typename F>
+    auto executeOnThread(F&& work, Priority priority = Priority::NORMAL) -> T
     {
         if (std::this_thread::get_id() == _thread.get_id())
         {
@@ -52,42 +254,99 @@ public:
             return work();
         }
 
-        std::promise<T> promise;
-        std::function<void()> magicFunc = [&promise, &work]() {
+        BlockingResult<T> result;
+        executeOnThread(Job([&result, &work]() { result.run(work); }), priority);
+        return result.get();
+    }
+
+    /** Queues \p work on the thread and returns right away with a
+        Future for its result. If called on the thread itself the work
+        is run immediately and the Future is already ready. */
+    template <typename T, typename F>
+    auto executeOnThreadAsync(F&& work, Priority priority = Priority::NORMAL) -> Future<T>
+    {
+        Promise<T> promise;
+        auto future = promise.getFuture();
+
+        if (std::this_thread::get_id() == _thread.get_id())
+        {
             try
             {
-                promise.set_value(work());
+                promise.setValue(work());
             }
             catch (...)
             {
-                promise.set_exception(std::current_exception());
+                promise.setException(std::current_exception());
             }
-        };
+            return future;
+        }
 
-        executeOnThread(magicFunc);
+        Job job([promise, work = std::forward<F>(work)]() mutable {
+            try
+            {
+                promise.setValue(work());
+            }
+            catch (...)
+            {
+                promise.setException(std::current_exception());
+            }
+        });
+        executeOnThread(std::move(job), priority);
 
-        auto future = promise.get_future();
-        future.wait();
-        return future.get();
+        return future;
     }
 
-    void timeout(const std::chrono::milliseconds& length, std::function<void()> work);
+    TimerWheel::Handle timeout(const std::chrono::milliseconds& length,
+                               Job work,
+                               Priority priority = Priority::NORMAL);
     template <class Rep, class Period>
-    void timeout(const std::chrono::duration<Rep, Period>& length, std::function<void()> work)
+    TimerWheel::Handle timeout(const std::chrono::duration<Rep, Period>& length,
+                               Job work,
+                               Priority priority = Priority::NORMAL)
     {
-        return timeout(std::chrono::duration_cast<std::chrono::milliseconds>(length), work);
+        return timeout(std::chrono::duration_cast<std::chrono::milliseconds>(length), std::move(work), priority);
     }
 
-    void timeoutSeconds(const std::chrono::seconds& length, std::function<void()> work);
+    TimerWheel::Handle timeoutSeconds(const std::chrono::seconds& length,
+                                      Job work,
+                                      Priority priority = Priority::NORMAL);
     template <class Rep, class Period>
-    void timeoutSeconds(const std::chrono::duration<Rep, Period>& length, std::function<void()> work)
+    TimerWheel::Handle timeoutSeconds(const std::chrono::duration<Rep, Period>& length,
+                                      Job work,
+                                      Priority priority = Priority::NORMAL)
     {
-        return timeoutSeconds(std::chrono::duration_cast<std::chrono::seconds>(length), work);
+        return timeoutSeconds(std::chrono::duration_cast<std::chrono::seconds>(length), std::move(work), priority);
     }
 
+    bool cancelTimeout(const TimerWheel::Handle& handle);
+
     void runQueuedJobs(void);
+    DrainResult runQueuedJobs(std::chrono::steady_clock::time_point deadline, unsigned int maxJobs);
+
+    Stats stats() const;
+    std::uint64_t queueDepth() const;
+    bool isCurrentThread() const;
+
+    void setName(const std::string& name);
+    std::string name() const;
+    std::uint64_t stalls() const;
 
 private:
-    void simpleSource(std::function<GSource*()> srcBuilder, std::function<void()> work);
+    void enqueue(Job work, Priority priority);
+    bool popJob(QueuedJob& job);
+    bool jobsEmpty() const;
+    void runJob(QueuedJob& job);
+    void wakeup();
+    void drainJobs();
+    static gboolean jobSourceDispatch(GSource* source, GSourceFunc callback, gpointer user_data);
+
+    TimerWheel::Handle addTimer(std::uint64_t now, std::uint64_t expiry, Job work, Priority priority);
+    void armTimers(bool force = false);
+    void fireTimers();
+    static gboolean timerSourceDispatch(GSource* source, GSourceFunc callback, gpointer user_data);
+
+    friend class Watchdog;
+    bool checkStall(gint64 now, gint64 threshold, const std::type_info*& running);
+    static gint heartbeatPoll(GPollFD* fds, guint nfds, gint timeout);
 };
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "glib-watchdog.h"
+#include "glib-thread.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cxxabi.h>
+
+namespace GLib
+{
+
+const std::chrono::milliseconds Watchdog::DEFAULT_THRESHOLD{2000};
+
+/** How many times per threshold the threads are checked */
+static const int CHECKS_PER_THRESHOLD = 4;
+
+/** The watchdog for the process */
+Watchdog& Watchdog::instance()
+{
+    static Watchdog watchdog;
+    return watchdog;
+}
+
+Watchdog::Watchdog()
+    : thresholdMs(DEFAULT_THRESHOLD.count())
+{
+}
+
+Watchdog::~Watchdog()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quitting = true;
+        wake.notify_all();
+    }
+
+    if (checker.joinable())
+    {
+        checker.join();
+    }
+}
+
+/** Start watching a thread, starting the watchdog thread if needed */
+void Watchdog::watch(ContextThread* thread)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    threads.insert(thread);
+
+    if (!checker.joinable())
+    {
+        checker = std::thread([this]() { run(); });
+    }
+}
+
+/** Stop watching a thread, once this returns the watchdog won't
+    touch it again */
+void Watchdog::unwatch(ContextThread* thread)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    threads.erase(thread);
+}
+
+/** How long a loop can be busy before it is considered stalled */
+void Watchdog::setThreshold(const std::chrono::milliseconds& threshold)
+{
+    thresholdMs.store(threshold.count());
+
+    std::lock_guard<std::mutex> guard(lock);
+    wake.notify_all();
+}
+
+std::chrono::milliseconds Watchdog::threshold() const
+{
+    return std::chrono::milliseconds(thresholdMs.load());
+}
+
+/** Number of stalls seen across all threads */
+std::uint64_t Watchdog::stalls() const
+{
+    return stallCount.load();
+}
+
+/** Turns a job's type into something a person can read, which for a
+    lambda includes the function it was written in */
+std::string Watchdog::describe(const std::type_info* type)
+{
+    if (type == nullptr)
+    {
+        return "a GLib source";
+    }
+
+    int status = 0;
+    auto demangled = abi::__cxa_demangle(type->name(), nullptr, nullptr, &status);
+    if (demangled == nullptr)
+    {
+        return type->name();
+    }
+
+    std::string name(demangled);
+    std::free(demangled);
+    return name;
+}
+
+/** Body of the watchdog thread */
+void Watchdog::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (!quitting)
+    {
+        auto threshold = thresholdMs.load();
+        wake.wait_for(guard, std::chrono::milliseconds(std::max<std::int64_t>(threshold / CHECKS_PER_THRESHOLD, 1)));
+
+        if (quitting)
+        {
+            break;
+        }
+
+        auto now = g_get_monotonic_time();
+        for (auto thread : threads)
+        {
+            const std::type_info* running = nullptr;
+            if (!thread->checkStall(now, threshold * 1000, running))
+            {
+                continue;
+            }
+
+            stallCount++;
+            g_warning("GLib thread '%s' hasn't iterated in over %d ms, it is running %s", thread->name().c_str(),
+                      int(threshold), describe(running).c_str());
+        }
+    }
+}
+
+}  // ns GLib
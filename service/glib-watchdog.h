@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <typeinfo>
+
+namespace GLib
+{
+
+class ContextThread;
+
+/** \brief Notices when a ContextThread's loop stops iterating
+
+    Every ContextThread registers itself here. Each thread beats its
+    heart whenever its loop comes back from polling, and a single
+    watchdog thread looks at them a few times per threshold. A loop
+    that has been busy, not sitting in poll, for longer than the
+    threshold is stalled: something on it is blocking, usually a
+    synchronous D-Bus call. Each stall is logged once with the name of
+    the job that was running, and counted.
+
+    The watchdog thread is only started once there's a thread to watch.
+*/
+class Watchdog
+{
+public:
+    static Watchdog& instance();
+
+    ~Watchdog();
+
+    void watch(ContextThread* thread);
+    void unwatch(ContextThread* thread);
+
+    void setThreshold(const std::chrono::milliseconds& threshold);
+    std::chrono::milliseconds threshold() const;
+
+    std::uint64_t stalls() const;
+
+    static std::string describe(const std::type_info* type);
+
+    /** Used when no threshold has been set */
+    static const std::chrono::milliseconds DEFAULT_THRESHOLD;
+
+private:
+    Watchdog();
+
+    void run();
+
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    std::set<ContextThread*> threads;
+    std::thread checker;
+    bool quitting = false;
+
+    std::atomic<std::int64_t> thresholdMs;
+    std::atomic<std::uint64_t> stallCount{0};
+};
+
+}  // ns GLib
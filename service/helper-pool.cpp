@@ -0,0 +1,190 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "helper-pool.h"
+
+#include <algorithm>
+
+const unsigned int HelperPool::DEFAULT_MAX_IDLE;
+const char* const HelperPool::DEFAULT_HELPER = POLKIT_AGENT_HELPER;
+
+/** \param helperPath The helper to run, with the user as its only argument
+    \param maxIdle Limit on helpers waiting at once, 0 never keeps any
+*/
+std::shared_ptr<HelperPool> HelperPool::create(const std::string& helperPath, unsigned int maxIdle)
+{
+    return std::shared_ptr<HelperPool>(new HelperPool(helperPath, maxIdle));
+}
+
+HelperPool::HelperPool(const std::string& helperPath, unsigned int maxIdle)
+    : helperPath(helperPath)
+    , maxIdle(maxIdle)
+{
+}
+
+/** Stops the helpers that are still waiting, nobody is going to give
+    them a cookie */
+HelperPool::~HelperPool()
+{
+    /* Nothing more is spawned once the thread has stopped */
+    thread.quit();
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto& entry : idle)
+    {
+        g_subprocess_force_exit(entry.process.get());
+    }
+    idle.clear();
+}
+
+/** A running helper for \p user, waiting for its cookie on stdin.
+    One that has already been started is used if there is one,
+    otherwise one is started now. Either way another is started in the
+    background so the next request for the user finds one waiting.
+
+    \return The helper, or nullptr if it couldn't be started
+*/
+std::shared_ptr<GSubprocess> HelperPool::acquire(const std::string& user)
+{
+    std::shared_ptr<GSubprocess> process;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto found = std::find_if(idle.begin(), idle.end(), [&user](const Idle& entry) { return entry.user == user; });
+        if (found != idle.end())
+        {
+            process = found->process;
+            idle.erase(found);
+            counters.hits++;
+        }
+        else
+        {
+            counters.misses++;
+        }
+    }
+
+    if (!process)
+    {
+        process = spawn(user);
+    }
+
+    prewarm(user);
+
+    return process;
+}
+
+/** Has a helper for \p user started in the background, if there
+    isn't one already waiting */
+void HelperPool::prewarm(const std::string& user)
+{
+    if (maxIdle == 0)
+    {
+        return;
+    }
+
+    thread.executeOnThread([this, user]() { refill(user); }, GLib::Priority::BACKGROUND);
+}
+
+/** Counters, safe to call from any thread */
+HelperPool::Stats HelperPool::stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto stats = counters;
+    stats.idle = idle.size();
+    return stats;
+}
+
+/** Starts a helper for \p user, on whatever thread we're called on */
+std::shared_ptr<GSubprocess> HelperPool::spawn(const std::string& user)
+{
+    const gchar* argv[] = {helperPath.c_str(), user.c_str(), nullptr};
+    GError* error = nullptr;
+
+    auto flags = GSubprocessFlags(G_SUBPROCESS_FLAGS_STDIN_PIPE | G_SUBPROCESS_FLAGS_STDOUT_PIPE);
+    auto process = g_subprocess_newv(argv, flags, &error);
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (error != nullptr)
+    {
+        g_warning("Unable to start '%s' for '%s': %s", helperPath.c_str(), user.c_str(), error->message);
+        g_error_free(error);
+        counters.failures++;
+        return {};
+    }
+
+    counters.spawned++;
+    return std::shared_ptr<GSubprocess>(process, [](GSubprocess* process) { g_object_unref(process); });
+}
+
+/** Starts a helper for \p user to wait, on our thread, unless one is
+    already waiting. Makes room by stopping the one that has waited
+    longest if we're at the limit. */
+void HelperPool::refill(const std::string& user)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (std::any_of(idle.begin(), idle.end(), [&user](const Idle& entry) { return entry.user == user; }))
+        {
+            return;
+        }
+    }
+
+    auto process = spawn(user);
+    if (!process)
+    {
+        return;
+    }
+
+    /* Reaped here, and dropped if it is still waiting when it goes.
+       The answer comes in on our thread, which stops before we go */
+    g_subprocess_wait_async(process.get(), nullptr, /* cancellable */
+                            [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                                g_subprocess_wait_finish(G_SUBPROCESS(obj), res, nullptr);
+                                static_cast<HelperPool*>(user_data)->exited(G_SUBPROCESS(obj));
+                            },
+                            this);
+
+    std::lock_guard<std::mutex> guard(lock);
+    while (idle.size() >= maxIdle && !idle.empty())
+    {
+        g_debug("Stopping waiting helper for '%s' to make room", idle.front().user.c_str());
+        g_subprocess_force_exit(idle.front().process.get());
+        idle.pop_front();
+        counters.evicted++;
+    }
+    idle.push_back(Idle{user, process});
+}
+
+/** A helper we started has exited, if it was still waiting it is no
+    use to anyone */
+void HelperPool::exited(GSubprocess* process)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = std::find_if(idle.begin(), idle.end(),
+                              [process](const Idle& entry) { return entry.process.get() == process; });
+    if (found != idle.end())
+    {
+        g_debug("Waiting helper for '%s' exited", found->user.c_str());
+        idle.erase(found);
+        counters.evicted++;
+    }
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <gio/gio.h>
+
+#include "glib-thread.h"
+
+/** \brief Helper processes started before they're needed
+
+    Every PolkitAgentSession forks and execs polkit-agent-helper-1 when
+    it is initiated, and under a burst of requests that is most of the
+    time it takes to get a prompt up. The helper takes the user it
+    authenticates on its command line but reads the cookie from stdin,
+    so one can be started for a user ahead of time and sit waiting for
+    the cookie. This keeps a few of those waiting for each user that
+    has asked for one, so acquire() usually hands back a process that
+    is already running.
+
+    The spawning is done on a thread of our own so it never holds up
+    an Authentication. Each acquire() has another helper for that user
+    started to replace it, and prewarm() starts one before anyone asks.
+    At most maxIdle helpers wait at once, across all users; when there
+    is no room the one that has been waiting longest is stopped for
+    the new one. Helpers that exit while they're waiting are dropped,
+    and the ones still waiting when the pool is destroyed are stopped.
+
+    Only helpers that read the cookie from stdin can be used, older
+    ones that want it on their command line can't be started early.
+*/
+class HelperPool
+{
+public:
+    /** Counters since the pool was created */
+    struct Stats
+    {
+        std::uint64_t hits = 0;     /**< acquire() had one waiting */
+        std::uint64_t misses = 0;   /**< acquire() had to start one */
+        std::uint64_t spawned = 0;  /**< Helpers started, by either */
+        std::uint64_t failures = 0; /**< Helpers that couldn't be started */
+        std::uint64_t evicted = 0;  /**< Waiting helpers stopped to make room or that exited */
+        unsigned int idle = 0;      /**< Helpers waiting right now */
+    };
+
+    /** Default limit on waiting helpers, across all users */
+    static const unsigned int DEFAULT_MAX_IDLE = 4;
+    /** PolicyKit's helper, where it was when we were built */
+    static const char* const DEFAULT_HELPER;
+
+    static std::shared_ptr<HelperPool> create(const std::string& helperPath = DEFAULT_HELPER,
+                                              unsigned int maxIdle = DEFAULT_MAX_IDLE);
+    ~HelperPool();
+
+    HelperPool(const HelperPool&) = delete;
+    HelperPool& operator=(const HelperPool&) = delete;
+
+    std::shared_ptr<GSubprocess> acquire(const std::string& user);
+    void prewarm(const std::string& user);
+
+    Stats stats() const;
+
+private:
+    HelperPool(const std::string& helperPath, unsigned int maxIdle);
+
+    /** A helper waiting for its cookie */
+    struct Idle
+    {
+        std::string user;                     /**< Who it will authenticate */
+        std::shared_ptr<GSubprocess> process; /**< The running helper */
+    };
+
+    std::shared_ptr<GSubprocess> spawn(const std::string& user);
+    void refill(const std::string& user);
+    void exited(GSubprocess* process);
+
+    std::string helperPath; /**< Path to polkit-agent-helper-1, or something that speaks like it */
+    unsigned int maxIdle;   /**< Limit on idle.size() */
+
+    mutable std::mutex lock;
+    std::list<Idle> idle; /**< Waiting helpers, the one that has waited longest first */
+    Stats counters;       /**< Everything but idle, which is idle.size() */
+
+    /** Where helpers are spawned and reaped, stopped first when
+        we're destroyed so nothing on it outlives us */
+    GLib::ContextThread thread;
+};
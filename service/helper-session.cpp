@@ -0,0 +1,318 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "helper-session.h"
+
+#include <algorithm>
+#include <cstring>
+#include <pwd.h>
+#include <stdexcept>
+#include <vector>
+
+#include <polkit/polkit.h>
+
+/** \param pool Where to get the helper from
+    \param identity Who to authenticate, must be a unix-user to succeed
+    \param cookie Cookie of the transaction
+*/
+HelperSession::HelperSession(const std::shared_ptr<HelperPool>& pool,
+                             const Identity& identity,
+                             const std::string& cookie)
+    : pool(pool)
+    , identity(identity)
+    , cookie(cookie)
+    , user(userName(identity))
+{
+    if (!pool)
+    {
+        throw std::runtime_error("HelperSession needs a pool to get helpers from");
+    }
+}
+
+HelperSession::~HelperSession()
+{
+    stop();
+}
+
+/** The name of the user for a unix-user identity, empty for anything
+    else or a user that doesn't exist */
+std::string HelperSession::userName(const Identity& identity)
+{
+    if (identity.get() == nullptr || !POLKIT_IS_UNIX_USER(identity.get()))
+    {
+        return {};
+    }
+
+    auto uid = polkit_unix_user_get_uid(POLKIT_UNIX_USER(identity.get()));
+
+    struct passwd pwd;
+    struct passwd* result = nullptr;
+    std::vector<char> buffer(16384);
+    if (getpwuid_r(uid, &pwd, buffer.data(), buffer.size(), &result) != 0 || result == nullptr)
+    {
+        g_warning("No user for uid %d", int(uid));
+        return {};
+    }
+
+    return result->pw_name;
+}
+
+/** Gets a helper from the pool and gives it our cookie, after which
+    it talks to PAM and we start hearing from it */
+void HelperSession::initiate()
+{
+    stop();
+    completed = false;
+
+    if (!user.empty())
+    {
+        process = pool->acquire(user);
+    }
+
+    GError* error = nullptr;
+    if (process)
+    {
+        std::string line = cookie + "\n";
+        auto input = g_subprocess_get_stdin_pipe(process.get()); /* No transfer */
+        g_output_stream_write_all(input, line.c_str(), line.size(), nullptr, nullptr, &error);
+    }
+
+    if (!process || error != nullptr)
+    {
+        if (error != nullptr)
+        {
+            g_warning("Unable to send the cookie to the helper: %s", error->message);
+            g_error_free(error);
+        }
+        else
+        {
+            g_warning("No helper to authenticate '%s'", identity.toString().c_str());
+        }
+
+        /* Not from inside initiate(), whoever called us isn't ready */
+        failure = g_idle_source_new();
+        g_source_set_callback(failure,
+                              [](gpointer user_data) -> gboolean {
+                                  auto self = static_cast<HelperSession*>(user_data);
+                                  g_source_unref(self->failure);
+                                  self->failure = nullptr;
+                                  self->finish(false);
+                                  return G_SOURCE_REMOVE;
+                              },
+                              this, nullptr);
+        auto context = g_main_context_ref_thread_default();
+        g_source_attach(failure, context);
+        g_main_context_unref(context);
+        return;
+    }
+
+    cancel = std::shared_ptr<GCancellable>(g_cancellable_new(), [](GCancellable* cancel) { g_object_unref(cancel); });
+    output = std::shared_ptr<GDataInputStream>(g_data_input_stream_new(g_subprocess_get_stdout_pipe(process.get())),
+                                               [](GDataInputStream* stream) { g_object_unref(stream); });
+
+    readLine();
+}
+
+/** Drops the helper we have and starts again with a new one */
+void HelperSession::resetSession()
+{
+    initiate();
+}
+
+/** Stops the current attempt, if the helper hasn't finished it is
+    told to go away */
+void HelperSession::stop()
+{
+    if (failure != nullptr)
+    {
+        g_source_destroy(failure);
+        g_source_unref(failure);
+        failure = nullptr;
+    }
+
+    if (cancel)
+    {
+        g_cancellable_cancel(cancel.get());
+        cancel.reset();
+    }
+    output.reset();
+
+    if (process && !completed)
+    {
+        g_subprocess_force_exit(process.get());
+    }
+    process.reset();
+}
+
+/** Waits for the next line from the helper */
+void HelperSession::readLine()
+{
+    g_data_input_stream_read_line_async(
+        output.get(), G_PRIORITY_DEFAULT, cancel.get(),
+        [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+            GError* error = nullptr;
+            auto line = g_data_input_stream_read_line_finish(G_DATA_INPUT_STREAM(obj), res, nullptr, &error);
+
+            /* Cancelled means we've stopped, maybe been destroyed */
+            if (error != nullptr && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+                g_error_free(error);
+                g_free(line);
+                return;
+            }
+
+            auto self = static_cast<HelperSession*>(user_data);
+            if (line == nullptr)
+            {
+                if (error != nullptr)
+                {
+                    g_warning("Unable to read from the helper: %s", error->message);
+                    g_error_free(error);
+                }
+                self->finish(false);
+                return;
+            }
+
+            self->gotLine(line);
+            g_free(line);
+        },
+        this);
+}
+
+/** Handles a line from the helper. Anything that isn't the end has the
+    next read started before the signal, which may reset or destroy us */
+void HelperSession::gotLine(const char* line)
+{
+    enum Kind
+    {
+        PROMPT_HIDDEN,
+        PROMPT_SHOWN,
+        ERROR_MSG,
+        TEXT_INFO
+    };
+    static const std::pair<const char*, Kind> prefixes[] = {{"PAM_PROMPT_ECHO_OFF ", PROMPT_HIDDEN},
+                                                            {"PAM_PROMPT_ECHO_ON ", PROMPT_SHOWN},
+                                                            {"PAM_ERROR_MSG ", ERROR_MSG},
+                                                            {"PAM_TEXT_INFO ", TEXT_INFO}};
+
+    if (g_strcmp0(line, "SUCCESS") == 0)
+    {
+        finish(true);
+        return;
+    }
+    if (g_strcmp0(line, "FAILURE") == 0)
+    {
+        finish(false);
+        return;
+    }
+
+    for (const auto& prefix : prefixes)
+    {
+        if (!g_str_has_prefix(line, prefix.first))
+        {
+            continue;
+        }
+
+        auto compressed = g_strcompress(line + std::strlen(prefix.first));
+        std::string text(compressed);
+        g_free(compressed);
+
+        g_debug("Helper %s%s", prefix.first, text.c_str());
+        readLine();
+
+        switch (prefix.second)
+        {
+            case PROMPT_HIDDEN:
+                requestSignal(text, true);
+                break;
+            case PROMPT_SHOWN:
+                requestSignal(text, false);
+                break;
+            case ERROR_MSG:
+                errorSignal(text);
+                break;
+            case TEXT_INFO:
+                infoSignal(text);
+                break;
+        }
+        return;
+    }
+
+    g_warning("Unknown line from the helper: %s", line);
+    readLine();
+}
+
+/** The helper is done, for good or bad. Emitting is the last thing so
+    the handler can reset or destroy us. */
+void HelperSession::finish(bool success)
+{
+    g_debug("Helper session complete: %s", success ? "success" : "fail");
+
+    /* The helper exits on its own once it has said, or has already */
+    completed = true;
+    stop();
+
+    completeSignal(success);
+}
+
+/** Sends a response to the helper.
+    \param response Text response from the user */
+void HelperSession::requestResponse(const std::string& response)
+{
+    if (!process)
+    {
+        return;
+    }
+
+    std::string line = response + "\n";
+    GError* error = nullptr;
+    auto input = g_subprocess_get_stdin_pipe(process.get()); /* No transfer */
+    g_output_stream_write_all(input, line.c_str(), line.size(), nullptr, nullptr, &error);
+    std::fill(line.begin(), line.end(), '\0');
+
+    if (error != nullptr)
+    {
+        g_warning("Unable to send a response to the helper: %s", error->message);
+        g_error_free(error);
+    }
+}
+
+/** Gets the request signal so that it can be connected to. */
+core::Signal<const std::string&, bool>& HelperSession::request()
+{
+    return requestSignal;
+}
+
+/** Gets the info signal so that it can be connected to. */
+core::Signal<const std::string&>& HelperSession::info()
+{
+    return infoSignal;
+}
+
+/** Gets the error signal so that it can be connected to. */
+core::Signal<const std::string&>& HelperSession::error()
+{
+    return errorSignal;
+}
+
+/** Gets the complete signal so that it can be connected to. */
+core::Signal<bool>& HelperSession::complete()
+{
+    return completeSignal;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <gio/gio.h>
+
+#include "helper-pool.h"
+#include "session-iface.h"
+
+/** \brief A Session that talks to a helper from a HelperPool
+
+    Does what PolkitAgentSession does, but with a helper that was
+    started before we needed it. The cookie goes to the helper on its
+    stdin, and then each line it writes is one of PAM_PROMPT_ECHO_OFF,
+    PAM_PROMPT_ECHO_ON, PAM_ERROR_MSG or PAM_TEXT_INFO followed by the
+    escaped text, or SUCCESS or FAILURE to finish. Responses go back as
+    a line each. A helper that exits without saying is a failure.
+
+    Only unix-user identities can be authenticated by the helper, any
+    other fails. Everything happens on the thread-default context of
+    the thread that calls initiate(), and the signals are emitted there.
+*/
+class HelperSession : public Session
+{
+public:
+    HelperSession(const std::shared_ptr<HelperPool>& pool, const Identity& identity, const std::string& cookie);
+    ~HelperSession() override;
+
+    void initiate() override;
+    void resetSession() override;
+
+    core::Signal<const std::string&, bool>& request() override;
+    void requestResponse(const std::string& response) override;
+
+    core::Signal<const std::string&>& info() override;
+    core::Signal<const std::string&>& error() override;
+    core::Signal<bool>& complete() override;
+
+    static std::string userName(const Identity& identity);
+
+private:
+    void stop();
+    void readLine();
+    void gotLine(const char* line);
+    void finish(bool success);
+
+    std::shared_ptr<HelperPool> pool; /**< Where the helpers come from */
+    Identity identity;                /**< Who we're authenticating */
+    std::string cookie;               /**< Cookie of the transaction */
+    std::string user;                 /**< Name of the identity's user, empty if it isn't one */
+
+    std::shared_ptr<GSubprocess> process;     /**< The helper for this attempt, nullptr between them */
+    std::shared_ptr<GDataInputStream> output; /**< What the helper writes, a line at a time */
+    std::shared_ptr<GCancellable> cancel;     /**< Cancels the read in flight when the attempt ends */
+    GSource* failure = nullptr;               /**< Reports not getting a helper, from the main loop */
+    bool completed = false;                   /**< The attempt is over, the helper is gone or going */
+
+    core::Signal<const std::string&, bool> requestSignal;
+    core::Signal<const std::string&> infoSignal;
+    core::Signal<const std::string&> errorSignal;
+    core::Signal<bool> completeSignal;
+};
@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "histogram.h"
+
+#include <cmath>
+
+namespace GLib
+{
+
+const unsigned int Histogram::SUB_BUCKET_BITS;
+const unsigned int Histogram::SUB_BUCKETS;
+const std::size_t Histogram::BUCKETS;
+
+Histogram::Histogram()
+    : sum(0)
+    , max(0)
+{
+    for (auto& bucket : counts)
+    {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+/** Adds a value to the histogram, safe to call from any thread */
+void Histogram::record(std::uint64_t value)
+{
+    counts[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+
+    auto current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+/** Copies out the current counts */
+Histogram::Snapshot Histogram::snapshot() const
+{
+    Snapshot snap;
+
+    /* The count comes from the buckets so that the percentiles add
+       up even when racing a record() */
+    snap.counts.resize(BUCKETS);
+    for (std::size_t i = 0; i < BUCKETS; i++)
+    {
+        snap.counts[i] = counts[i].load(std::memory_order_relaxed);
+        snap.count += snap.counts[i];
+    }
+
+    snap.sum = sum.load(std::memory_order_relaxed);
+    snap.max = max.load(std::memory_order_relaxed);
+
+    return snap;
+}
+
+/** Which bucket a value is counted in */
+std::size_t Histogram::bucketFor(std::uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    auto sub = (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/** The largest value that is counted in \p bucket */
+std::uint64_t Histogram::bucketHighest(std::size_t bucket)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    unsigned int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    std::uint64_t sub = bucket % SUB_BUCKETS;
+    auto shift = exponent - SUB_BUCKET_BITS;
+
+    return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/** Average of the recorded values, zero when empty */
+double Histogram::Snapshot::mean() const
+{
+    if (count == 0)
+    {
+        return 0.0;
+    }
+    return double(sum) / double(count);
+}
+
+/** Value that \p percent percent of the recorded values are at or
+    below, reported as the top of its bucket and never more than the
+    largest value recorded. Zero when empty. */
+std::uint64_t Histogram::Snapshot::percentile(double percent) const
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    auto target = std::uint64_t(std::ceil(double(count) * percent / 100.0));
+    if (target == 0)
+    {
+        target = 1;
+    }
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); i++)
+    {
+        seen += counts[i];
+        if (seen >= target)
+        {
+            auto highest = bucketHighest(i);
+            return highest < max ? highest : max;
+        }
+    }
+
+    return max;
+}
+
+}  // ns GLib
@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace GLib
+{
+
+/** \brief Lock-free histogram of unsigned values
+
+    Buckets are laid out like an HDR histogram: values below
+    SUB_BUCKETS get a bucket each, and every power of two above that
+    is split into SUB_BUCKETS equal buckets. That keeps the error on
+    any value under about six percent while covering the whole 64 bit
+    range with a fixed number of counters.
+
+    Recording is a few relaxed atomic operations, so any thread can
+    record without waiting on any other. A snapshot taken while others
+    are recording is not an exact instant, but every count in it has
+    been recorded.
+*/
+class Histogram
+{
+public:
+    /** Linear buckets per power of two, as a number of bits */
+    static const unsigned int SUB_BUCKET_BITS = 4;
+    static const unsigned int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const std::size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    /** Copy of a histogram at a point in time */
+    struct Snapshot
+    {
+        std::vector<std::uint64_t> counts;
+        std::uint64_t count = 0;
+        std::uint64_t sum = 0;
+        std::uint64_t max = 0;
+
+        double mean() const;
+        std::uint64_t percentile(double percent) const;
+    };
+
+    Histogram();
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(std::uint64_t value);
+    Snapshot snapshot() const;
+
+    static std::size_t bucketFor(std::uint64_t value);
+    static std::uint64_t bucketHighest(std::size_t bucket);
+
+private:
+    std::atomic<std::uint64_t> counts[BUCKETS];
+    std::atomic<std::uint64_t> sum;
+    std::atomic<std::uint64_t> max;
+};
+
+}  // ns GLib
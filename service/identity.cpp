@@ -0,0 +1,194 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "identity.h"
+
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <vector>
+
+static std::shared_ptr<PolkitIdentity> share_identity(PolkitIdentity* identity)
+{
+    return std::shared_ptr<PolkitIdentity>(identity, [](PolkitIdentity* identity) { g_clear_object(&identity); });
+}
+
+/** Takes a reference on \p identity */
+Identity::Identity(PolkitIdentity* identity)
+{
+    if (identity == nullptr)
+    {
+        return;
+    }
+
+    this->identity = share_identity(static_cast<PolkitIdentity*>(g_object_ref(identity)));
+
+    auto str = polkit_identity_to_string(identity);
+    if (str != nullptr)
+    {
+        string = str;
+    }
+    g_free(str);
+}
+
+/** Parses \p identity, like "unix-user:ted" */
+Identity::Identity(const std::string& identity)
+    : string(identity)
+{
+    GError* error = nullptr;
+    auto parsed = polkit_identity_from_string(identity.c_str(), &error);
+    if (error != nullptr)
+    {
+        g_debug("Unable to parse identity '%s': %s", identity.c_str(), error->message);
+        g_error_free(error);
+    }
+
+    if (parsed != nullptr)
+    {
+        this->identity = share_identity(parsed);
+    }
+}
+
+Identity::Identity(const char* identity)
+    : Identity(std::string(identity != nullptr ? identity : ""))
+{
+}
+
+/** The PolicyKit object, no transfer. May be nullptr if we were
+    made from a string that didn't parse. */
+PolkitIdentity* Identity::get() const
+{
+    return identity.get();
+}
+
+const std::string& Identity::toString() const
+{
+    return string;
+}
+
+/** Whether this is the user we're running as */
+bool Identity::isCurrentUser() const
+{
+    if (!identity || !POLKIT_IS_UNIX_USER(identity.get()))
+    {
+        return false;
+    }
+
+    return polkit_unix_user_get_uid(POLKIT_UNIX_USER(identity.get())) == gint(getuid());
+}
+
+/** Whether this is a user that administers the system, root or a
+    member of the groups PolicyKit's admin rules name on Ubuntu. They
+    are the ones most likely to be asked for after the current user. */
+bool Identity::isAdmin() const
+{
+    if (!identity || !POLKIT_IS_UNIX_USER(identity.get()))
+    {
+        return false;
+    }
+
+    auto uid = polkit_unix_user_get_uid(POLKIT_UNIX_USER(identity.get()));
+    if (uid == 0)
+    {
+        return true;
+    }
+
+    struct passwd pwd;
+    struct passwd* user = nullptr;
+    std::vector<char> buffer(16384);
+    if (getpwuid_r(uid, &pwd, buffer.data(), buffer.size(), &user) != 0 || user == nullptr)
+    {
+        return false;
+    }
+
+    std::string name = user->pw_name;
+    auto primary = user->pw_gid;
+
+    for (auto groupname : {"sudo", "admin"})
+    {
+        struct group grp;
+        struct group* group = nullptr;
+        std::vector<char> groupbuffer(16384);
+        if (getgrnam_r(groupname, &grp, groupbuffer.data(), groupbuffer.size(), &group) != 0 || group == nullptr)
+        {
+            continue;
+        }
+
+        if (group->gr_gid == primary)
+        {
+            return true;
+        }
+
+        for (auto member = group->gr_mem; member != nullptr && *member != nullptr; member++)
+        {
+            if (name == *member)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/** What to call it when asking which to use. A user's full name if
+    they have one and their login if not, anything else as PolicyKit
+    calls it. */
+std::string Identity::displayName() const
+{
+    if (!identity || !POLKIT_IS_UNIX_USER(identity.get()))
+    {
+        return string;
+    }
+
+    auto uid = polkit_unix_user_get_uid(POLKIT_UNIX_USER(identity.get()));
+
+    struct passwd pwd;
+    struct passwd* result = nullptr;
+    std::vector<char> buffer(16384);
+    if (getpwuid_r(uid, &pwd, buffer.data(), buffer.size(), &result) != 0 || result == nullptr)
+    {
+        return string;
+    }
+
+    /* The full name is the first field of the GECOS */
+    std::string gecos = result->pw_gecos != nullptr ? result->pw_gecos : "";
+    auto name = gecos.substr(0, gecos.find(','));
+    if (!name.empty())
+    {
+        return name;
+    }
+
+    return result->pw_name;
+}
+
+bool Identity::operator==(const Identity& other) const
+{
+    return string == other.string;
+}
+
+bool Identity::operator!=(const Identity& other) const
+{
+    return string != other.string;
+}
+
+bool Identity::operator<(const Identity& other) const
+{
+    return string < other.string;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <polkit/polkit.h>
+
+/** \brief A PolicyKit identity that can be authenticated as
+
+    PolicyKit hands us PolkitIdentity objects and a Session needs one
+    to start, so we keep a reference to the object rather than turning
+    it into a string and parsing it again for every session. Copies
+    share the reference. The string form is made once, for comparing
+    identities and for the log.
+
+    One made from a string parses it, for the test suite and anything
+    else that only has the string. If it doesn't parse get() is
+    nullptr but the string is still kept.
+*/
+class Identity
+{
+public:
+    explicit Identity(PolkitIdentity* identity);
+    Identity(const std::string& identity);
+    Identity(const char* identity);
+
+    PolkitIdentity* get() const;
+    const std::string& toString() const;
+
+    bool isCurrentUser() const;
+    bool isAdmin() const;
+    std::string displayName() const;
+
+    bool operator==(const Identity& other) const;
+    bool operator!=(const Identity& other) const;
+    bool operator<(const Identity& other) const;
+
+private:
+    std::shared_ptr<PolkitIdentity> identity; /**< Our reference on the object, may be nullptr */
+    std::string string;                       /**< What PolicyKit calls it */
+};
@@ -0,0 +1,165 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace GLib
+{
+
+/** \brief Multi-producer, single-consumer queue of jobs
+
+    Any thread may push onto the queue, but only the thread that
+    owns the queue (the ContextThread's loop) may pop from it. Pushing
+    is a single atomic exchange so producers never wait on each other
+    or on the consumer.
+
+    The queue always keeps one node around that is the "stub" at the
+    tail, the value in that node has already been consumed. A producer
+    that has swapped the head but not yet linked its node will make
+    the queue look empty to the consumer for a moment, so pop() can
+    return false while empty() is also false. Callers should check
+    again later in that case.
+
+    Consumed nodes are kept for reuse in a small ring that only the
+    consumer adds to and producers take from with a compare and swap
+    on an ever increasing count, so it is lock-free too and a count
+    can't come around again the way a pointer can.
+*/
+template <typename T>
+class JobQueue
+{
+    struct Node
+    {
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+
+    /** Where producers add nodes */
+    std::atomic<Node*> head;
+    /** Where the consumer takes nodes, only touched by the consumer */
+    Node* tail;
+
+    /** Most nodes that we'll keep around for reuse */
+    static const std::size_t MAX_FREE_NODES = 256;
+    /** Nodes ready to be reused, from freeTaken up to freeAdded */
+    std::atomic<Node*> freeNodes[MAX_FREE_NODES];
+    /** Nodes ever added to freeNodes, only changed by the consumer */
+    std::atomic<std::uint64_t> freeAdded{0};
+    /** Nodes ever taken from freeNodes, claimed by producers */
+    std::atomic<std::uint64_t> freeTaken{0};
+
+    Node* allocNode()
+    {
+        auto taken = freeTaken.load(std::memory_order_acquire);
+        while (taken < freeAdded.load(std::memory_order_acquire))
+        {
+            /* Only ours if nobody claimed it first, in which case the
+               consumer may have put another node in its slot */
+            auto node = freeNodes[taken % MAX_FREE_NODES].load(std::memory_order_relaxed);
+            if (freeTaken.compare_exchange_weak(taken, taken + 1, std::memory_order_acq_rel))
+            {
+                node->next.store(nullptr, std::memory_order_relaxed);
+                return node;
+            }
+        }
+
+        return new Node;
+    }
+
+    void freeNode(Node* node)
+    {
+        auto added = freeAdded.load(std::memory_order_relaxed);
+        if (added - freeTaken.load(std::memory_order_acquire) < MAX_FREE_NODES)
+        {
+            freeNodes[added % MAX_FREE_NODES].store(node, std::memory_order_relaxed);
+            freeAdded.store(added + 1, std::memory_order_release);
+            return;
+        }
+
+        delete node;
+    }
+
+public:
+    JobQueue()
+    {
+        auto stub = new Node;
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+
+    ~JobQueue()
+    {
+        while (tail != nullptr)
+        {
+            auto next = tail->next.load(std::memory_order_relaxed);
+            delete tail;
+            tail = next;
+        }
+
+        for (auto i = freeTaken.load(); i < freeAdded.load(); i++)
+        {
+            delete freeNodes[i % MAX_FREE_NODES].load(std::memory_order_relaxed);
+        }
+    }
+
+    JobQueue(const JobQueue&) = delete;
+    JobQueue& operator=(const JobQueue&) = delete;
+
+    /** Add a value to the queue, safe to call from any thread */
+    void push(T value)
+    {
+        auto node = allocNode();
+        node->value = std::move(value);
+
+        auto prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /** Take the oldest value off of the queue, only call from the consumer.
+        \param value Location to move the value into
+        \return Whether a value was returned
+    */
+    bool pop(T& value)
+    {
+        auto next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            return false;
+        }
+
+        value = std::move(next->value);
+        freeNode(tail);
+        tail = next;
+        return true;
+    }
+
+    /** Whether there are values in the queue or being added to it,
+        only call from the consumer. */
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail;
+    }
+};
+
+}  // ns GLib
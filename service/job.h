@@ -0,0 +1,208 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace GLib
+{
+
+/** \brief Move-only callable that is run on a ContextThread
+
+    Works like a <tt>std::function<void()></tt> that can't be copied,
+    which means it can hold move-only captures, and that stores the
+    callable inline when it fits. The inline space is sized so that
+    the closures we pass around (a couple of pointers, a cookie
+    string and a callback) don't need the heap. Larger callables are
+    still accepted, they're just allocated.
+*/
+class Job
+{
+public:
+    /** Bytes available for callables stored without allocating */
+    static const std::size_t INLINE_SIZE = 96;
+
+    Job() noexcept
+    {
+    }
+
+    Job(std::nullptr_t) noexcept
+    {
+    }
+
+    template <typename F,
+              typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Job>::value>::type>
+    Job(F&& func)
+    {
+        using Func = typename std::decay<F>::type;
+        build<Func>(std::forward<F>(func), std::integral_constant<bool, fitsInline<Func>()>());
+    }
+
+    Job(Job&& other) noexcept
+    {
+        takeFrom(other);
+    }
+
+    Job& operator=(Job&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            takeFrom(other);
+        }
+        return *this;
+    }
+
+    Job& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    Job(const Job&) = delete;
+    Job& operator=(const Job&) = delete;
+
+    ~Job()
+    {
+        reset();
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return ops != nullptr;
+    }
+
+    void operator()()
+    {
+        ops->invoke(&storage);
+    }
+
+    /** Type of the callable, so that diagnostics can say which job
+        is which. nullptr when empty. */
+    const std::type_info* type() const noexcept
+    {
+        return ops != nullptr ? ops->type : nullptr;
+    }
+
+    /** Whether a callable of type \p Func is stored without allocating */
+    template <typename Func>
+    static constexpr bool fitsInline()
+    {
+        return sizeof(Func) <= INLINE_SIZE && alignof(Func) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible<Func>::value;
+    }
+
+private:
+    /** What to do with the callable, one of these per type */
+    struct Ops
+    {
+        void (*invoke)(void* storage);
+        void (*move)(void* to, void* from);
+        void (*destroy)(void* storage);
+        const std::type_info* type;
+    };
+
+    template <typename Func>
+    struct InlineOps
+    {
+        static void invoke(void* storage)
+        {
+            (*static_cast<Func*>(storage))();
+        }
+        static void move(void* to, void* from)
+        {
+            new (to) Func(std::move(*static_cast<Func*>(from)));
+            static_cast<Func*>(from)->~Func();
+        }
+        static void destroy(void* storage)
+        {
+            static_cast<Func*>(storage)->~Func();
+        }
+        static const Ops ops;
+    };
+
+    template <typename Func>
+    struct HeapOps
+    {
+        static void invoke(void* storage)
+        {
+            (**static_cast<Func**>(storage))();
+        }
+        static void move(void* to, void* from)
+        {
+            *static_cast<Func**>(to) = *static_cast<Func**>(from);
+        }
+        static void destroy(void* storage)
+        {
+            delete *static_cast<Func**>(storage);
+        }
+        static const Ops ops;
+    };
+
+    const Ops* ops = nullptr;
+    typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type storage;
+
+    template <typename Func, typename F>
+    void build(F&& func, std::true_type /* inline */)
+    {
+        new (&storage) Func(std::forward<F>(func));
+        ops = &InlineOps<Func>::ops;
+    }
+
+    template <typename Func, typename F>
+    void build(F&& func, std::false_type /* inline */)
+    {
+        *reinterpret_cast<Func**>(&storage) = new Func(std::forward<F>(func));
+        ops = &HeapOps<Func>::ops;
+    }
+
+    void takeFrom(Job& other) noexcept
+    {
+        if (other.ops != nullptr)
+        {
+            other.ops->move(&storage, &other.storage);
+            ops = other.ops;
+            other.ops = nullptr;
+        }
+    }
+
+    void reset() noexcept
+    {
+        if (ops != nullptr)
+        {
+            ops->destroy(&storage);
+            ops = nullptr;
+        }
+    }
+};
+
+template <typename Func>
+const Job::Ops Job::InlineOps<Func>::ops = {&Job::InlineOps<Func>::invoke, &Job::InlineOps<Func>::move,
+                                            &Job::InlineOps<Func>::destroy, &typeid(Func)};
+
+template <typename Func>
+const Job::Ops Job::HeapOps<Func>::ops = {&Job::HeapOps<Func>::invoke, &Job::HeapOps<Func>::move,
+                                          &Job::HeapOps<Func>::destroy, &typeid(Func)};
+
+}  // ns GLib
@@ -20,6 +20,7 @@
 #include "agent.h"
 #include "auth-manager.h"
 #include "authentication.h"
+#include "helper-pool.h"
 
 #include <csignal>
 #include <future>
@@ -31,6 +32,9 @@ std::promise<int> retval;
 int main(int argc, char* argv[])
 {
     auto auths = std::make_shared<AuthManager>();
+#ifdef ENABLE_HELPER_POOL
+    auths->setHelperPool(HelperPool::create());
+#endif
     auto agent = std::make_shared<Agent>(auths);
 
     std::signal(SIGTERM, [](int signal) -> void { retval.set_value(0); });
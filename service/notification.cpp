@@ -0,0 +1,330 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "notification.h"
+
+#include <atomic>
+#include <stdexcept>
+
+static const char* const NOTIFICATIONS_NAME = "org.freedesktop.Notifications";
+static const char* const NOTIFICATIONS_PATH = "/org/freedesktop/Notifications";
+static const char* const NOTIFICATIONS_INTERFACE = "org.freedesktop.Notifications";
+
+/* Shared by every notification, they're all talking to the same server */
+static GLib::Histogram notifyLatency;
+static GLib::Histogram closeLatency;
+static std::atomic<std::uint64_t> failures{0};
+
+/** \param bus Connection to send on, its thread-default context is
+        where the replies, signals and callbacks come in
+    \param appName Application name the server shows it with
+    \param actionCallback Called with the key of an action the user picked
+    \param closedCallback Called when the server closes it, not when we do
+    \param errorCallback Called when the server refuses to show it
+*/
+Notification::Notification(const std::shared_ptr<GDBusConnection>& bus,
+                           const std::string& appName,
+                           const std::function<void(const std::string&)>& actionCallback,
+                           const std::function<void()>& closedCallback,
+                           const std::function<void(const std::string&)>& errorCallback)
+    : shared(std::make_shared<Shared>())
+    , appName(appName)
+    , actionCallback(actionCallback)
+    , closedCallback(closedCallback)
+    , errorCallback(errorCallback)
+{
+    if (!bus)
+    {
+        throw std::runtime_error("Notification needs a bus connection");
+    }
+
+    shared->bus = bus;
+    shared->owner = this;
+
+    /* Both signals we care about, told apart in the handler. Signals
+       still waiting on the context aren't delivered once we've
+       unsubscribed, so we don't need a reference */
+    subscription = g_dbus_connection_signal_subscribe(bus.get(), NOTIFICATIONS_NAME, NOTIFICATIONS_INTERFACE,
+                                                      nullptr, /* all members */
+                                                      NOTIFICATIONS_PATH, nullptr, G_DBUS_SIGNAL_FLAGS_NONE, signal,
+                                                      this, nullptr); /* free func */
+}
+
+/** Closes it if it's shown, a Notify still in flight is closed when
+    it answers */
+Notification::~Notification()
+{
+    close();
+    shared->owner = nullptr;
+
+    g_dbus_connection_signal_unsubscribe(shared->bus.get(), subscription);
+}
+
+/** Changes what it says, shown the next time show() is called */
+void Notification::update(const std::string& summary, const std::string& body, const std::string& icon)
+{
+    this->summary = summary;
+    this->body = body;
+    this->icon = icon;
+}
+
+/** Milliseconds before the server hides it, 0 for never and -1 for
+    the server's default */
+void Notification::setTimeout(int timeout)
+{
+    this->timeout = timeout;
+}
+
+/** Adds a button, the user picking it calls the action callback with
+    \p key */
+void Notification::addAction(const std::string& key, const std::string& label)
+{
+    actions.emplace_back(key, label);
+    builtActions.reset();
+}
+
+/** Sets a hint, replacing any with the same key. A floating \p value
+    is sunk */
+void Notification::setHint(const std::string& key, GVariant* value)
+{
+    hints[key] = std::shared_ptr<GVariant>(g_variant_ref_sink(value), [](GVariant* value) { g_variant_unref(value); });
+    builtHints.reset();
+}
+
+/** Sends it to the server, replacing what is shown if it already is */
+void Notification::show()
+{
+    shared->closing = false;
+
+    if (shared->notifying)
+    {
+        shared->reshow = true;
+        return;
+    }
+
+    sendNotify(shared);
+}
+
+/** Takes it down, if it is shown or about to be. The closed callback
+    isn't called for it */
+void Notification::close()
+{
+    shared->reshow = false;
+
+    if (shared->closing || (!shared->notifying && shared->id == 0))
+    {
+        return;
+    }
+
+    shared->closing = true;
+
+    if (!shared->notifying)
+    {
+        sendClose(shared);
+    }
+}
+
+/** Round trip times for every notification so far, safe to call from
+    any thread */
+Notification::Stats Notification::stats()
+{
+    Stats stats;
+
+    stats.notifyLatency = notifyLatency.snapshot();
+    stats.closeLatency = closeLatency.snapshot();
+    stats.failures = failures.load();
+
+    return stats;
+}
+
+/** Parameters for the Notify call, as a floating reference. The
+    actions and hints don't change between updates, so they're only
+    built again when they have been changed */
+GVariant* Notification::parameters(std::uint32_t replaces) const
+{
+    auto unref = [](GVariant* variant) { g_variant_unref(variant); };
+
+    if (!builtActions)
+    {
+        GVariantBuilder builder;
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
+        for (const auto& action : actions)
+        {
+            g_variant_builder_add(&builder, "s", action.first.c_str());
+            g_variant_builder_add(&builder, "s", action.second.c_str());
+        }
+        builtActions = std::shared_ptr<GVariant>(g_variant_ref_sink(g_variant_builder_end(&builder)), unref);
+    }
+
+    if (!builtHints)
+    {
+        GVariantBuilder builder;
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+        for (const auto& hint : hints)
+        {
+            g_variant_builder_add(&builder, "{sv}", hint.first.c_str(), hint.second.get());
+        }
+        builtHints = std::shared_ptr<GVariant>(g_variant_ref_sink(g_variant_builder_end(&builder)), unref);
+    }
+
+    return g_variant_new("(susss@as@a{sv}i)", appName.c_str(), replaces, icon.c_str(), summary.c_str(), body.c_str(),
+                         builtActions.get(), builtHints.get(), timeout);
+}
+
+/** A call waiting on the server, with when it was sent */
+struct Notification::Call
+{
+    std::shared_ptr<Shared> shared;
+    gint64 sent;
+};
+
+/** Sends Notify with what the owner says, replacing the one we have
+    if there is one */
+void Notification::sendNotify(const std::shared_ptr<Shared>& shared)
+{
+    shared->notifying = true;
+
+    g_dbus_connection_call(shared->bus.get(), NOTIFICATIONS_NAME, NOTIFICATIONS_PATH, NOTIFICATIONS_INTERFACE,
+                           "Notify", shared->owner->parameters(shared->id), G_VARIANT_TYPE("(u)"),
+                           G_DBUS_CALL_FLAGS_NONE, -1, nullptr, /* cancellable */
+                           [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                               auto call = static_cast<Call*>(user_data);
+                               GError* error = nullptr;
+                               auto result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(obj), res, &error);
+
+                               notifyLatency.record(g_get_monotonic_time() - call->sent);
+
+                               auto shared = call->shared;
+                               delete call;
+
+                               notifyDone(shared, result, error);
+                           },
+                           new Call{shared, g_get_monotonic_time()});
+}
+
+/** Sends CloseNotification for the one we have, nothing waits on the
+    answer but the latency */
+void Notification::sendClose(const std::shared_ptr<Shared>& shared)
+{
+    g_dbus_connection_call(shared->bus.get(), NOTIFICATIONS_NAME, NOTIFICATIONS_PATH, NOTIFICATIONS_INTERFACE,
+                           "CloseNotification", g_variant_new("(u)", shared->id), nullptr, G_DBUS_CALL_FLAGS_NONE, -1,
+                           nullptr, /* cancellable */
+                           [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                               auto call = static_cast<Call*>(user_data);
+                               GError* error = nullptr;
+                               auto result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(obj), res, &error);
+
+                               closeLatency.record(g_get_monotonic_time() - call->sent);
+                               delete call;
+
+                               if (error != nullptr)
+                               {
+                                   failures++;
+                                   g_debug("Unable to close notification: %s", error->message);
+                                   g_error_free(error);
+                               }
+                               if (result != nullptr)
+                               {
+                                   g_variant_unref(result);
+                               }
+                           },
+                           new Call{shared, g_get_monotonic_time()});
+
+    shared->id = 0;
+}
+
+/** The server answered Notify, carry on with whatever was asked for
+    while it was in flight */
+void Notification::notifyDone(const std::shared_ptr<Shared>& shared, GVariant* result, GError* error)
+{
+    shared->notifying = false;
+
+    if (error != nullptr)
+    {
+        failures++;
+        g_warning("Unable to show notification: %s", error->message);
+        std::string message(error->message);
+        g_error_free(error);
+
+        shared->reshow = false;
+        if (shared->owner != nullptr && !shared->closing)
+        {
+            /* May destroy the owner, so it's the last thing we do */
+            auto callback = shared->owner->errorCallback;
+            callback(message);
+        }
+        shared->closing = false;
+        return;
+    }
+
+    g_variant_get(result, "(u)", &shared->id);
+    g_variant_unref(result);
+
+    if (shared->owner == nullptr || shared->closing)
+    {
+        sendClose(shared);
+        return;
+    }
+
+    if (shared->reshow)
+    {
+        shared->reshow = false;
+        sendNotify(shared);
+    }
+}
+
+/** Handler for the server's signals, only the ones for our ID */
+void Notification::signal(GDBusConnection* connection,
+                          const gchar* sender,
+                          const gchar* path,
+                          const gchar* interface,
+                          const gchar* name,
+                          GVariant* params,
+                          gpointer user_data)
+{
+    auto self = static_cast<Notification*>(user_data);
+    auto shared = self->shared;
+
+    if (g_strcmp0(name, "ActionInvoked") == 0 && g_variant_is_of_type(params, G_VARIANT_TYPE("(us)")))
+    {
+        guint32 id = 0;
+        const gchar* key = nullptr;
+        g_variant_get(params, "(u&s)", &id, &key);
+
+        if (id != 0 && id == shared->id && !shared->closing)
+        {
+            auto callback = self->actionCallback;
+            callback(key);
+        }
+    }
+    else if (g_strcmp0(name, "NotificationClosed") == 0 && g_variant_is_of_type(params, G_VARIANT_TYPE("(uu)")))
+    {
+        guint32 id = 0;
+        guint32 reason = 0;
+        g_variant_get(params, "(uu)", &id, &reason);
+
+        if (id != 0 && id == shared->id && !shared->closing)
+        {
+            g_debug("Notification %u closed by the server, reason %u", id, reason);
+            shared->id = 0;
+            auto callback = self->closedCallback;
+            callback();
+        }
+    }
+}
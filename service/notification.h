@@ -0,0 +1,126 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gio/gio.h>
+
+#include "histogram.h"
+
+/** \brief A notification shown without waiting on the notification server
+
+    libnotify's show and close are synchronous DBus calls, so every
+    Authentication thread stopped for a round trip to the notification
+    server each time it changed the snap decision. This sends Notify
+    and CloseNotification asynchronously on our own connection and
+    listens for the ActionInvoked and NotificationClosed signals
+    itself. The replies and the signals come back on the thread-default
+    context of the thread that built it, and so do the callbacks.
+
+    Once the server has given us an ID every show() replaces what is up
+    in place. Only one Notify is in flight at a time: showing again
+    while one is waits for its ID so the update replaces it rather than
+    making a second notification, and closing before the ID is known
+    closes it as soon as it is. The callbacks may destroy the
+    Notification, and destroying it closes it if it is shown, replies
+    that come back after that are handled without it.
+*/
+class Notification
+{
+public:
+    /** Round trip times in microseconds, for all notifications */
+    struct Stats
+    {
+        GLib::Histogram::Snapshot notifyLatency; /**< Time for the server to answer Notify */
+        GLib::Histogram::Snapshot closeLatency;  /**< Time for the server to answer CloseNotification */
+        std::uint64_t failures = 0;              /**< Calls that returned an error */
+    };
+
+    Notification(const std::shared_ptr<GDBusConnection>& bus,
+                 const std::string& appName,
+                 const std::function<void(const std::string&)>& actionCallback,
+                 const std::function<void()>& closedCallback,
+                 const std::function<void(const std::string&)>& errorCallback);
+    ~Notification();
+
+    Notification(const Notification&) = delete;
+    Notification& operator=(const Notification&) = delete;
+
+    void update(const std::string& summary, const std::string& body, const std::string& icon);
+    void setTimeout(int timeout);
+    void addAction(const std::string& key, const std::string& label);
+    void setHint(const std::string& key, GVariant* value);
+
+    void show();
+    void close();
+
+    static Stats stats();
+
+private:
+    /** What the calls in flight need, it outlives us if they do */
+    struct Shared
+    {
+        std::shared_ptr<GDBusConnection> bus; /**< Connection the calls go out on */
+        Notification* owner = nullptr;        /**< Cleared when we're destroyed */
+        std::uint32_t id = 0;                 /**< ID from the server, 0 until Notify answers */
+        bool notifying = false;               /**< A Notify is in flight */
+        bool reshow = false;                  /**< Notify again once the one in flight answers */
+        bool closing = false;                 /**< Close requested, ignore anything else about it */
+    };
+
+    struct Call;
+
+    static void sendNotify(const std::shared_ptr<Shared>& shared);
+    static void sendClose(const std::shared_ptr<Shared>& shared);
+    static void notifyDone(const std::shared_ptr<Shared>& shared, GVariant* result, GError* error);
+    static void signal(GDBusConnection* connection,
+                       const gchar* sender,
+                       const gchar* path,
+                       const gchar* interface,
+                       const gchar* name,
+                       GVariant* params,
+                       gpointer user_data);
+
+    GVariant* parameters(std::uint32_t replaces) const;
+
+    std::shared_ptr<Shared> shared;
+    guint subscription = 0; /**< Our signal subscription on the connection */
+
+    std::string appName;
+    std::string summary;
+    std::string body;
+    std::string icon;
+    int timeout = -1;
+    std::vector<std::pair<std::string, std::string>> actions; /**< Action keys and their labels, in order */
+    std::map<std::string, std::shared_ptr<GVariant>> hints;   /**< Hints sent with the notification */
+    mutable std::shared_ptr<GVariant> builtActions;           /**< actions as sent, until they change */
+    mutable std::shared_ptr<GVariant> builtHints;             /**< hints as sent, until they change */
+
+    std::function<void(const std::string&)> actionCallback; /**< An action was invoked, with its key */
+    std::function<void()> closedCallback;                   /**< The server closed it, not us */
+    std::function<void(const std::string&)> errorCallback;  /**< Notify failed, with the error */
+};
@@ -0,0 +1,283 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "prompt-classifier.h"
+
+#include <cstdint>
+
+typedef PromptClassifier::Type Type;
+
+/** A word that marks a kind of prompt */
+struct Keyword
+{
+    const char* text;   /**< Lower case for the ASCII letters, UTF-8 otherwise */
+    std::size_t length; /**< Bytes in text */
+    Type type;          /**< Kind of prompt it marks */
+    bool word;          /**< Only matches on its own, not inside another word */
+};
+
+template <std::size_t N>
+constexpr Keyword keyword(const char (&text)[N], Type type, bool word = false)
+{
+    return {text, N - 1, type, word};
+}
+
+/* Scripts with case that aren't ASCII get both forms where the
+   keyword starts the prompt */
+static constexpr Keyword keywords[] = {
+    /* Fingerprint, pam_fprintd */
+    keyword("fingerprint", Type::FINGERPRINT),
+    keyword("finger", Type::FINGERPRINT, true),
+    keyword("fingerabdruck", Type::FINGERPRINT),
+    keyword("empreinte", Type::FINGERPRINT),
+    keyword("huella", Type::FINGERPRINT),
+    keyword("impronta", Type::FINGERPRINT),
+    keyword("impressão digital", Type::FINGERPRINT),
+    keyword("отпечат", Type::FINGERPRINT),
+    keyword("Отпечат", Type::FINGERPRINT),
+    keyword("指纹", Type::FINGERPRINT),
+    keyword("指紋", Type::FINGERPRINT),
+    keyword("지문", Type::FINGERPRINT),
+
+    /* PIN, smart cards and pam_pkcs11 */
+    keyword("pin", Type::PIN, true),
+
+    /* One time codes, pam_oath, pam_google_authenticator and RADIUS tokens */
+    keyword("otp", Type::OTP, true),
+    keyword("one-time", Type::OTP),
+    keyword("one time", Type::OTP),
+    keyword("verification code", Type::OTP),
+    keyword("authentication code", Type::OTP),
+    keyword("passcode", Type::OTP),
+    keyword("token", Type::OTP, true),
+    keyword("bestätigungscode", Type::OTP),
+    keyword("einmalpasswort", Type::OTP),
+    keyword("code de vérification", Type::OTP),
+    keyword("código de verificación", Type::OTP),
+    keyword("código de verificação", Type::OTP),
+    keyword("код подтверждения", Type::OTP),
+    keyword("Код подтверждения", Type::OTP),
+    keyword("验证码", Type::OTP),
+    keyword("確認コード", Type::OTP),
+    keyword("ワンタイム", Type::OTP),
+
+    /* Passwords, Linux-PAM's pam_unix translations */
+    keyword("password", Type::PASSWORD),
+    keyword("passphrase", Type::PASSWORD),
+    keyword("passwort", Type::PASSWORD),
+    keyword("kennwort", Type::PASSWORD),
+    keyword("mot de passe", Type::PASSWORD),
+    keyword("contraseña", Type::PASSWORD),
+    keyword("senha", Type::PASSWORD, true),
+    keyword("wachtwoord", Type::PASSWORD),
+    keyword("hasło", Type::PASSWORD),
+    keyword("lösenord", Type::PASSWORD),
+    keyword("passord", Type::PASSWORD),
+    keyword("adgangskode", Type::PASSWORD),
+    keyword("salasana", Type::PASSWORD),
+    keyword("parola", Type::PASSWORD, true),
+    keyword("heslo", Type::PASSWORD, true),
+    keyword("jelszó", Type::PASSWORD),
+    keyword("şifre", Type::PASSWORD),
+    keyword("Şifre", Type::PASSWORD),
+    keyword("пароль", Type::PASSWORD),
+    keyword("Пароль", Type::PASSWORD),
+    keyword("κωδικός", Type::PASSWORD),
+    keyword("Κωδικός", Type::PASSWORD),
+    keyword("密码", Type::PASSWORD),
+    keyword("密碼", Type::PASSWORD),
+    keyword("パスワード", Type::PASSWORD),
+    keyword("비밀번호", Type::PASSWORD),
+    keyword("암호", Type::PASSWORD),
+    keyword("סיסמה", Type::PASSWORD),
+    keyword("كلمة المرور", Type::PASSWORD),
+
+    /* Usernames, pam_unix and login */
+    keyword("username", Type::USERNAME),
+    keyword("user name", Type::USERNAME),
+    keyword("login", Type::USERNAME, true),
+    keyword("benutzername", Type::USERNAME),
+    keyword("nom d'utilisateur", Type::USERNAME),
+    keyword("usuario", Type::USERNAME, true),
+    keyword("nome utente", Type::USERNAME),
+    keyword("gebruikersnaam", Type::USERNAME),
+    keyword("имя пользователя", Type::USERNAME),
+    keyword("Имя пользователя", Type::USERNAME),
+    keyword("用户名", Type::USERNAME),
+    keyword("ユーザー名", Type::USERNAME),
+    keyword("사용자 이름", Type::USERNAME),
+};
+
+static inline char fold(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static inline bool isWordByte(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/** Whether the bytes from \p start to \p end are only spaces and
+    colons, ASCII or full width */
+static bool onlyPunctuation(const char* start, const char* end)
+{
+    static const char fullColon[] = "\xef\xbc\x9a"; /* U+FF1A */
+
+    while (start < end)
+    {
+        if (isSpace(*start) || *start == ':')
+        {
+            start++;
+        }
+        else if (end - start >= 3 && start[0] == fullColon[0] && start[1] == fullColon[1] && start[2] == fullColon[2])
+        {
+            start += 3;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static constexpr std::size_t keywordCount = sizeof(keywords) / sizeof(keywords[0]);
+static_assert(keywordCount <= 128, "Keyword index only has room for 128 keywords");
+
+/** Built when we're compiled so the scan only compares keywords
+    that could match. Most places in a prompt don't start any keyword,
+    the pairs of bytes that do rule them out with one lookup, and for
+    those that do the first byte says which keywords to compare. */
+struct KeywordIndex
+{
+    std::uint64_t firstBytes[256][2]; /**< For each byte, which keywords start with it */
+    std::uint8_t pairs[256][32];      /**< Bit set for each pair of bytes that starts a keyword */
+};
+
+static constexpr KeywordIndex buildIndex()
+{
+    KeywordIndex index{};
+    for (std::size_t i = 0; i < keywordCount; i++)
+    {
+        auto first = static_cast<unsigned char>(keywords[i].text[0]);
+        auto second = static_cast<unsigned char>(keywords[i].text[1]);
+        index.firstBytes[first][i / 64] |= std::uint64_t(1) << (i % 64);
+        index.pairs[first][second / 8] |= 1 << (second % 8);
+    }
+    return index;
+}
+
+static constexpr KeywordIndex keywordIndex = buildIndex();
+
+/** Whether \p word is in the prompt at \p start */
+static bool matchAt(const char* prompt, std::size_t length, std::size_t start, const Keyword& word)
+{
+    if (start + word.length > length)
+    {
+        return false;
+    }
+
+    for (std::size_t i = 1; i < word.length; i++)
+    {
+        if (fold(prompt[start + i]) != word.text[i])
+        {
+            return false;
+        }
+    }
+
+    if (word.word && ((start > 0 && isWordByte(prompt[start - 1])) ||
+                      (start + word.length < length && isWordByte(prompt[start + word.length]))))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/** Classify \p length bytes of UTF-8 at \p prompt */
+PromptClassifier::Result PromptClassifier::classify(const char* prompt, std::size_t length)
+{
+    Result result;
+
+    /* Every keyword is at least two bytes */
+    for (std::size_t start = 0; start + 1 < length && result.type != Type::FINGERPRINT; start++)
+    {
+        auto first = static_cast<unsigned char>(fold(prompt[start]));
+        auto second = static_cast<unsigned char>(fold(prompt[start + 1]));
+        if ((keywordIndex.pairs[first][second / 8] & (1 << (second % 8))) == 0)
+        {
+            continue;
+        }
+
+        const auto& masks = keywordIndex.firstBytes[first];
+
+        for (std::size_t half = 0; half < 2; half++)
+        {
+            for (auto bits = masks[half]; bits != 0; bits &= bits - 1)
+            {
+                const auto& word = keywords[half * 64 + __builtin_ctzll(bits)];
+                if (word.type <= result.type || !matchAt(prompt, length, start, word))
+                {
+                    continue;
+                }
+
+                result.type = word.type;
+                result.bare = onlyPunctuation(prompt, prompt + start) &&
+                              onlyPunctuation(prompt + start + word.length, prompt + length);
+            }
+        }
+    }
+
+    return result;
+}
+
+/** Classify the prompt PAM sent us */
+PromptClassifier::Result PromptClassifier::classify(const std::string& prompt)
+{
+    return classify(prompt.data(), prompt.size());
+}
+
+/** Name of \p type, for debug messages */
+const char* PromptClassifier::typeName(Type type)
+{
+    switch (type)
+    {
+        case Type::USERNAME:
+            return "username";
+        case Type::PASSWORD:
+            return "password";
+        case Type::OTP:
+            return "otp";
+        case Type::PIN:
+            return "pin";
+        case Type::FINGERPRINT:
+            return "fingerprint";
+        case Type::UNKNOWN:
+            break;
+    }
+
+    return "unknown";
+}
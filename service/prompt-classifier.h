@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/** \brief Works out what a PAM prompt is asking for
+
+    PAM only tells us whether what is typed should be echoed, and the
+    prompt is in whatever language the module was translated to. This
+    looks for the words PAM modules use for each kind of prompt, in
+    English and the common translations of Linux-PAM, pam_fprintd and
+    the OTP modules. ASCII letters are compared without case, other
+    UTF-8 is compared as it is.
+
+    The keywords are a fixed table compiled in, and classifying is a
+    scan over the prompt for each of them, nothing is allocated. When a
+    prompt has words for more than one kind the most specific wins, so
+    "One-time password" is an OTP and "Password for login" a password.
+*/
+class PromptClassifier
+{
+public:
+    /** What a prompt is asking for, least specific first */
+    enum class Type
+    {
+        UNKNOWN,    /**< Nothing we recognize */
+        USERNAME,   /**< Who is logging in */
+        PASSWORD,   /**< The user's password */
+        OTP,        /**< A one time code from a token or an app */
+        PIN,        /**< A PIN, usually for a smart card */
+        FINGERPRINT /**< Use the fingerprint reader */
+    };
+
+    /** What classify() found */
+    struct Result
+    {
+        Type type = Type::UNKNOWN; /**< Kind of prompt */
+        bool bare = false;         /**< The prompt is only the keyword, with spaces and colons */
+    };
+
+    static Result classify(const char* prompt, std::size_t length);
+    static Result classify(const std::string& prompt);
+
+    static const char* typeName(Type type);
+};
@@ -0,0 +1,238 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "session-bus.h"
+
+const std::chrono::milliseconds SessionBus::RETRY_DELAY{1000};
+
+/* The GLib callbacks hold one of these so they can tell if we've
+   been destroyed while they were waiting */
+typedef std::weak_ptr<SessionBus> WeakBus;
+
+static void delete_weak_bus(gpointer user_data, GClosure* closure)
+{
+    delete static_cast<WeakBus*>(user_data);
+}
+
+/** Builds the SessionBus and starts getting the connection
+    \param connected Called on this thread's context each time there
+        is a new connection
+*/
+std::shared_ptr<SessionBus> SessionBus::create(const std::function<void()>& connected)
+{
+    auto bus = std::shared_ptr<SessionBus>(new SessionBus(connected));
+    bus->connect();
+    return bus;
+}
+
+SessionBus::SessionBus(const std::function<void()>& connected)
+    : connectedCallback(connected)
+    , context(g_main_context_ref_thread_default(), [](GMainContext* context) { g_main_context_unref(context); })
+    , cancel(g_cancellable_new(), [](GCancellable* cancel) { g_clear_object(&cancel); })
+{
+}
+
+SessionBus::~SessionBus()
+{
+    g_cancellable_cancel(cancel.get());
+
+    if (retry != nullptr)
+    {
+        g_source_destroy(retry);
+        g_source_unref(retry);
+    }
+
+    if (bus && closedSignal != 0)
+    {
+        g_signal_handler_disconnect(bus.get(), closedSignal);
+    }
+}
+
+/** The current connection, nullptr if we're waiting on one */
+std::shared_ptr<GDBusConnection> SessionBus::connection() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bus;
+}
+
+/** How many times we've connected, more than one means the
+    connection has been lost and made again */
+std::uint64_t SessionBus::connects() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return connectCount;
+}
+
+/** Opens a connection to the session bus, called on our context so
+    that is where the answer comes back. Finding the address can mean
+    asking X or launching a bus, so that is done on a GIO worker
+    thread and we carry on in connectTo(). */
+void SessionBus::connect()
+{
+    auto task = g_task_new(nullptr, /* source */
+                           cancel.get(),
+                           [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                               auto weak = static_cast<WeakBus*>(user_data);
+                               GError* error = nullptr;
+                               auto address = static_cast<gchar*>(g_task_propagate_pointer(G_TASK(res), &error));
+
+                               auto self = weak->lock();
+                               delete weak;
+
+                               if (!self)
+                               {
+                                   g_free(address);
+                                   g_clear_error(&error);
+                                   return;
+                               }
+
+                               if (error != nullptr)
+                               {
+                                   self->gotConnection(nullptr, error);
+                                   return;
+                               }
+
+                               self->connectTo(address);
+                               g_free(address);
+                           },
+                           new WeakBus(shared_from_this()));
+
+    g_task_run_in_thread(task, [](GTask* task, gpointer source, gpointer task_data, GCancellable* cancellable) {
+        GError* error = nullptr;
+        auto address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, cancellable, &error);
+        if (error != nullptr)
+        {
+            g_task_return_error(task, error);
+            return;
+        }
+        g_task_return_pointer(task, address, g_free);
+    });
+    g_object_unref(task);
+}
+
+/** Opens our own connection to the bus at \p address, on our context */
+void SessionBus::connectTo(const gchar* address)
+{
+    g_dbus_connection_new_for_address(
+        address,
+        GDBusConnectionFlags(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                             G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+        nullptr, cancel.get(),
+        [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+            auto weak = static_cast<WeakBus*>(user_data);
+            GError* error = nullptr;
+            auto connection = g_dbus_connection_new_for_address_finish(res, &error);
+
+            auto self = weak->lock();
+            delete weak;
+
+            if (!self)
+            {
+                g_clear_object(&connection);
+                g_clear_error(&error);
+                return;
+            }
+
+            self->gotConnection(connection, error);
+        },
+        new WeakBus(shared_from_this()));
+}
+
+/** Tries connecting again after RETRY_DELAY */
+void SessionBus::connectLater()
+{
+    if (retry != nullptr)
+    {
+        g_source_destroy(retry);
+        g_source_unref(retry);
+    }
+
+    retry = g_timeout_source_new(RETRY_DELAY.count());
+    g_source_set_callback(retry,
+                          [](gpointer user_data) -> gboolean {
+                              auto self = static_cast<WeakBus*>(user_data)->lock();
+                              if (self)
+                              {
+                                  g_source_unref(self->retry);
+                                  self->retry = nullptr;
+                                  self->connect();
+                              }
+                              return G_SOURCE_REMOVE;
+                          },
+                          new WeakBus(shared_from_this()),
+                          [](gpointer user_data) { delete static_cast<WeakBus*>(user_data); });
+    g_source_attach(retry, context.get());
+}
+
+/** Result of connect(), called on our context */
+void SessionBus::gotConnection(GDBusConnection* connection, GError* error)
+{
+    if (error != nullptr)
+    {
+        g_warning("Unable to get session bus, trying again: %s", error->message);
+        g_error_free(error);
+        connectLater();
+        return;
+    }
+
+    auto shared =
+        std::shared_ptr<GDBusConnection>(connection, [](GDBusConnection* connection) { g_clear_object(&connection); });
+    auto handler = g_signal_connect_data(connection, "closed", G_CALLBACK(busClosed), new WeakBus(shared_from_this()),
+                                         delete_weak_bus, GConnectFlags(0));
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        bus = shared;
+        closedSignal = handler;
+        connectCount++;
+    }
+
+    g_debug("Connected to the session bus as '%s'", g_dbus_connection_get_unique_name(connection));
+    connectedCallback();
+}
+
+/** Handler for the "closed" signal on the connection */
+void SessionBus::busClosed(GDBusConnection* connection, gboolean remote_peer_vanished, GError* error, gpointer user_data)
+{
+    auto self = static_cast<WeakBus*>(user_data)->lock();
+    if (self)
+    {
+        self->closed();
+    }
+}
+
+/** The connection closed under us, drop it and get a new one */
+void SessionBus::closed()
+{
+    g_warning("Session bus connection closed, reconnecting");
+
+    std::shared_ptr<GDBusConnection> old;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        old = std::move(bus);
+        bus.reset();
+        if (closedSignal != 0)
+        {
+            g_signal_handler_disconnect(old.get(), closedSignal);
+            closedSignal = 0;
+        }
+    }
+
+    connect();
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <gio/gio.h>
+
+/** \brief A session bus connection that is always being kept up
+
+    The connection is opened asynchronously when this is created, and
+    again whenever it closes, so nothing that uses it ever waits on
+    the bus. It is our own connection rather than GIO's shared one so
+    that a closed one can be replaced without waiting for everything
+    else holding the shared connection to let go of it. Until it is
+    connected connection() returns nullptr, once it is the connected
+    callback is called. If getting the bus fails it is retried after
+    RETRY_DELAY.
+
+    All of the work, and the connected callback, happens on the
+    thread-default context of the thread that created it.
+*/
+class SessionBus : public std::enable_shared_from_this<SessionBus>
+{
+public:
+    /** How long to wait before trying again when the bus can't be reached */
+    static const std::chrono::milliseconds RETRY_DELAY;
+
+    static std::shared_ptr<SessionBus> create(const std::function<void()>& connected = [] {});
+    ~SessionBus();
+
+    SessionBus(const SessionBus&) = delete;
+    SessionBus& operator=(const SessionBus&) = delete;
+
+    std::shared_ptr<GDBusConnection> connection() const;
+    std::uint64_t connects() const;
+
+private:
+    explicit SessionBus(const std::function<void()>& connected);
+
+    void connect();
+    void connectTo(const gchar* address);
+    void connectLater();
+    void gotConnection(GDBusConnection* bus, GError* error);
+    void closed();
+    static void busClosed(GDBusConnection* connection, gboolean remote_peer_vanished, GError* error, gpointer user_data);
+
+    std::function<void()> connectedCallback; /**< Called each time we have a new connection */
+    std::shared_ptr<GMainContext> context;    /**< Context the requests and callbacks happen on */
+    std::shared_ptr<GCancellable> cancel;     /**< Cancels an outstanding request when we're destroyed */
+    GSource* retry = nullptr;                 /**< Timeout to try again, if there is one */
+
+    mutable std::mutex lock;
+    std::shared_ptr<GDBusConnection> bus; /**< The connection, nullptr while we're getting one */
+    gulong closedSignal = 0;              /**< Handler for the connection closing */
+    std::uint64_t connectCount = 0;       /**< How many connections we've had */
+};
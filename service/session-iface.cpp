@@ -30,8 +30,8 @@
 class Session::Impl
 {
 private:
-    /** Identity we're running against */
-    std::string identity;
+    /** Identity we're running against, the same object for every reset */
+    Identity identity;
     /** Cookie of the transaction */
     std::string cookie;
 
@@ -42,10 +42,10 @@ private:
     bool sessionComplete;
 
 public:
-    Impl(const std::string& in_identity, const std::string& in_cookie)
+    Impl(const Identity& in_identity, const std::string& in_cookie)
         : identity(in_identity)
         , cookie(in_cookie)
-        , session(polkit_agent_session_new(polkit_identity_from_string(identity.c_str(), nullptr), cookie.c_str()))
+        , session(polkit_agent_session_new(identity.get(), cookie.c_str())) /* takes its own reference */
         , sessionComplete(false)
     {
     }
@@ -66,11 +66,6 @@ public:
         for whether it was successful or not. */
     core::Signal<bool> complete;
 
-    gulong gsig_request = 0;    /**< GLib signal handle */
-    gulong gsig_show_info = 0;  /**< GLib signal handle */
-    gulong gsig_show_error = 0; /**< GLib signal handle */
-    gulong gsig_completed = 0;  /**< GLib signal handle */
-
     /** Sends a response to the Polkit Session.
         \param response Text response from the user */
     void requestResponse(const std::string& response)
@@ -118,24 +113,21 @@ private:
     }
 
     /** Clears the saved GObject and makes sure to disconnect
-        all of its signals */
+        all of its signals. A session that has completed has no
+        helper left to cancel. */
     void clearSession()
     {
+        if (session == nullptr)
+        {
+            return;
+        }
+
         if (!sessionComplete)
         {
             polkit_agent_session_cancel(session);
         }
 
-        g_signal_handler_disconnect(session, gsig_request);
-        g_signal_handler_disconnect(session, gsig_show_info);
-        g_signal_handler_disconnect(session, gsig_show_error);
-        g_signal_handler_disconnect(session, gsig_completed);
-
-        gsig_request = 0;
-        gsig_show_info = 0;
-        gsig_show_error = 0;
-        gsig_completed = 0;
-
+        g_signal_handlers_disconnect_by_data(session, this);
         g_clear_object(&session);
     }
 
@@ -143,27 +135,31 @@ public:
     /** Internal implementation functions don't have to have good names */
     void go()
     {
-        gsig_request = g_signal_connect(session, "request", G_CALLBACK(requestCb), this);
-        gsig_show_info = g_signal_connect(session, "show-info", G_CALLBACK(infoCb), this);
-        gsig_show_error = g_signal_connect(session, "show-error", G_CALLBACK(errorCb), this);
-        gsig_completed = g_signal_connect(session, "completed", G_CALLBACK(completeCb), this);
+        g_signal_connect(session, "request", G_CALLBACK(requestCb), this);
+        g_signal_connect(session, "show-info", G_CALLBACK(infoCb), this);
+        g_signal_connect(session, "show-error", G_CALLBACK(errorCb), this);
+        g_signal_connect(session, "completed", G_CALLBACK(completeCb), this);
 
         polkit_agent_session_initiate(session);
     }
 
     /** Clears the internal GObject and then reinitializes it to
-        get another session going */
+        get another session going. Called for a retry, often from
+        inside the completed signal of the one being replaced, which
+        holds its own reference while it is emitting. The identity and
+        cookie are kept, only the conversation with the helper is new. */
     void reset()
     {
         clearSession();
 
-        session = polkit_agent_session_new(polkit_identity_from_string(identity.c_str(), nullptr), cookie.c_str());
+        session = polkit_agent_session_new(identity.get(), cookie.c_str());
+        sessionComplete = false;
 
         go();
     }
 };
 
-Session::Session(const std::string& identity, const std::string& cookie)
+Session::Session(const Identity& identity, const std::string& cookie)
     : impl(std::make_shared<Impl>(identity, cookie))
 {
 }
@@ -21,6 +21,8 @@
 #include <memory>
 #include <string>
 
+#include "identity.h"
+
 #pragma once
 
 /** \brief An interface for the session functionality of libpolicykitagent
@@ -34,7 +36,7 @@
 class Session
 {
 public:
-    Session(const std::string& identity, const std::string& cookie);
+    Session(const Identity& identity, const std::string& cookie);
     virtual ~Session();
 
     virtual void initiate();
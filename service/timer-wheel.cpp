@@ -0,0 +1,369 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#include "timer-wheel.h"
+
+#include <utility>
+
+namespace GLib
+{
+
+const std::uint64_t TimerWheel::NEVER;
+const unsigned int TimerWheel::LEVEL_BITS;
+const unsigned int TimerWheel::SLOTS;
+const unsigned int TimerWheel::LEVELS;
+const std::uint32_t TimerWheel::NIL;
+const unsigned int TimerWheel::EXPIRED_LEVEL;
+
+/** Rotate a slot bitmap so that bit \p start becomes bit zero */
+static inline std::uint64_t rotate(std::uint64_t bits, unsigned int start)
+{
+    start &= 63;
+    if (start == 0)
+    {
+        return bits;
+    }
+    return (bits >> start) | (bits << (64 - start));
+}
+
+TimerWheel::TimerWheel(std::uint64_t now)
+    : current(now)
+{
+}
+
+/** Adds a timer.
+    \param now The current tick
+    \param expiry Tick at which the timer should fire
+    \param work What to run when the timer fires
+    \param tag Value handed back with the work by popExpired(), up to 255
+    \return Handle that can be passed to cancel()
+*/
+TimerWheel::Handle TimerWheel::add(std::uint64_t now, std::uint64_t expiry, Job work, unsigned int tag)
+{
+    /* Nothing to process between here and now, so we can catch up
+       and keep the new timer in the lowest level possible */
+    if (count == 0 && now > current)
+    {
+        current = now;
+    }
+
+    std::uint32_t index;
+    if (freeNodes != NIL)
+    {
+        index = freeNodes;
+        freeNodes = nodes[index].next;
+    }
+    else
+    {
+        nodes.emplace_back();
+        index = nodes.size() - 1;
+    }
+
+    auto& node = nodes[index];
+    node.work = std::move(work);
+    node.expiry = expiry;
+    node.tag = tag;
+    node.active = true;
+    count++;
+
+    place(index);
+
+    Handle handle;
+    handle.index = index;
+    handle.generation = node.generation;
+    return handle;
+}
+
+/** Cancels a timer that hasn't been run yet.
+    \param handle Handle returned by add()
+    \return Whether the timer was found
+*/
+bool TimerWheel::cancel(const Handle& handle)
+{
+    Job work;
+    return cancel(handle, work);
+}
+
+/** Cancels a timer and hands back its work, so that the owner can
+    destroy it outside of any locks it holds.
+    \param handle Handle returned by add()
+    \param work Location to move the timer's work into
+    \return Whether the timer was found
+*/
+bool TimerWheel::cancel(const Handle& handle, Job& work)
+{
+    if (handle.generation == 0 || handle.index >= nodes.size())
+    {
+        return false;
+    }
+
+    auto& node = nodes[handle.index];
+    if (!node.active || node.generation != handle.generation)
+    {
+        return false;
+    }
+
+    unlink(handle.index);
+    work = std::move(node.work);
+    release(handle.index);
+
+    return true;
+}
+
+/** Moves time forward to \p now, timers that are due are moved to the
+    expired list to be picked up with popExpired() */
+void TimerWheel::advance(std::uint64_t now)
+{
+    while (true)
+    {
+        auto tick = nextEvent();
+        if (tick == NEVER || tick > now)
+        {
+            break;
+        }
+        process(tick);
+    }
+
+    if (now > current)
+    {
+        current = now;
+    }
+}
+
+/** Takes the next expired timer
+    \param work Location to move the timer's work into
+    \return Whether there was an expired timer
+*/
+bool TimerWheel::popExpired(Job& work)
+{
+    unsigned int tag;
+    return popExpired(work, tag);
+}
+
+/** Takes the next expired timer along with its tag
+    \param work Location to move the timer's work into
+    \param tag Location for the tag the timer was added with
+    \return Whether there was an expired timer
+*/
+bool TimerWheel::popExpired(Job& work, unsigned int& tag)
+{
+    if (expired.head == NIL)
+    {
+        return false;
+    }
+
+    auto index = expired.head;
+    unlink(index);
+    work = std::move(nodes[index].work);
+    tag = nodes[index].tag;
+    release(index);
+
+    return true;
+}
+
+/** The tick at which the owner should call advance() next, may be
+    earlier than any timer expires if timers need to move between
+    levels. NEVER if there are no timers. */
+std::uint64_t TimerWheel::nextExpiry() const
+{
+    if (expired.head != NIL)
+    {
+        return current;
+    }
+    return nextEvent();
+}
+
+/** Number of timers waiting to be run */
+std::size_t TimerWheel::size() const
+{
+    return count;
+}
+
+/** Put a node in the right slot for its expiry */
+void TimerWheel::place(std::uint32_t index)
+{
+    auto expiry = nodes[index].expiry;
+
+    if (expiry <= current)
+    {
+        link(index, EXPIRED_LEVEL, 0);
+        return;
+    }
+
+    auto delta = expiry - current;
+    for (unsigned int level = 0; level < LEVELS; level++)
+    {
+        if (delta < (std::uint64_t(1) << (LEVEL_BITS * (level + 1))))
+        {
+            link(index, level, (expiry >> (LEVEL_BITS * level)) & (SLOTS - 1));
+            return;
+        }
+    }
+
+    /* Further out than the wheel covers, park it as far out as we can
+       and it'll get placed again when we get there. */
+    auto furthest = current + (std::uint64_t(1) << (LEVEL_BITS * LEVELS)) - 1;
+    link(index, LEVELS - 1, (furthest >> (LEVEL_BITS * (LEVELS - 1))) & (SLOTS - 1));
+}
+
+/** Add a node to the end of a slot */
+void TimerWheel::link(std::uint32_t index, unsigned int level, unsigned int slot)
+{
+    auto& list = level == EXPIRED_LEVEL ? expired : slots[level][slot];
+    auto& node = nodes[index];
+
+    node.level = level;
+    node.slot = slot;
+    node.next = NIL;
+    node.prev = list.tail;
+
+    if (list.tail != NIL)
+    {
+        nodes[list.tail].next = index;
+    }
+    else
+    {
+        list.head = index;
+    }
+    list.tail = index;
+
+    if (level != EXPIRED_LEVEL)
+    {
+        occupied[level] |= std::uint64_t(1) << slot;
+    }
+}
+
+/** Take a node out of whichever slot it is in */
+void TimerWheel::unlink(std::uint32_t index)
+{
+    auto& node = nodes[index];
+    auto& list = node.level == EXPIRED_LEVEL ? expired : slots[node.level][node.slot];
+
+    if (node.prev != NIL)
+    {
+        nodes[node.prev].next = node.next;
+    }
+    else
+    {
+        list.head = node.next;
+    }
+
+    if (node.next != NIL)
+    {
+        nodes[node.next].prev = node.prev;
+    }
+    else
+    {
+        list.tail = node.prev;
+    }
+
+    node.prev = NIL;
+    node.next = NIL;
+
+    if (node.level != EXPIRED_LEVEL && list.head == NIL)
+    {
+        occupied[node.level] &= ~(std::uint64_t(1) << node.slot);
+    }
+}
+
+/** Put a node on the free list, any handles to it become invalid */
+void TimerWheel::release(std::uint32_t index)
+{
+    auto& node = nodes[index];
+
+    node.work = nullptr;
+    node.active = false;
+    node.generation = node.generation + 1 == 0 ? 1 : node.generation + 1;
+    node.next = freeNodes;
+    freeNodes = index;
+    count--;
+}
+
+/** The first tick after current where a slot needs processing */
+std::uint64_t TimerWheel::nextEvent() const
+{
+    auto next = NEVER;
+
+    for (unsigned int level = 0; level < LEVELS; level++)
+    {
+        if (occupied[level] == 0)
+        {
+            continue;
+        }
+
+        auto shift = LEVEL_BITS * level;
+        auto position = (current >> shift) & (SLOTS - 1);
+
+        /* Distance in slots to the next occupied one, looking at the
+           slot after ours first and ours, a full turn away, last */
+        auto distance = __builtin_ctzll(rotate(occupied[level], position + 1)) + 1;
+        auto tick = ((current >> shift) + distance) << shift;
+
+        if (tick < next)
+        {
+            next = tick;
+        }
+    }
+
+    return next;
+}
+
+/** Handle everything that happens at \p tick */
+void TimerWheel::process(std::uint64_t tick)
+{
+    current = tick;
+
+    /* Move timers down from the higher levels whose slots start now,
+       they'll land in a lower level or in the expired list. */
+    for (unsigned int level = LEVELS - 1; level > 0; level--)
+    {
+        auto shift = LEVEL_BITS * level;
+        if ((tick & ((std::uint64_t(1) << shift) - 1)) != 0)
+        {
+            continue;
+        }
+
+        auto slot = (tick >> shift) & (SLOTS - 1);
+        auto index = slots[level][slot].head;
+        slots[level][slot] = List();
+        occupied[level] &= ~(std::uint64_t(1) << slot);
+
+        while (index != NIL)
+        {
+            auto next = nodes[index].next;
+            place(index);
+            index = next;
+        }
+    }
+
+    /* Everything in the first level slot expires now */
+    auto slot = tick & (SLOTS - 1);
+    auto index = slots[0][slot].head;
+    slots[0][slot] = List();
+    occupied[0] &= ~(std::uint64_t(1) << slot);
+
+    while (index != NIL)
+    {
+        auto next = nodes[index].next;
+        link(index, EXPIRED_LEVEL, 0);
+        index = next;
+    }
+}
+
+}  // ns GLib
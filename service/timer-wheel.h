@@ -0,0 +1,132 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "job.h"
+
+namespace GLib
+{
+
+/** \brief Hierarchical timer wheel
+
+    Keeps any number of timers and tells its owner the one time it
+    needs to wake up, so that a single GSource can serve every timeout
+    on a ContextThread. Time is measured in ticks, what a tick is is
+    up to the owner.
+
+    There are LEVELS wheels of SLOTS slots each. The first level has
+    one slot per tick, each level above it has slots that are SLOTS
+    times wider than the level below. A timer goes into the lowest
+    level that can hold it and moves down a level each time the wheel
+    reaches the start of its slot, until it expires out of the first
+    level. Adding and cancelling a timer are O(1), as is finding the
+    next time to wake up.
+
+    Timers are kept in a slab and referenced by index and generation,
+    so once the slab has grown to the number of concurrent timers
+    adding one doesn't allocate.
+
+    Each timer can carry a small tag for the owner, ContextThread uses
+    it for the priority of the timer's work.
+
+    This class does no locking, the owner must serialize access.
+*/
+class TimerWheel
+{
+public:
+    /** Reference to a timer so that it can be cancelled */
+    struct Handle
+    {
+        std::uint32_t index = 0;
+        std::uint32_t generation = 0; /**< Zero is never a valid generation */
+    };
+
+    /** Returned by nextExpiry() when there are no timers */
+    static const std::uint64_t NEVER = std::numeric_limits<std::uint64_t>::max();
+
+    explicit TimerWheel(std::uint64_t now = 0);
+
+    Handle add(std::uint64_t now, std::uint64_t expiry, Job work, unsigned int tag = 0);
+    bool cancel(const Handle& handle);
+    bool cancel(const Handle& handle, Job& work);
+
+    void advance(std::uint64_t now);
+    bool popExpired(Job& work);
+    bool popExpired(Job& work, unsigned int& tag);
+
+    std::uint64_t nextExpiry() const;
+    std::size_t size() const;
+
+private:
+    static const unsigned int LEVEL_BITS = 6;
+    static const unsigned int SLOTS = 1 << LEVEL_BITS;
+    static const unsigned int LEVELS = 4;
+    static const std::uint32_t NIL = std::numeric_limits<std::uint32_t>::max();
+    /** Where the expired list lives in the slot numbering */
+    static const unsigned int EXPIRED_LEVEL = LEVELS;
+
+    struct Node
+    {
+        Job work;
+        std::uint64_t expiry = 0;
+        std::uint32_t prev = NIL;
+        std::uint32_t next = NIL;
+        std::uint32_t generation = 1;
+        std::uint8_t level = 0;
+        std::uint8_t slot = 0;
+        std::uint8_t tag = 0;
+        bool active = false;
+    };
+
+    /** Doubly linked list of nodes */
+    struct List
+    {
+        std::uint32_t head = NIL;
+        std::uint32_t tail = NIL;
+    };
+
+    /** The last tick that has been processed */
+    std::uint64_t current;
+    /** Number of timers that haven't been popped or cancelled */
+    std::size_t count = 0;
+
+    std::vector<Node> nodes;
+    /** Unused nodes, linked through next */
+    std::uint32_t freeNodes = NIL;
+
+    List slots[LEVELS][SLOTS];
+    /** Bit per slot saying whether it has any timers */
+    std::uint64_t occupied[LEVELS] = {0};
+    /** Timers that are due to be run */
+    List expired;
+
+    void place(std::uint32_t index);
+    void link(std::uint32_t index, unsigned int level, unsigned int slot);
+    void unlink(std::uint32_t index);
+    void release(std::uint32_t index);
+    std::uint64_t nextEvent() const;
+    void process(std::uint64_t tick);
+};
+
+}  // ns GLib
@@ -144,9 +144,27 @@ public:
                              const std::string&,
                              const std::string&,
                              const std::string&,
-                             const std::list<std::string>&,
+                             const std::list<Identity>&,
                              const std::function<void(Authentication::State)>&));
     MOCK_METHOD1(cancelAuthentication, bool(const std::string&));
+
+    /* The agent uses the async versions, send them to the mocks */
+    GLib::Future<std::string> createAuthenticationAsync(
+        const std::string& action_id,
+        const std::string& message,
+        const std::string& icon_name,
+        const CookieRegistry::Handle& cookie,
+        const std::list<Identity>& identities,
+        const std::function<void(Authentication::State)>& finishedCallback) override
+    {
+        return GLib::makeReadyFuture(createAuthentication(action_id, message, icon_name, registry()->cookie(cookie),
+                                                          identities, finishedCallback));
+    }
+
+    GLib::Future<bool> cancelAuthenticationAsync(const CookieRegistry::Handle& handle) override
+    {
+        return GLib::makeReadyFuture(cancelAuthentication(registry()->cookie(handle)));
+    }
 };
 
 class AuthCallbackMatcher
@@ -288,7 +306,7 @@ public:
                         std::string,
                         std::string,
                         std::string,
-                        std::list<std::string>,
+                        std::list<Identity>,
                         std::function<void(Authentication::State)>>>
         openAuths;
 
@@ -296,7 +314,7 @@ public:
                                              const std::string& message,
                                              const std::string& icon_name,
                                              const std::string& cookie,
-                                             const std::list<std::string>& identities,
+                                             const std::list<Identity>& identities,
                                              const std::function<void(Authentication::State)>& finishedCallback)
     {
         openAuths.emplace(cookie, std::make_tuple(action_id, message, icon_name, cookie, identities, finishedCallback));
@@ -317,6 +335,23 @@ public:
 
         return true;
     }
+
+    GLib::Future<std::string> createAuthenticationAsync(
+        const std::string& action_id,
+        const std::string& message,
+        const std::string& icon_name,
+        const CookieRegistry::Handle& cookie,
+        const std::list<Identity>& identities,
+        const std::function<void(Authentication::State)>& finishedCallback) override
+    {
+        return GLib::makeReadyFuture(createAuthentication(action_id, message, icon_name, registry()->cookie(cookie),
+                                                          identities, finishedCallback));
+    }
+
+    GLib::Future<bool> cancelAuthenticationAsync(const CookieRegistry::Handle& handle) override
+    {
+        return GLib::makeReadyFuture(cancelAuthentication(registry()->cookie(handle)));
+    }
 };
 
 TEST_F(AgentTest, ShutdownCancel)
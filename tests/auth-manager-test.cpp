@@ -116,7 +116,7 @@ public:
                        const std::string& message,
                        const std::string& icon_name,
                        const std::string& cookie,
-                       const std::list<std::string>& identities,
+                       const std::list<Identity>& identities,
                        const std::function<void(State)>& finishedCallback)
         : Authentication()
         , _action_id(action_id)
@@ -125,15 +125,43 @@ public:
         , _cookie(cookie)
         , _identities(identities)
         , _finishedCallback(finishedCallback)
+        , _thread(std::this_thread::get_id())
     {
     }
 
     virtual void cancel() override
     {
         g_debug("Mock cancelled");
+        for (auto& follower : _followers)
+        {
+            follower.second(Authentication::State::CANCELLED);
+        }
+        _followers.clear();
         _finishedCallback(Authentication::State::CANCELLED);
     }
 
+    virtual bool join(const std::string& cookie,
+                      const std::string& action_id,
+                      const std::string& message,
+                      const std::function<void(State)>& callback) override
+    {
+        _followers.emplace_back(cookie, callback);
+        return true;
+    }
+
+    virtual void leave(const std::string& cookie) override
+    {
+        for (auto follower = _followers.begin(); follower != _followers.end(); follower++)
+        {
+            if (follower->first == cookie)
+            {
+                follower->second(Authentication::State::CANCELLED);
+                _followers.erase(follower);
+                return;
+            }
+        }
+    }
+
     virtual void start() override
     {
         g_debug("Starting Mock authentication");
@@ -143,15 +171,17 @@ public:
     std::string _message;
     std::string _icon_name;
     std::string _cookie;
-    std::list<std::string> _identities;
+    std::list<Identity> _identities;
     std::function<void(State)> _finishedCallback;
+    std::thread::id _thread;
+    std::list<std::pair<std::string, std::function<void(State)>>> _followers;
 };
 
 class AuthManagerAuthMock : public AuthManager
 {
 public:
-    AuthManagerAuthMock()
-        : AuthManager()
+    AuthManagerAuthMock(unsigned int threads = 0)
+        : AuthManager(threads)
     {
     }
 
@@ -160,19 +190,21 @@ public:
     }
 
     std::weak_ptr<AuthenticationMock> lastMock;
+    std::atomic<int> built{0};
 
     std::shared_ptr<Authentication> buildAuthentication(
         const std::string& action_id,
         const std::string& message,
         const std::string& icon_name,
         const std::string& cookie,
-        const std::list<std::string>& identities,
+        const std::list<Identity>& identities,
         const std::function<void(Authentication::State)>& finishedCallback) override
     {
         g_debug("Building Mock Authentication");
         auto auth =
             std::make_shared<AuthenticationMock>(action_id, message, icon_name, cookie, identities, finishedCallback);
         lastMock = auth;
+        built++;
         return auth;
     }
 };
@@ -195,13 +227,76 @@ TEST_F(AuthManagerTest, createAuth)
     EXPECT_EQ("message", authman.lastMock.lock()->_message);
     EXPECT_EQ("icon-name", authman.lastMock.lock()->_icon_name);
     EXPECT_EQ("everyone-loves-cookies", authman.lastMock.lock()->_cookie);
-    EXPECT_EQ(std::list<std::string>({"unix-name:me"}), authman.lastMock.lock()->_identities);
+    EXPECT_EQ(std::list<Identity>({"unix-name:me"}), authman.lastMock.lock()->_identities);
     EXPECT_TRUE((bool)(authman.lastMock.lock()->_finishedCallback));
 
     authman.lastMock.lock()->_finishedCallback(Authentication::State::CANCELLED);
     EXPECT_EQ(true, callback);
 }
 
+TEST_F(AuthManagerTest, createAuthAsync)
+{
+    AuthManagerAuthMock authman;
+    GLib::ContextThread thread;
+    bool callback = false;
+
+    auto handle = authman.createAuthenticationAsync("action-id", "message", "icon-name", "everyone-loves-cookies",
+                                                    {"unix-name:me"},
+                                                    [&callback](Authentication::State state) { callback = true; });
+
+    /* Continuation runs on the thread we ask for */
+    auto continued = handle.then(thread, [](GLib::Future<std::string> created) {
+        EXPECT_EQ("everyone-loves-cookies", created.get());
+        return std::this_thread::get_id();
+    });
+
+    EXPECT_NE(std::this_thread::get_id(), continued.get());
+
+    ASSERT_FALSE(authman.lastMock.expired());
+    EXPECT_EQ("everyone-loves-cookies", authman.lastMock.lock()->_cookie);
+
+    auto cancelled = authman.cancelAuthenticationAsync("everyone-loves-cookies");
+    EXPECT_TRUE(cancelled.get());
+    EXPECT_TRUE(callback);
+}
+
+TEST_F(AuthManagerTest, cookieHandles)
+{
+    AuthManagerAuthMock authman;
+    auto registry = authman.registry();
+    bool cancelled = false;
+
+    /* We keep our reference, the manager takes its own */
+    auto cookie = registry->intern("cookie-handle");
+    EXPECT_EQ("cookie-handle",
+              authman
+                  .createAuthenticationAsync("action-id", "message", "icon-name", cookie, {"unix-name:me"},
+                                             [&cancelled](Authentication::State state) {
+                                                 cancelled = state == Authentication::State::CANCELLED;
+                                             })
+                  .get());
+    ASSERT_FALSE(authman.lastMock.expired());
+    EXPECT_EQ("cookie-handle", authman.lastMock.lock()->_cookie);
+
+    EXPECT_TRUE(authman.cancelAuthenticationAsync(cookie).get());
+    EXPECT_TRUE(cancelled);
+
+    registry->release(cookie);
+    for (int i = 0; i < 100 && registry->size() != 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    EXPECT_EQ(0u, registry->size());
+
+    /* Once it is gone the handle doesn't find anything */
+    EXPECT_FALSE(authman.cancelAuthenticationAsync(cookie).get());
+    EXPECT_THROW(authman
+                     .createAuthenticationAsync("action-id", "message", "icon-name", cookie, {"unix-name:me"},
+                                                [](Authentication::State state) {})
+                     .get(),
+                 std::runtime_error);
+}
+
 TEST_F(AuthManagerTest, cancelAuth)
 {
     AuthManagerAuthMock authman;
@@ -219,6 +314,246 @@ TEST_F(AuthManagerTest, cancelAuth)
     EXPECT_TRUE(callback_cancelled);
 }
 
+TEST_F(AuthManagerTest, pool)
+{
+    AuthManagerAuthMock authman(2);
+    int cancelled = 0;
+
+    authman.createAuthentication("action-one", "message", "icon-name", "cookie-one", {"unix-name:me"},
+                                 [&cancelled](Authentication::State state) { cancelled++; });
+    ASSERT_FALSE(authman.lastMock.expired());
+    auto first = authman.lastMock.lock()->_thread;
+
+    authman.createAuthentication("action-two", "message", "icon-name", "cookie-two", {"unix-name:me"},
+                                 [&cancelled](Authentication::State state) { cancelled++; });
+    ASSERT_FALSE(authman.lastMock.expired());
+    auto second = authman.lastMock.lock()->_thread;
+
+    /* Spread out, and neither on our thread */
+    EXPECT_NE(first, second);
+    EXPECT_NE(std::this_thread::get_id(), first);
+    EXPECT_NE(std::this_thread::get_id(), second);
+    EXPECT_EQ(2u, authman.poolStats().size());
+
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-one"));
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-two"));
+    EXPECT_EQ(2, cancelled);
+
+    /* Same cookie can't be in flight twice */
+    authman.createAuthentication("action-id", "message", "icon-name", "cookie-three", {"unix-name:me"},
+                                 [](Authentication::State state) {});
+    EXPECT_THROW(authman.createAuthentication("action-id", "message", "icon-name", "cookie-three",
+                                              {"unix-name:me"}, [](Authentication::State state) {}),
+                 std::runtime_error);
+}
+
+TEST_F(AuthManagerTest, cookies)
+{
+    CookieRegistry registry;
+
+    auto one = registry.intern("cookie-one");
+    auto two = registry.intern("cookie-two");
+    EXPECT_TRUE(one.valid());
+    EXPECT_NE(one, two);
+    EXPECT_EQ(one, registry.intern("cookie-one"));
+    EXPECT_EQ(one, registry.find("cookie-one"));
+    EXPECT_FALSE(registry.find("cookie-three").valid());
+    EXPECT_EQ("cookie-two", registry.cookie(two));
+
+    CookieRegistry::Table<int> table;
+    *table.insert(one) = 1;
+    EXPECT_EQ(nullptr, table.insert(one));
+    EXPECT_EQ(1, *table.find(one));
+    EXPECT_EQ(nullptr, table.find(two));
+
+    /* Held twice, so still there after one release */
+    registry.release(one);
+    EXPECT_EQ(one, registry.find("cookie-one"));
+    registry.release(one);
+    EXPECT_FALSE(registry.find("cookie-one").valid());
+    EXPECT_EQ("", registry.cookie(one));
+    EXPECT_THROW(registry.release(one), std::logic_error);
+    EXPECT_FALSE(registry.retain(one));
+
+    /* A reference can be taken by handle too */
+    EXPECT_TRUE(registry.retain(two));
+    registry.release(two);
+    EXPECT_EQ(two, registry.find("cookie-two"));
+
+    /* The slot is reused but the old handle doesn't find the new state */
+    auto three = registry.intern("cookie-three");
+    EXPECT_EQ(one.index, three.index);
+    EXPECT_NE(one, three);
+    EXPECT_NE(nullptr, table.insert(three));
+    EXPECT_EQ(nullptr, table.find(one));
+    EXPECT_EQ(1u, table.size());
+
+    /* The manager gives its cookies back when they're done */
+    AuthManagerAuthMock authman;
+    authman.createAuthentication("action-id", "message", "icon-name", "cookie-four", {"unix-name:me"},
+                                 [](Authentication::State state) {});
+    EXPECT_TRUE(authman.registry()->find("cookie-four").valid());
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-four"));
+
+    for (int i = 0; i < 100 && authman.registry()->size() != 0; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    EXPECT_EQ(0u, authman.registry()->size());
+}
+
+TEST_F(AuthManagerTest, admission)
+{
+    AuthManagerAuthMock authman;
+    authman.setAdmissionLimits(1, 1);
+    std::vector<std::string> finished;
+    auto done = [&finished](const std::string& cookie) {
+        return [&finished, cookie](Authentication::State state) {
+            if (state == Authentication::State::CANCELLED)
+            {
+                finished.push_back(cookie);
+            }
+        };
+    };
+
+    authman.createAuthentication("action-one", "message", "icon-name", "cookie-one", {"unix-name:me"},
+                                 done("cookie-one"));
+
+    /* Waits for the first one */
+    auto second = authman.createAuthenticationAsync("action-two", "message", "icon-name", "cookie-two",
+                                                    {"unix-name:me"}, done("cookie-two"));
+
+    /* No room left to wait */
+    EXPECT_THROW(authman.createAuthentication("action-three", "message", "icon-name", "cookie-three",
+                                              {"unix-name:me"}, done("cookie-three")),
+                 AuthManager::RejectedError);
+
+    auto stats = authman.admissionStats();
+    EXPECT_EQ(1u, stats.admitted);
+    EXPECT_EQ(1u, stats.queued);
+    EXPECT_EQ(1u, stats.rejected);
+    EXPECT_EQ(1u, stats.running);
+    EXPECT_EQ(1u, stats.waiting);
+    EXPECT_FALSE(second.isReady());
+    EXPECT_EQ("cookie-one", authman.lastMock.lock()->_cookie);
+
+    /* Finishing the first starts the second */
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-one"));
+    EXPECT_EQ("cookie-two", second.get());
+    EXPECT_EQ("cookie-two", authman.lastMock.lock()->_cookie);
+
+    stats = authman.admissionStats();
+    EXPECT_EQ(2u, stats.admitted);
+    EXPECT_EQ(1u, stats.running);
+    EXPECT_EQ(0u, stats.waiting);
+
+    /* Cancelling one that is waiting finishes it without starting it */
+    auto fourth = authman.createAuthenticationAsync("action-four", "message", "icon-name", "cookie-four",
+                                                    {"unix-name:me"}, done("cookie-four"));
+    EXPECT_EQ(1u, authman.admissionStats().waiting);
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-four"));
+    EXPECT_EQ("cookie-four", fourth.get());
+    EXPECT_EQ("cookie-two", authman.lastMock.lock()->_cookie);
+
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-two"));
+    EXPECT_EQ(std::vector<std::string>({"cookie-one", "cookie-four", "cookie-two"}), finished);
+    EXPECT_EQ(2u, authman.admissionStats().admitted);
+}
+
+TEST_F(AuthManagerTest, coalesce)
+{
+    AuthManagerAuthMock authman;
+    std::vector<std::pair<std::string, Authentication::State>> finished;
+    auto done = [&finished](const std::string& cookie) {
+        return [&finished, cookie](Authentication::State state) { finished.emplace_back(cookie, state); };
+    };
+
+    authman.createAuthentication("action-id", "message", "icon-name", "cookie-one", {"unix-name:me", "unix-user:0"},
+                                 done("cookie-one"));
+    EXPECT_EQ(1, authman.built);
+
+    /* Same question, in a different order */
+    EXPECT_EQ("cookie-two", authman.createAuthentication("action-id", "message", "icon-name", "cookie-two",
+                                                         {"unix-user:0", "unix-name:me"}, done("cookie-two")));
+    EXPECT_EQ(1, authman.built);
+    ASSERT_FALSE(authman.lastMock.expired());
+    EXPECT_EQ("cookie-one", authman.lastMock.lock()->_cookie);
+    EXPECT_EQ(1u, authman.lastMock.lock()->_followers.size());
+
+    /* Different question */
+    authman.createAuthentication("action-other", "message", "icon-name", "cookie-three", {"unix-name:me"},
+                                 done("cookie-three"));
+    EXPECT_EQ(2, authman.built);
+
+    auto stats = authman.admissionStats();
+    EXPECT_EQ(2u, stats.admitted);
+    EXPECT_EQ(1u, stats.coalesced);
+    EXPECT_EQ(2u, stats.running);
+
+    /* A follower leaving doesn't bother the leader */
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-two"));
+    ASSERT_EQ(1u, finished.size());
+    EXPECT_EQ("cookie-two", finished[0].first);
+
+    /* The leader finishing takes its followers with it */
+    authman.createAuthentication("action-id", "message", "icon-name", "cookie-four", {"unix-name:me", "unix-user:0"},
+                                 done("cookie-four"));
+    EXPECT_EQ(2, authman.built);
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-one"));
+    ASSERT_EQ(3u, finished.size());
+    EXPECT_EQ("cookie-four", finished[1].first);
+    EXPECT_EQ("cookie-one", finished[2].first);
+
+    /* Once it is done a new request gets its own */
+    for (int i = 0; i < 100 && authman.registry()->find("cookie-one").valid(); i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    authman.createAuthentication("action-id", "message", "icon-name", "cookie-five", {"unix-name:me", "unix-user:0"},
+                                 done("cookie-five"));
+    EXPECT_EQ(3, authman.built);
+    EXPECT_EQ("cookie-five", authman.lastMock.lock()->_cookie);
+
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-three"));
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-five"));
+}
+
+TEST_F(AuthManagerTest, batch)
+{
+    AuthManagerAuthMock authman;
+    authman.setBatchWindow(std::chrono::milliseconds{1000});
+
+    authman.createAuthentication("action-one", "message", "icon-name", "cookie-one", {"unix-name:me"},
+                                 [](Authentication::State state) {});
+
+    /* Another action for the same person joins it */
+    authman.createAuthentication("action-two", "message", "icon-name", "cookie-two", {"unix-name:me"},
+                                 [](Authentication::State state) {});
+    EXPECT_EQ(1, authman.built);
+    ASSERT_FALSE(authman.lastMock.expired());
+    EXPECT_EQ(1u, authman.lastMock.lock()->_followers.size());
+
+    /* Someone else doesn't */
+    authman.createAuthentication("action-two", "message", "icon-name", "cookie-three", {"unix-name:you"},
+                                 [](Authentication::State state) {});
+    EXPECT_EQ(2, authman.built);
+
+    auto stats = authman.admissionStats();
+    EXPECT_EQ(1u, stats.coalesced);
+    EXPECT_EQ(1u, stats.batched);
+
+    /* After the window closes it's on its own again */
+    authman.setBatchWindow(std::chrono::milliseconds{50});
+    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+    authman.createAuthentication("action-four", "message", "icon-name", "cookie-four", {"unix-name:me"},
+                                 [](Authentication::State state) {});
+    EXPECT_EQ(3, authman.built);
+
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-one"));
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-three"));
+    EXPECT_TRUE(authman.cancelAuthentication("cookie-four"));
+}
+
 TEST_F(AuthManagerTest, badServer)
 {
     std::shared_ptr<AuthManager> authman;
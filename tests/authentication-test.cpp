@@ -29,12 +29,16 @@
 
 /* Local Headers */
 #include "authentication.h"
+#include "helper-pool.h"
+#include "session-bus.h"
 #include "session-iface.h"
 
 /* System Libs */
 #include <chrono>
+#include <functional>
 #include <libnotify/notify.h>
 #include <thread>
+#include <unistd.h>
 
 class AuthenticationTest : public ::testing::Test
 {
@@ -43,6 +47,8 @@ protected:
     GDBusConnection* session = NULL;
 
     std::shared_ptr<NotificationsMock> notifications;
+    std::shared_ptr<SessionBus> bus;
+    std::shared_ptr<ExportPool> exports;
 
     virtual void SetUp()
     {
@@ -80,10 +86,21 @@ protected:
 
         /* Normally done by Auth Manager */
         notify_init("authentication-test");
+
+        bus = SessionBus::create();
+        for (unsigned int i = 0; !bus->connection() && i < 100; i++)
+        {
+            loop(10);
+        }
+        ASSERT_NE(nullptr, bus->connection());
+        exports = ExportPool::create(bus);
     }
 
     virtual void TearDown()
     {
+        exports.reset();
+        bus.reset();
+
         /* Normally done by Auth Manager */
         notify_uninit();
 
@@ -117,6 +134,16 @@ protected:
         g_main_loop_run(loop);
         g_main_loop_unref(loop);
     }
+
+    /* Runs the main loop until check() or about five seconds */
+    bool loopUntil(const std::function<bool()>& check)
+    {
+        for (unsigned int i = 0; !check() && i < 500; i++)
+        {
+            loop(10);
+        }
+        return check();
+    }
 };
 
 class SessionMock : public Session
@@ -125,8 +152,8 @@ public:
     std::string _identity;
     bool _initiated;
 
-    SessionMock(const std::string& identity)
-        : _identity(identity)
+    SessionMock(const Identity& identity)
+        : _identity(identity.toString())
         , _initiated(false)
     {
     }
@@ -136,6 +163,12 @@ public:
         _initiated = true;
     }
 
+    void resetSession() override
+    {
+        _resets++;
+    }
+    unsigned int _resets = 0;
+
     core::Signal<const std::string&, bool>& request() override
     {
         return _request;
@@ -170,29 +203,68 @@ public:
                               const std::string& message,
                               const std::string& icon_name,
                               const std::string& cookie,
-                              const std::list<std::string>& identities,
-                              const std::function<void(State)>& finishedCallback)
-        : Authentication(action_id, message, icon_name, cookie, identities, finishedCallback)
+                              const std::list<Identity>& identities,
+                              const std::function<void(State)>& finishedCallback,
+                              const std::shared_ptr<ExportSlot>& exports)
+        : Authentication(action_id, message, icon_name, cookie, identities, finishedCallback, exports)
     {
         g_debug("Building Authentication object with Session Mock");
     }
 
     std::weak_ptr<SessionMock> lastSession;
+    std::vector<std::weak_ptr<SessionMock>> sessions;
+    std::weak_ptr<SessionMock> lastReplay;
+    std::string lastReplayCookie;
+
+    /* Use the real sessions, for the helper pool */
+    bool realSessions = false;
+    std::vector<std::string> builtFor;
 
 protected:
-    std::shared_ptr<Session> buildSession(const std::string& identity) override
+    /* The real one, so the session's signals are connected */
+    std::shared_ptr<Session> buildSession(const Identity& identity) override
+    {
+        building = true;
+        auto session = Authentication::buildSession(identity);
+        building = false;
+        return session;
+    }
+
+    std::shared_ptr<Session> newSession(const Identity& identity, const std::string& cookie) override
     {
-        g_debug("Building a Mock session: %s", identity.c_str());
+        if (building)
+        {
+            builtFor.push_back(identity.toString());
+        }
+        if (realSessions)
+        {
+            return Authentication::newSession(identity, cookie);
+        }
+
         auto session = std::make_shared<SessionMock>(identity);
-        lastSession = session;
+        if (building)
+        {
+            g_debug("Building a Mock session: %s", identity.toString().c_str());
+            lastSession = session;
+            sessions.push_back(session);
+        }
+        else
+        {
+            g_debug("Building a Mock replay session: %s", cookie.c_str());
+            lastReplay = session;
+            lastReplayCookie = cookie;
+        }
         return session;
     }
+
+private:
+    bool building = false;
 };
 
 TEST_F(AuthenticationTest, Init)
 {
     AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
-                                   [](Authentication::State state) { return; });
+                                   [](Authentication::State state) { return; }, exports->lease());
     auth.start();
 
     ASSERT_FALSE(auth.lastSession.expired());
@@ -208,7 +280,8 @@ TEST_F(AuthenticationTest, Cancel)
                                    [&cbState, &cbCalled](Authentication::State state) {
                                        cbState = state;
                                        cbCalled = true;
-                                   });
+                                   },
+                                   exports->lease());
 
     auth.cancel();
     loop(10);
@@ -220,11 +293,12 @@ TEST_F(AuthenticationTest, Cancel)
 TEST_F(AuthenticationTest, BasicRequest)
 {
     AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
-                                   [](Authentication::State state) {});
+                                   [](Authentication::State state) {}, exports->lease());
     auth.start();
 
     auth.setInfo("some info");
     auth.addRequest("password:", true);
+    loop(50);
 
     auto dialogs = notifications->getNotifications();
 
@@ -255,3 +329,725 @@ TEST_F(AuthenticationTest, BasicRequest)
     notifications->emitAction("okay");
     loop(50);
 }
+
+TEST_F(AuthenticationTest, RequestInPlace)
+{
+    bool cbCalled = false;
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
+                                   [&cbCalled](Authentication::State state) { cbCalled = true; }, exports->lease());
+    auth.start();
+
+    auth.addRequest("password:", true);
+    loop(50);
+
+    ASSERT_FALSE(auth.lastSession.expired());
+    EXPECT_CALL(*(auth.lastSession.lock()), requestResponse("")).Times(2).WillRepeatedly(testing::Return());
+    notifications->emitAction("okay");
+    loop(50);
+
+    /* The server taking down the answered decision isn't a cancel */
+    notifications->emitClosed();
+    loop(50);
+    EXPECT_FALSE(cbCalled);
+
+    /* A second step after the first was answered */
+    auth.addRequest("One time code:", false);
+    loop(50);
+    notifications->emitAction("okay");
+    loop(50);
+
+    /* A third while the answered one is still up replaces it */
+    auth.addRequest("Another code:", false);
+    loop(50);
+
+    auto dialogs = notifications->getNotifications();
+    ASSERT_EQ(3, dialogs.size());
+    EXPECT_EQ(0u, dialogs[0].replace_id);
+    EXPECT_EQ(0u, dialogs[1].replace_id);
+    EXPECT_EQ(10u, dialogs[2].replace_id);
+    EXPECT_EQ(dialogs[1].hints.size(), dialogs[2].hints.size());
+    EXPECT_FALSE(cbCalled);
+}
+
+TEST_F(AuthenticationTest, JoinReplay)
+{
+    std::vector<std::pair<std::string, Authentication::State>> finished;
+
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
+                                   [&finished](Authentication::State state) {
+                                       finished.emplace_back("everyone-loves-cookies", state);
+                                   },
+                                   exports->lease());
+    auth.start();
+
+    EXPECT_TRUE(auth.join("cookie-two", "other-action", "other message", [&finished](Authentication::State state) {
+        finished.emplace_back("cookie-two", state);
+    }));
+
+    /* The user answers once, for both actions */
+    auth.addRequest("password:", true);
+    loop(50);
+
+    auto dialogs = notifications->getNotifications();
+    ASSERT_EQ(1, dialogs.size());
+    EXPECT_EQ("message\nother message", dialogs[0].body);
+
+    ASSERT_FALSE(auth.lastSession.expired());
+    EXPECT_CALL(*(auth.lastSession.lock()), requestResponse("")).WillOnce(testing::Return());
+    notifications->emitAction("okay");
+    loop(50);
+
+    /* Too late to join, the user didn't answer for this one */
+    EXPECT_FALSE(auth.join("cookie-late", "action-id", "message", [&finished](Authentication::State state) {
+        finished.emplace_back("cookie-late", state);
+    }));
+    EXPECT_FALSE(auth.join("cookie-other", "third-action", "third message", [&finished](Authentication::State state) {
+        finished.emplace_back("cookie-other", state);
+    }));
+
+    auth.lastSession.lock()->_complete(true);
+
+    /* And their answer goes to the joined cookie's own session */
+    ASSERT_FALSE(auth.lastReplay.expired());
+    EXPECT_EQ("cookie-two", auth.lastReplayCookie);
+    EXPECT_TRUE(auth.lastReplay.lock()->_initiated);
+    EXPECT_TRUE(finished.empty());
+
+    EXPECT_CALL(*(auth.lastReplay.lock()), requestResponse("")).WillOnce(testing::Return());
+    auth.lastReplay.lock()->_request("password:", true);
+    auth.lastReplay.lock()->_complete(true);
+
+    /* Everyone succeeds, the leader last */
+    ASSERT_EQ(2u, finished.size());
+    EXPECT_EQ("cookie-two", finished[0].first);
+    EXPECT_EQ(Authentication::State::SUCCESS, finished[0].second);
+    EXPECT_EQ("everyone-loves-cookies", finished[1].first);
+    EXPECT_EQ(Authentication::State::SUCCESS, finished[1].second);
+
+    /* Done, so nothing else can join */
+    EXPECT_FALSE(auth.join("cookie-three", "action-id", "message", [](Authentication::State state) {}));
+}
+
+TEST_F(AuthenticationTest, RetryLimit)
+{
+    std::vector<Authentication::State> finished;
+
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
+                                   [&finished](Authentication::State state) { finished.push_back(state); },
+                                   exports->lease());
+    Authentication::RetryPolicy policy;
+    policy.maxAttempts = 3;
+    auth.setRetryPolicy(policy);
+    auth.start();
+
+    ASSERT_FALSE(auth.lastSession.expired());
+    auto session = auth.lastSession.lock();
+    auto before = Authentication::retryStats();
+
+    auth.addRequest("password:", true);
+    loop(50);
+
+    /* Wrong twice, tried again right away each time */
+    session->_complete(false);
+    EXPECT_EQ(1u, session->_resets);
+    auth.addRequest("password:", true);
+    loop(50);
+
+    session->_complete(false);
+    EXPECT_EQ(2u, session->_resets);
+    auth.addRequest("password:", true);
+    loop(50);
+    EXPECT_TRUE(finished.empty());
+
+    auto after = Authentication::retryStats();
+    EXPECT_EQ(before.retries + 2, after.retries);
+    EXPECT_EQ(before.retryLatency.count + 2, after.retryLatency.count);
+
+    /* Each retry updated the snap decision that was already up */
+    auto dialogs = notifications->getNotifications();
+    ASSERT_EQ(3, dialogs.size());
+    EXPECT_EQ(0u, dialogs[0].replace_id);
+    EXPECT_EQ(10u, dialogs[1].replace_id);
+    EXPECT_EQ(10u, dialogs[2].replace_id);
+
+    /* The third is the last one, no retry and a clean cancel */
+    session->_complete(false);
+    EXPECT_EQ(2u, session->_resets);
+    ASSERT_EQ(1u, finished.size());
+    EXPECT_EQ(Authentication::State::CANCELLED, finished[0]);
+    EXPECT_EQ(before.exhausted + 1, Authentication::retryStats().exhausted);
+
+    /* Giving up takes it down rather than asking again */
+    loop(50);
+    EXPECT_EQ(3, notifications->getNotifications().size());
+}
+
+TEST_F(AuthenticationTest, RetryBackoff)
+{
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
+                                   [](Authentication::State state) {}, exports->lease());
+    Authentication::RetryPolicy policy;
+    policy.maxAttempts = 0;
+    policy.backoff = std::chrono::milliseconds(100);
+    auth.setRetryPolicy(policy);
+    auth.start();
+
+    ASSERT_FALSE(auth.lastSession.expired());
+    auto session = auth.lastSession.lock();
+
+    /* Waits the backoff before trying again */
+    session->_complete(false);
+    loop(20);
+    EXPECT_EQ(0u, session->_resets);
+    loop(150);
+    EXPECT_EQ(1u, session->_resets);
+
+    /* Cancelling while waiting drops the retry */
+    session->_complete(false);
+    auth.cancel();
+    loop(250);
+    EXPECT_EQ(1u, session->_resets);
+}
+
+TEST_F(AuthenticationTest, IdentitySelector)
+{
+    std::vector<Authentication::State> finished;
+    auto slot = exports->lease();
+
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies",
+                                   {"unix-name:one", "unix-name:two", "unix-name:three", "unix-name:four"},
+                                   [&finished](Authentication::State state) { finished.push_back(state); }, slot);
+    auth.start();
+
+    /* Only the one that is offered is started */
+    ASSERT_EQ(1u, auth.sessions.size());
+    ASSERT_FALSE(auth.sessions[0].expired());
+    EXPECT_TRUE(auth.sessions[0].lock()->_initiated);
+    EXPECT_EQ("unix-name:one", auth.sessions[0].lock()->_identity);
+
+    auto group = G_ACTION_GROUP(slot->actions().get());
+    ASSERT_TRUE(g_action_group_has_action(group, "identity"));
+    auto state = g_action_group_get_action_state(group, "identity");
+    EXPECT_STREQ("unix-name:one", g_variant_get_string(state, nullptr));
+    g_variant_unref(state);
+
+    auth.sessions[0].lock()->_request("Password for one:", true);
+    loop(50);
+    EXPECT_EQ(1, notifications->getNotifications().size());
+
+    auto menu = G_MENU_MODEL(slot->menus().get());
+    ASSERT_EQ(2, g_menu_model_get_n_items(menu));
+    gchar* type = nullptr;
+    ASSERT_TRUE(g_menu_model_get_item_attribute(menu, 0, "x-canonical-unity8-policy-kit-type", "s", &type));
+    EXPECT_STREQ("identity", type);
+    g_free(type);
+    gchar* label = nullptr;
+    ASSERT_TRUE(g_menu_model_get_item_attribute(menu, 1, G_MENU_ATTRIBUTE_LABEL, "s", &label));
+    EXPECT_STREQ("Password for one:", label);
+    g_free(label);
+
+    /* Picking another starts it */
+    g_action_group_change_action_state(group, "identity", g_variant_new_string("unix-name:two"));
+    loop(50);
+    ASSERT_EQ(2u, auth.sessions.size());
+    EXPECT_EQ("unix-name:two", auth.sessions[1].lock()->_identity);
+    auth.sessions[1].lock()->_request("Password for two:", true);
+    loop(50);
+    ASSERT_EQ(2, g_menu_model_get_n_items(menu));
+    ASSERT_TRUE(g_menu_model_get_item_attribute(menu, 1, G_MENU_ATTRIBUTE_LABEL, "s", &label));
+    EXPECT_STREQ("Password for two:", label);
+    g_free(label);
+
+    /* Going back shows what it already asked, without starting anything new */
+    auth.selectIdentity("unix-name:one");
+    loop(50);
+    EXPECT_EQ(2u, auth.sessions.size());
+    ASSERT_TRUE(g_menu_model_get_item_attribute(menu, 1, G_MENU_ATTRIBUTE_LABEL, "s", &label));
+    EXPECT_STREQ("Password for one:", label);
+    g_free(label);
+
+    /* One failing on its own after the user moved on waits to be
+       picked again */
+    auth.sessions[1].lock()->_complete(false);
+    EXPECT_EQ(0u, auth.sessions[1].lock()->_resets);
+    auth.selectIdentity("unix-name:two");
+    EXPECT_EQ(1u, auth.sessions[1].lock()->_resets);
+    loop(50);
+
+    /* Not one of ours, nothing changes */
+    auth.selectIdentity("unix-name:nobody");
+    state = g_action_group_get_action_state(group, "identity");
+    EXPECT_STREQ("unix-name:two", g_variant_get_string(state, nullptr));
+    g_variant_unref(state);
+
+    /* One that isn't picked can't succeed for us */
+    auth.sessions[0].lock()->_complete(true);
+    EXPECT_TRUE(finished.empty());
+
+    /* Answering cancels the others */
+    EXPECT_CALL(*(auth.sessions[1].lock()), requestResponse("")).WillOnce(testing::Return());
+    notifications->emitAction("okay");
+    loop(50);
+    EXPECT_TRUE(auth.sessions[0].expired());
+    EXPECT_FALSE(auth.sessions[1].expired());
+
+    /* One that wasn't started is started when it's picked */
+    auth.selectIdentity("unix-name:four");
+    ASSERT_EQ(3u, auth.sessions.size());
+    EXPECT_EQ("unix-name:four", auth.sessions.back().lock()->_identity);
+
+    auth.sessions.back().lock()->_complete(true);
+    ASSERT_EQ(1u, finished.size());
+    EXPECT_EQ(Authentication::State::SUCCESS, finished[0]);
+}
+
+TEST_F(AuthenticationTest, IdentityOrder)
+{
+    auto helpers = HelperPool::create(HELPER_STANDIN, 4);
+
+    /* An admin is offered ahead of the others */
+    {
+        AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies",
+                                       {"unix-group:wheel", "unix-user:root"}, [](Authentication::State state) {},
+                                       exports->lease());
+        auth.start();
+
+        ASSERT_EQ(1u, auth.builtFor.size());
+        EXPECT_EQ("unix-user:root", auth.builtFor[0]);
+    }
+
+    /* Root would be the current user too */
+    if (getuid() == 0)
+    {
+        return;
+    }
+
+    auto me = std::string("unix-user:") + g_get_user_name();
+
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies",
+                                   {"unix-group:wheel", "unix-user:root", me}, [](Authentication::State state) {},
+                                   exports->lease());
+    auth.realSessions = true;
+    auth.setHelperPool(helpers);
+    auth.start();
+
+    /* The current user is offered first, and is the only one started */
+    ASSERT_EQ(1u, auth.builtFor.size());
+    EXPECT_EQ(me, auth.builtFor[0]);
+
+    /* The admin has a helper waiting, without PAM being started */
+    ASSERT_TRUE(loopUntil([helpers]() { return helpers->stats().idle == 2; }));
+    EXPECT_EQ(0u, helpers->stats().hits);
+
+    /* So switching to them takes it rather than starting one */
+    auth.selectIdentity("unix-user:root");
+    ASSERT_EQ(2u, auth.builtFor.size());
+    EXPECT_EQ("unix-user:root", auth.builtFor[1]);
+    ASSERT_TRUE(loopUntil([helpers]() { return helpers->stats().hits == 1; }));
+
+    auth.cancel();
+}
+
+TEST_F(AuthenticationTest, JoinCancel)
+{
+    std::vector<std::string> cancelled;
+
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
+                                   [&cancelled](Authentication::State state) {
+                                       cancelled.push_back("everyone-loves-cookies");
+                                   },
+                                   exports->lease());
+    auth.start();
+
+    auth.join("cookie-two", "action-id", "message",
+              [&cancelled](Authentication::State state) { cancelled.push_back("cookie-two"); });
+    auth.join("cookie-three", "action-id", "message",
+              [&cancelled](Authentication::State state) { cancelled.push_back("cookie-three"); });
+
+    auth.leave("cookie-two");
+    EXPECT_EQ(std::vector<std::string>({"cookie-two"}), cancelled);
+
+    auth.cancel();
+    EXPECT_EQ(std::vector<std::string>({"cookie-two", "cookie-three", "everyone-loves-cookies"}), cancelled);
+}
+
+TEST_F(AuthenticationTest, ExportPool)
+{
+    auto pool = ExportPool::create(bus, 1);
+
+    auto slot = pool->lease();
+    ASSERT_NE(nullptr, slot);
+    auto path = slot->path();
+    EXPECT_EQ(1u, pool->created());
+
+    /* Dirty it up like an Authentication would */
+    g_menu_append(slot->menus().get(), "label", nullptr);
+    g_action_group_change_action_state(G_ACTION_GROUP(slot->actions().get()), "response",
+                                       g_variant_new_string("password"));
+
+    slot.reset();
+    EXPECT_EQ(1u, pool->idle());
+
+    /* Comes back as the same export, cleaned out */
+    slot = pool->lease();
+    EXPECT_EQ(path, slot->path());
+    EXPECT_EQ(1u, pool->created());
+    EXPECT_EQ(0, g_menu_model_get_n_items(G_MENU_MODEL(slot->menus().get())));
+
+    auto vresponse = g_action_group_get_action_state(G_ACTION_GROUP(slot->actions().get()), "response");
+    EXPECT_STREQ("", g_variant_get_string(vresponse, nullptr));
+    g_variant_unref(vresponse);
+
+    /* Past the idle limit they are destroyed */
+    auto second = pool->lease();
+    EXPECT_NE(path, second->path());
+    EXPECT_EQ(2u, pool->created());
+    slot.reset();
+    second.reset();
+    EXPECT_EQ(1u, pool->idle());
+
+    /* An Authentication uses the slot it was given */
+    slot = pool->lease();
+    {
+        Authentication auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
+                            [](Authentication::State state) {}, slot);
+        slot.reset();
+        EXPECT_EQ(0u, pool->idle());
+    }
+    EXPECT_EQ(1u, pool->idle());
+}
+
+TEST_F(AuthenticationTest, ExportTree)
+{
+    auto pool = ExportPool::create(bus);
+    auto slot = pool->lease();
+    g_menu_append(slot->menus().get(), "label", nullptr);
+
+    /* Calls go out on the bus and come back to be handled on this
+       thread's context, so they have to be async */
+    auto name = std::string(g_dbus_connection_get_unique_name(bus->connection().get()));
+    auto call = [this, &slot, &name](const gchar* interface, const gchar* method, GVariant* params) {
+        GVariant* result = nullptr;
+        g_dbus_connection_call(session, name.c_str(), slot->path().c_str(), interface, method, params, nullptr,
+                               G_DBUS_CALL_FLAGS_NONE, -1, nullptr,
+                               [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                                   auto result = static_cast<GVariant**>(user_data);
+                                   *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(obj), res, nullptr);
+                               },
+                               &result);
+
+        for (unsigned int i = 0; result == nullptr && i < 50; i++)
+        {
+            loop(10);
+        }
+        return result;
+    };
+    auto print = [](GVariant* variant) {
+        auto printed = g_variant_print(variant, FALSE);
+        std::string retval(printed);
+        g_free(printed);
+        return retval;
+    };
+
+    auto list = call("org.gtk.Actions", "List", nullptr);
+    ASSERT_NE(nullptr, list);
+    EXPECT_EQ("(['response'],)", print(list));
+    g_variant_unref(list);
+
+    auto setstate = call("org.gtk.Actions", "SetState",
+                         g_variant_new("(sva{sv})", "response", g_variant_new_string("password"), nullptr));
+    ASSERT_NE(nullptr, setstate);
+    g_variant_unref(setstate);
+
+    auto vresponse = g_action_group_get_action_state(G_ACTION_GROUP(slot->actions().get()), "response");
+    EXPECT_STREQ("password", g_variant_get_string(vresponse, nullptr));
+    g_variant_unref(vresponse);
+
+    auto menu = call("org.gtk.Menus", "Start", g_variant_new_parsed("([@u 0],)"));
+    ASSERT_NE(nullptr, menu);
+    EXPECT_EQ("([(0, 0, [{'label': <'label'>}])],)", print(menu));
+    g_variant_unref(menu);
+
+    /* Gone from the bus once the slot is */
+    auto path = slot->path();
+    slot.reset();
+    pool.reset();
+
+    GError* error = nullptr;
+    g_dbus_connection_call(session, name.c_str(), path.c_str(), "org.gtk.Actions", "List", nullptr, nullptr,
+                           G_DBUS_CALL_FLAGS_NONE, -1, nullptr,
+                           [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                               auto error = static_cast<GError**>(user_data);
+                               auto result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(obj), res, error);
+                               if (result != nullptr)
+                               {
+                                   g_variant_unref(result);
+                               }
+                           },
+                           &error);
+    for (unsigned int i = 0; error == nullptr && i < 50; i++)
+    {
+        loop(10);
+    }
+    EXPECT_NE(nullptr, error);
+    g_clear_error(&error);
+}
+
+TEST_F(AuthenticationTest, Notification)
+{
+    auto before = Notification::stats();
+
+    std::vector<std::string> invoked;
+    unsigned int closed = 0;
+    unsigned int errors = 0;
+    auto notification = std::make_shared<Notification>(
+        bus->connection(), "authentication-test",
+        [&invoked](const std::string& action) { invoked.push_back(action); }, [&closed]() { closed++; },
+        [&errors](const std::string& error) { errors++; });
+    notification->update("summary", "body", "icon");
+    notification->addAction("okay", "Okay");
+
+    /* Doesn't wait on the server */
+    notification->show();
+    EXPECT_TRUE(notifications->getNotifications().empty());
+
+    for (unsigned int i = 0; notifications->getNotifications().empty() && i < 50; i++)
+    {
+        loop(10);
+    }
+    loop(10);
+
+    auto dialogs = notifications->getNotifications();
+    ASSERT_EQ(1, dialogs.size());
+    EXPECT_EQ("summary", dialogs[0].summary);
+    EXPECT_EQ(0u, dialogs[0].replace_id);
+    EXPECT_EQ(before.notifyLatency.count + 1, Notification::stats().notifyLatency.count);
+
+    /* Signals for our ID come back as callbacks */
+    notifications->emitAction("okay");
+    notifications->emitAction("okay", 11);
+    loop(50);
+    ASSERT_EQ(1, invoked.size());
+    EXPECT_EQ("okay", invoked[0]);
+
+    /* Showing again replaces it */
+    notification->update("summary", "other body", "icon");
+    notification->show();
+    loop(50);
+    dialogs = notifications->getNotifications();
+    ASSERT_EQ(2, dialogs.size());
+    EXPECT_EQ("other body", dialogs[1].body);
+    EXPECT_EQ(10u, dialogs[1].replace_id);
+
+    notifications->emitClosed();
+    loop(50);
+    EXPECT_EQ(1u, closed);
+
+    /* Closing before Notify answers closes it once it does, and we
+       don't hear about it */
+    notification->show();
+    notification->close();
+    notification.reset();
+
+    for (unsigned int i = 0; Notification::stats().closeLatency.count == before.closeLatency.count && i < 50; i++)
+    {
+        loop(10);
+    }
+    EXPECT_EQ(before.closeLatency.count + 1, Notification::stats().closeLatency.count);
+    EXPECT_EQ(1u, closed);
+    EXPECT_EQ(0u, errors);
+}
+
+TEST_F(AuthenticationTest, MenuChanges)
+{
+    auto slot = exports->lease();
+    AuthenticationSessionMock auth("action-id", "message", "icon-name", "everyone-loves-cookies", {"unix-name:me"},
+                                   [](Authentication::State state) {}, slot);
+    auth.start();
+
+    /* Watch for the menu changing, once we've said we're interested */
+    std::vector<std::size_t> signals;
+    auto name = std::string(g_dbus_connection_get_unique_name(bus->connection().get()));
+    auto subscription = g_dbus_connection_signal_subscribe(
+        session, name.c_str(), "org.gtk.Menus", "Changed", slot->path().c_str(), nullptr, G_DBUS_SIGNAL_FLAGS_NONE,
+        [](GDBusConnection* connection, const gchar* sender, const gchar* path, const gchar* interface,
+           const gchar* signal, GVariant* params, gpointer user_data) {
+            auto signals = static_cast<std::vector<std::size_t>*>(user_data);
+            auto changes = g_variant_get_child_value(params, 0);
+            signals->push_back(g_variant_n_children(changes));
+            g_variant_unref(changes);
+        },
+        &signals, nullptr);
+
+    GVariant* started = nullptr;
+    g_dbus_connection_call(session, name.c_str(), slot->path().c_str(), "org.gtk.Menus", "Start",
+                           g_variant_new_parsed("([@u 0],)"), nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr,
+                           [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                               auto result = static_cast<GVariant**>(user_data);
+                               *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(obj), res, nullptr);
+                           },
+                           &started);
+    for (unsigned int i = 0; started == nullptr && i < 50; i++)
+    {
+        loop(10);
+    }
+    ASSERT_NE(nullptr, started);
+    g_variant_unref(started);
+
+    /* A burst from PAM is one update to the menu */
+    auth.setError("bad password");
+    auth.setInfo("some info");
+    auth.setInfo("more info");
+    auth.addRequest("password:", true);
+    loop(50);
+
+    ASSERT_EQ(1u, signals.size());
+    EXPECT_EQ(3u, signals[0]);
+
+    /* Always info, error then the request */
+    auto model = G_MENU_MODEL(slot->menus().get());
+    ASSERT_EQ(3, g_menu_model_get_n_items(model));
+    auto type = [model](gint position, const gchar* attribute) {
+        gchar* value = nullptr;
+        std::string retval;
+        if (g_menu_model_get_item_attribute(model, position, attribute, "s", &value))
+        {
+            retval = value;
+            g_free(value);
+        }
+        return retval;
+    };
+    EXPECT_EQ("info", type(0, "x-canonical-unity8-policy-kit-type"));
+    EXPECT_EQ("more info", type(0, "label"));
+    EXPECT_EQ("error", type(1, "x-canonical-unity8-policy-kit-type"));
+    EXPECT_EQ("com.canonical.snapdecision.textfield", type(2, "x-canonical-type"));
+
+    g_dbus_connection_signal_unsubscribe(session, subscription);
+}
+
+TEST_F(AuthenticationTest, MenuSubscribers)
+{
+    auto slot = exports->lease();
+    auto path = slot->path();
+    auto name = std::string(g_dbus_connection_get_unique_name(bus->connection().get()));
+
+    std::size_t signals = 0;
+    auto subscription = g_dbus_connection_signal_subscribe(
+        session, name.c_str(), "org.gtk.Menus", "Changed", path.c_str(), nullptr, G_DBUS_SIGNAL_FLAGS_NONE,
+        [](GDBusConnection* connection, const gchar* sender, const gchar* path, const gchar* interface,
+           const gchar* signal, GVariant* params, gpointer user_data) { (*static_cast<std::size_t*>(user_data))++; },
+        &signals, nullptr);
+
+    auto start = [this, &name, &path](GDBusConnection* connection) {
+        GVariant* started = nullptr;
+        g_dbus_connection_call(connection, name.c_str(), path.c_str(), "org.gtk.Menus", "Start",
+                               g_variant_new_parsed("([@u 0],)"), nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr,
+                               [](GObject* obj, GAsyncResult* res, gpointer user_data) {
+                                   auto result = static_cast<GVariant**>(user_data);
+                                   *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(obj), res, nullptr);
+                               },
+                               &started);
+        for (unsigned int i = 0; started == nullptr && i < 50; i++)
+        {
+            loop(10);
+        }
+        ASSERT_NE(nullptr, started);
+        g_variant_unref(started);
+    };
+
+    /* A client that goes away without calling End stops being sent changes */
+    auto address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, nullptr, nullptr);
+    auto client = g_dbus_connection_new_for_address_sync(
+        address, GDBusConnectionFlags(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                      G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+        nullptr, nullptr, nullptr);
+    g_free(address);
+    ASSERT_NE(nullptr, client);
+    start(client);
+    g_dbus_connection_close_sync(client, nullptr, nullptr);
+    g_object_unref(client);
+    loop(100);
+
+    g_menu_append(slot->menus().get(), "gone", nullptr);
+    loop(50);
+    EXPECT_EQ(0u, signals);
+
+    /* One that is still there is */
+    start(session);
+    g_menu_append(slot->menus().get(), "here", nullptr);
+    loop(50);
+    EXPECT_EQ(1u, signals);
+
+    /* Giving the slot back empties the menu, and the client hears it */
+    slot.reset();
+    loop(50);
+    EXPECT_EQ(2u, signals);
+
+    /* It doesn't call Start again for the next lease at the same
+       path, and still hears about the new menu */
+    slot = exports->lease();
+    ASSERT_EQ(path, slot->path());
+    g_menu_append(slot->menus().get(), "next", nullptr);
+    loop(50);
+    EXPECT_EQ(3u, signals);
+
+    g_dbus_connection_signal_unsubscribe(session, subscription);
+}
+
+TEST_F(AuthenticationTest, Identity)
+{
+    auto user = polkit_unix_user_new(0);
+    g_object_add_weak_pointer(G_OBJECT(user), (gpointer*)&user);
+
+    {
+        Identity identity(user);
+        g_object_unref(user); /* Ours, the identity has its own */
+        ASSERT_NE(nullptr, user);
+        EXPECT_EQ(user, identity.get());
+        EXPECT_FALSE(identity.toString().empty());
+
+        /* Copies share the one object */
+        std::list<Identity> copies(10, identity);
+        EXPECT_EQ(identity, copies.front());
+        EXPECT_EQ(user, copies.back().get());
+    }
+
+    /* And nothing is left holding it */
+    EXPECT_EQ(nullptr, user);
+
+    /* Strings are parsed once, ones that don't parse are kept */
+    Identity parsed("unix-user:0");
+    EXPECT_NE(nullptr, parsed.get());
+
+    Identity unparsed("unix-name:me");
+    EXPECT_EQ(nullptr, unparsed.get());
+    EXPECT_EQ("unix-name:me", unparsed.toString());
+}
+
+TEST_F(AuthenticationTest, SessionBus)
+{
+    /* Connected in the background, it doesn't block */
+    unsigned int connected = 0;
+    auto other = SessionBus::create([&connected]() { connected++; });
+    EXPECT_EQ(nullptr, other->connection());
+    EXPECT_EQ(0u, other->connects());
+
+    for (unsigned int i = 0; !other->connection() && i < 100; i++)
+    {
+        loop(10);
+    }
+    ASSERT_NE(nullptr, other->connection());
+    EXPECT_EQ(1u, connected);
+    EXPECT_EQ(1u, other->connects());
+
+    /* Comes back when the connection closes */
+    g_dbus_connection_close_sync(other->connection().get(), nullptr, nullptr);
+    for (unsigned int i = 0; other->connects() < 2 && i < 100; i++)
+    {
+        loop(10);
+    }
+    EXPECT_EQ(2u, connected);
+    EXPECT_EQ(2u, other->connects());
+    ASSERT_NE(nullptr, other->connection());
+    EXPECT_FALSE(g_dbus_connection_is_closed(other->connection().get()));
+}
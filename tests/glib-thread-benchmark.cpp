@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+/* Micro benchmark for posting jobs to a GLib thread. It isn't run as
+   part of the test suite, run it by hand and compare the numbers:
+
+       ./tests/glib-thread-benchmark [jobs] [producers]
+
+   The "source per job" numbers are the way ContextThread used to
+   post work, an idle GSource per job. The "job queue" numbers are
+   the current ContextThread implementation. */
+
+/* Local Headers */
+#include "glib-thread.h"
+
+/* System Libs */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <gio/gio.h>
+
+/** The old way of doing things, kept here so that we can compare
+    against it. One GSource allocated and attached per job. */
+class SourcePerJobThread
+{
+    GMainContext* context;
+    GMainLoop* loop;
+    std::thread thread;
+
+public:
+    SourcePerJobThread()
+        : context(g_main_context_new())
+        , loop(g_main_loop_new(context, FALSE))
+        , thread([this]() {
+            g_main_context_push_thread_default(context);
+            g_main_loop_run(loop);
+            g_main_context_pop_thread_default(context);
+        })
+    {
+    }
+
+    ~SourcePerJobThread()
+    {
+        executeOnThread([this]() { g_main_loop_quit(loop); });
+        thread.join();
+        g_main_loop_unref(loop);
+        g_main_context_unref(context);
+    }
+
+    void executeOnThread(std::function<void()> work)
+    {
+        auto heapWork = new std::function<void()>(work);
+        auto source = g_idle_source_new();
+        g_source_set_callback(source,
+                              [](gpointer data) {
+                                  auto heapWork = static_cast<std::function<void()>*>(data);
+                                  (*heapWork)();
+                                  return G_SOURCE_REMOVE;
+                              },
+                              heapWork,
+                              [](gpointer data) {
+                                  auto heapWork = static_cast<std::function<void()>*>(data);
+                                  delete heapWork;
+                              });
+        g_source_attach(source, context);
+        g_source_unref(source);
+    }
+};
+
+/** Posts \p jobs jobs from \p producers threads and waits for all of
+    them to have been run. Returns the number of jobs per second. */
+template <typename Thread>
+double measure(Thread& target, unsigned int jobs, unsigned int producers)
+{
+    std::atomic<unsigned int> completed{0};
+    std::promise<void> done;
+    auto total = jobs * producers;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < producers; i++)
+    {
+        threads.emplace_back([&target, &completed, &done, jobs, total]() {
+            for (unsigned int j = 0; j < jobs; j++)
+            {
+                target.executeOnThread([&completed, &done, total]() {
+                    if (++completed == total)
+                    {
+                        done.set_value();
+                    }
+                });
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    done.get_future().wait();
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    return total / elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int jobs = argc > 1 ? std::atoi(argv[1]) : 100000;
+    unsigned int producers = argc > 2 ? std::atoi(argv[2]) : 4;
+
+    std::printf("Posting %u jobs from each of %u threads\n", jobs, producers);
+
+    {
+        SourcePerJobThread thread;
+        std::printf("  source per job: %12.0f jobs/sec\n", measure(thread, jobs, producers));
+    }
+
+    {
+        GLib::ContextThread thread;
+        std::printf("  job queue:      %12.0f jobs/sec\n", measure(thread, jobs, producers));
+    }
+
+    return 0;
+}
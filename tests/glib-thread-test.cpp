@@ -0,0 +1,507 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+/* Test Libraries */
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#pragma GCC diagnostic pop
+
+/* Local Headers */
+#include "glib-thread-pool.h"
+#include "glib-thread.h"
+#include "glib-watchdog.h"
+#include "histogram.h"
+#include "job.h"
+#include "timer-wheel.h"
+
+/* System Libs */
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+/* Count every allocation in the process so that we can check
+   that the hot paths don't make any. */
+static std::atomic<unsigned long> allocations{0};
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    auto ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+    std::free(ptr);
+}
+
+TEST(GLibThreadTest, Init)
+{
+    GLib::ContextThread thread;
+}
+
+TEST(GLibThreadTest, ExecuteOnThread)
+{
+    GLib::ContextThread thread;
+
+    auto id = thread.executeOnThread<std::thread::id>([]() { return std::this_thread::get_id(); });
+    EXPECT_NE(std::this_thread::get_id(), id);
+
+    EXPECT_THROW(thread.executeOnThread<bool>([]() -> bool { throw std::runtime_error("on thread"); }),
+                 std::runtime_error);
+}
+
+TEST(GLibThreadTest, JobInline)
+{
+    /* Short enough to not allocate itself */
+    std::string cookie("cookie-monster");
+    std::function<void(bool)> callback = [](bool) {};
+    bool called = false;
+
+    auto before = allocations.load();
+    GLib::Job job([cookie, callback, &called]() { called = true; });
+    GLib::Job moved(std::move(job));
+    moved();
+    auto after = allocations.load();
+
+    EXPECT_EQ(before, after);
+    EXPECT_TRUE(called);
+    EXPECT_FALSE((bool)job);
+}
+
+TEST(GLibThreadTest, JobMoveOnly)
+{
+    auto value = std::unique_ptr<int>(new int(5));
+    int result = 0;
+
+    GLib::Job job([value = std::move(value), &result]() { result = *value; });
+    job();
+
+    EXPECT_EQ(5, result);
+}
+
+TEST(GLibThreadTest, JobLarge)
+{
+    struct
+    {
+        char data[GLib::Job::INLINE_SIZE * 2];
+    } big = {{0}};
+    big.data[0] = 'x';
+    char result = '\0';
+
+    EXPECT_FALSE(GLib::Job::fitsInline<decltype(big)>());
+
+    GLib::Job job([big, &result]() { result = big.data[0]; });
+    GLib::Job moved(std::move(job));
+    moved();
+
+    EXPECT_EQ('x', result);
+}
+
+/* Once the queue has warmed up, a round trip to the thread and back
+   should not touch the heap */
+TEST(GLibThreadTest, HopNoAllocations)
+{
+    GLib::ContextThread thread;
+    std::string cookie("everyone-loves-cookies");
+
+    auto hop = [&thread, &cookie]() {
+        return thread.executeOnThread<bool>([&cookie]() { return !cookie.empty(); });
+    };
+
+    /* Warm up */
+    for (int i = 0; i < 10; i++)
+    {
+        hop();
+    }
+
+    auto before = allocations.load();
+    bool result = true;
+    for (int i = 0; i < 100; i++)
+    {
+        result = hop() && result;
+    }
+    auto after = allocations.load();
+
+    EXPECT_TRUE(result);
+    EXPECT_EQ(before, after);
+}
+
+TEST(GLibThreadTest, TimerWheelOrder)
+{
+    GLib::TimerWheel wheel(0);
+    std::vector<int> fired;
+
+    /* Spread across all the levels of the wheel */
+    wheel.add(0, 300000, [&fired]() { fired.push_back(4); });
+    wheel.add(0, 5000, [&fired]() { fired.push_back(3); });
+    wheel.add(0, 70, [&fired]() { fired.push_back(2); });
+    wheel.add(0, 3, [&fired]() { fired.push_back(1); });
+    EXPECT_EQ(4u, wheel.size());
+
+    std::uint64_t now = 0;
+    while (wheel.size() > 0)
+    {
+        auto next = wheel.nextExpiry();
+        ASSERT_NE(GLib::TimerWheel::NEVER, next);
+        ASSERT_GE(next, now);
+
+        now = next;
+        wheel.advance(now);
+
+        GLib::Job work;
+        while (wheel.popExpired(work))
+        {
+            work();
+        }
+    }
+
+    EXPECT_EQ(std::vector<int>({1, 2, 3, 4}), fired);
+    EXPECT_EQ(300000u, now);
+    EXPECT_EQ(GLib::TimerWheel::NEVER, wheel.nextExpiry());
+}
+
+TEST(GLibThreadTest, TimerWheelSameTick)
+{
+    GLib::TimerWheel wheel(0);
+    int fired = 0;
+
+    for (int i = 0; i < 10; i++)
+    {
+        wheel.add(0, 1000, [&fired]() { fired++; });
+    }
+
+    EXPECT_EQ(1000u, wheel.nextExpiry());
+    wheel.advance(999);
+    GLib::Job work;
+    EXPECT_FALSE(wheel.popExpired(work));
+
+    /* One advance gets them all */
+    wheel.advance(1000);
+    while (wheel.popExpired(work))
+    {
+        work();
+    }
+    EXPECT_EQ(10, fired);
+}
+
+TEST(GLibThreadTest, TimerWheelCancel)
+{
+    GLib::TimerWheel wheel(0);
+    bool fired = false;
+
+    auto handle = wheel.add(0, 10, [&fired]() { fired = true; });
+    EXPECT_TRUE(wheel.cancel(handle));
+    EXPECT_FALSE(wheel.cancel(handle));
+    EXPECT_EQ(0u, wheel.size());
+
+    /* The slot gets reused, the old handle mustn't cancel the new timer */
+    auto second = wheel.add(0, 10, []() {});
+    EXPECT_EQ(handle.index, second.index);
+    EXPECT_FALSE(wheel.cancel(handle));
+
+    wheel.advance(100);
+    GLib::Job work;
+    while (wheel.popExpired(work))
+    {
+        work();
+    }
+    EXPECT_FALSE(fired);
+    EXPECT_FALSE(wheel.cancel(second));
+}
+
+TEST(GLibThreadTest, Timeout)
+{
+    GLib::ContextThread thread;
+    std::promise<std::chrono::steady_clock::time_point> firedPromise;
+    std::promise<void> zeroPromise;
+    bool cancelledFired = false;
+
+    auto start = std::chrono::steady_clock::now();
+    thread.timeout(std::chrono::milliseconds{50}, [&firedPromise]() {
+        firedPromise.set_value(std::chrono::steady_clock::now());
+    });
+    thread.timeout(std::chrono::milliseconds{0}, [&zeroPromise]() { zeroPromise.set_value(); });
+    auto handle = thread.timeout(std::chrono::milliseconds{10}, [&cancelledFired]() { cancelledFired = true; });
+
+    EXPECT_TRUE(thread.cancelTimeout(handle));
+
+    EXPECT_EQ(std::future_status::ready, zeroPromise.get_future().wait_for(std::chrono::seconds{1}));
+
+    auto fired = firedPromise.get_future();
+    ASSERT_EQ(std::future_status::ready, fired.wait_for(std::chrono::seconds{1}));
+    EXPECT_LE(std::chrono::milliseconds{50}, fired.get() - start);
+
+    EXPECT_FALSE(cancelledFired);
+    EXPECT_FALSE(thread.cancelTimeout(handle));
+}
+
+TEST(GLibThreadTest, HistogramBuckets)
+{
+    /* Every value lands in a bucket that covers it, and the buckets
+       are in order */
+    std::size_t last = 0;
+    for (std::uint64_t value : {0ull, 1ull, 15ull, 16ull, 17ull, 31ull, 32ull, 33ull, 1000ull, 123456789ull,
+                                0xffffffffffffffffull})
+    {
+        auto bucket = GLib::Histogram::bucketFor(value);
+        EXPECT_LT(bucket, GLib::Histogram::BUCKETS);
+        EXPECT_GE(GLib::Histogram::bucketHighest(bucket), value);
+        if (bucket > 0)
+        {
+            EXPECT_LT(GLib::Histogram::bucketHighest(bucket - 1), value);
+        }
+        EXPECT_LE(last, bucket);
+        last = bucket;
+    }
+}
+
+TEST(GLibThreadTest, HistogramPercentiles)
+{
+    GLib::Histogram histogram;
+
+    auto empty = histogram.snapshot();
+    EXPECT_EQ(0u, empty.count);
+    EXPECT_EQ(0u, empty.percentile(50.0));
+
+    for (std::uint64_t i = 1; i <= 1000; i++)
+    {
+        histogram.record(i);
+    }
+
+    auto snap = histogram.snapshot();
+    EXPECT_EQ(1000u, snap.count);
+    EXPECT_EQ(1000u, snap.max);
+    EXPECT_DOUBLE_EQ(500.5, snap.mean());
+
+    /* Within the bucket precision */
+    EXPECT_NEAR(500.0, double(snap.percentile(50.0)), 500.0 / GLib::Histogram::SUB_BUCKETS);
+    EXPECT_NEAR(990.0, double(snap.percentile(99.0)), 990.0 / GLib::Histogram::SUB_BUCKETS);
+    EXPECT_EQ(1000u, snap.percentile(100.0));
+}
+
+TEST(GLibThreadTest, Stats)
+{
+    GLib::ContextThread thread;
+    std::mutex block;
+
+    /* Hold the thread up so that the queue backs up behind it */
+    block.lock();
+    thread.executeOnThread([&block]() {
+        std::lock_guard<std::mutex> guard(block);
+    });
+    for (int i = 0; i < 9; i++)
+    {
+        thread.executeOnThread([]() {});
+    }
+
+    /* The first job may already have been taken off the queue */
+    auto backedUp = thread.stats();
+    EXPECT_LE(9u, backedUp.currentDepth);
+    EXPECT_LE(9u, backedUp.maxDepth);
+    EXPECT_EQ(10u, backedUp.queueDepth.count);
+
+    block.unlock();
+    thread.executeOnThread<bool>([]() { return true; });
+
+    auto stats = thread.stats();
+    EXPECT_EQ(0u, stats.currentDepth);
+    EXPECT_EQ(backedUp.maxDepth + 1, stats.maxDepth);
+    EXPECT_EQ(11u, stats.dispatchLatency.count);
+    /* The blocking hop is counted as it finishes, after we've woken */
+    EXPECT_LE(10u, stats.runTime.count);
+}
+
+TEST(GLibThreadTest, Priorities)
+{
+    GLib::ContextThread thread;
+    std::mutex block;
+    std::vector<std::string> order;
+
+    /* Hold the thread up so that all the lanes fill up */
+    block.lock();
+    thread.executeOnThread([&block]() {
+        std::lock_guard<std::mutex> guard(block);
+    });
+
+    thread.executeOnThread([&order]() { order.push_back("background"); }, GLib::Priority::BACKGROUND);
+    thread.executeOnThread([&order]() { order.push_back("normal"); });
+    thread.executeOnThread([&order]() { order.push_back("urgent"); }, GLib::Priority::URGENT);
+
+    block.unlock();
+    thread.executeOnThread<bool>([]() { return true; }, GLib::Priority::BACKGROUND);
+
+    EXPECT_EQ(std::vector<std::string>({"urgent", "normal", "background"}), order);
+}
+
+TEST(GLibThreadTest, TimeoutPriority)
+{
+    GLib::ContextThread thread;
+    std::mutex block;
+    std::vector<std::string> order;
+
+    /* Both timers expire while the thread is busy */
+    block.lock();
+    thread.executeOnThread([&block]() {
+        std::lock_guard<std::mutex> guard(block);
+    });
+
+    thread.timeout(std::chrono::milliseconds{0}, [&order]() { order.push_back("normal"); });
+    thread.timeout(std::chrono::milliseconds{0}, [&order]() { order.push_back("urgent"); }, GLib::Priority::URGENT);
+    thread.executeOnThread([&order]() { order.push_back("queued"); });
+
+    block.unlock();
+
+    /* Timers get to the queues a dispatch after the blocking job */
+    std::promise<void> done;
+    thread.timeout(std::chrono::milliseconds{20}, [&done]() { done.set_value(); }, GLib::Priority::BACKGROUND);
+    ASSERT_EQ(std::future_status::ready, done.get_future().wait_for(std::chrono::seconds{1}));
+
+    EXPECT_EQ(std::vector<std::string>({"queued", "urgent", "normal"}), order);
+}
+
+TEST(GLibThreadTest, DrainFromJob)
+{
+    GLib::ContextThread thread;
+    int ran = 0;
+
+    auto result = thread.executeOnThread<GLib::ContextThread::DrainResult>([&thread, &ran]() {
+        /* Both need the thread, which is busy running us */
+        thread.executeOnThread([&ran]() { ran++; });
+        thread.timeout(std::chrono::milliseconds{0}, [&ran]() { ran++; }, GLib::Priority::URGENT);
+
+        return thread.runQueuedJobs(std::chrono::steady_clock::now() + std::chrono::seconds{1}, 100);
+    });
+
+    EXPECT_EQ(2, ran);
+    EXPECT_TRUE(result.drained());
+    EXPECT_FALSE(result.starved());
+    EXPECT_EQ(0u, result.totalJobsLeft());
+}
+
+TEST(GLibThreadTest, DrainBudget)
+{
+    GLib::ContextThread thread;
+    int ran = 0;
+
+    auto result = thread.executeOnThread<GLib::ContextThread::DrainResult>([&thread, &ran]() {
+        for (int i = 0; i < 10; i++)
+        {
+            thread.executeOnThread([&ran]() { ran++; });
+        }
+        thread.executeOnThread([&ran]() { ran++; }, GLib::Priority::BACKGROUND);
+
+        return thread.runQueuedJobs(std::chrono::steady_clock::now() + std::chrono::seconds{1}, 3);
+    });
+
+    EXPECT_EQ(3u, result.dispatched);
+    EXPECT_TRUE(result.starved());
+    EXPECT_EQ(0u, result.jobsLeft[static_cast<int>(GLib::Priority::URGENT)]);
+    EXPECT_EQ(7u, result.jobsLeft[static_cast<int>(GLib::Priority::NORMAL)]);
+    EXPECT_EQ(1u, result.jobsLeft[static_cast<int>(GLib::Priority::BACKGROUND)]);
+
+    /* The rest still get run normally */
+    thread.executeOnThread<bool>([]() { return true; }, GLib::Priority::BACKGROUND);
+    EXPECT_EQ(11, ran);
+}
+
+TEST(GLibThreadTest, Pool)
+{
+    GLib::ContextThreadPool pool(3);
+    ASSERT_EQ(3u, pool.size());
+
+    /* Fills up evenly */
+    std::vector<GLib::ContextThread*> acquired;
+    for (int i = 0; i < 6; i++)
+    {
+        acquired.push_back(&pool.acquire());
+    }
+    for (unsigned int i = 0; i < pool.size(); i++)
+    {
+        EXPECT_EQ(2u, pool.pinned(i));
+    }
+
+    /* A thread with room gets the next one */
+    pool.release(*acquired[0]);
+    EXPECT_EQ(acquired[0], &pool.acquire());
+
+    for (auto thread : acquired)
+    {
+        pool.release(*thread);
+    }
+
+    GLib::ContextThread other;
+    EXPECT_THROW(pool.release(other), std::logic_error);
+    EXPECT_LE(1u, GLib::ContextThreadPool::defaultSize());
+}
+
+TEST(GLibThreadTest, Watchdog)
+{
+    auto& watchdog = GLib::Watchdog::instance();
+    auto threshold = watchdog.threshold();
+    watchdog.setThreshold(std::chrono::milliseconds{50});
+
+    GLib::ContextThread thread;
+    thread.setName("sleepy");
+    EXPECT_EQ("sleepy", thread.name());
+
+    /* Quick jobs and an idle loop aren't stalls */
+    for (int i = 0; i < 10; i++)
+    {
+        thread.executeOnThread<bool>([]() { return true; });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{200});
+    EXPECT_EQ(0u, thread.stalls());
+
+    auto before = watchdog.stalls();
+    thread.executeOnThread<bool>([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds{300});
+        return true;
+    });
+
+    /* Reported once, however long it went on */
+    EXPECT_EQ(1u, thread.stalls());
+    EXPECT_EQ(1u, thread.stats().stalls);
+    EXPECT_LE(before + 1, watchdog.stalls());
+
+    watchdog.setThreshold(threshold);
+}
+
+TEST(GLibThreadTest, WatchdogDescribe)
+{
+    EXPECT_EQ("a GLib source", GLib::Watchdog::describe(nullptr));
+
+    GLib::Job job([]() {});
+    auto name = GLib::Watchdog::describe(job.type());
+    EXPECT_NE(std::string::npos, name.find("WatchdogDescribe")) << name;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+/* Test Libraries */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#pragma GCC diagnostic pop
+
+/* Local Headers */
+#include "helper-pool.h"
+#include "helper-session.h"
+
+/* System Libs */
+#include <functional>
+#include <string>
+#include <vector>
+
+class HelperSessionTest : public ::testing::Test
+{
+protected:
+    std::shared_ptr<HelperPool> pool;
+    std::string user;
+
+    /* What the session told us */
+    std::vector<std::pair<std::string, bool>> requests;
+    std::vector<std::string> infos;
+    std::vector<std::string> errors;
+    std::vector<bool> completes;
+
+    virtual void SetUp()
+    {
+        user = g_get_user_name();
+        pool = HelperPool::create(HELPER_STANDIN, 2);
+    }
+
+    virtual void TearDown()
+    {
+        pool.reset();
+    }
+
+    static gboolean timeout_cb(gpointer user_data)
+    {
+        GMainLoop* loop = static_cast<GMainLoop*>(user_data);
+        g_main_loop_quit(loop);
+        return G_SOURCE_REMOVE;
+    }
+
+    void loop(unsigned int ms)
+    {
+        GMainLoop* loop = g_main_loop_new(NULL, FALSE);
+        g_timeout_add(ms, timeout_cb, loop);
+        g_main_loop_run(loop);
+        g_main_loop_unref(loop);
+    }
+
+    /* Runs the main loop until check() or about five seconds */
+    bool loopUntil(const std::function<bool()>& check)
+    {
+        for (unsigned int i = 0; !check() && i < 500; i++)
+        {
+            loop(10);
+        }
+        return check();
+    }
+
+    std::shared_ptr<HelperSession> buildSession(const std::string& cookie)
+    {
+        auto session = std::make_shared<HelperSession>(pool, Identity("unix-user:" + user), cookie);
+
+        session->request().connect(
+            [this](const std::string& prompt, bool password) { requests.emplace_back(prompt, password); });
+        session->info().connect([this](const std::string& info) { infos.push_back(info); });
+        session->error().connect([this](const std::string& error) { errors.push_back(error); });
+        session->complete().connect([this](bool success) { completes.push_back(success); });
+
+        return session;
+    }
+};
+
+TEST_F(HelperSessionTest, Prewarm)
+{
+    pool->prewarm(user);
+    ASSERT_TRUE(loopUntil([this]() { return pool->stats().idle == 1; }));
+
+    /* Only one waits for each user */
+    pool->prewarm(user);
+    loop(100);
+    EXPECT_EQ(1u, pool->stats().idle);
+    EXPECT_EQ(1u, pool->stats().spawned);
+
+    /* Taking it has another started to replace it */
+    auto process = pool->acquire(user);
+    EXPECT_NE(nullptr, process);
+    EXPECT_EQ(1u, pool->stats().hits);
+    EXPECT_EQ(0u, pool->stats().misses);
+
+    ASSERT_TRUE(loopUntil([this]() { return pool->stats().idle == 1; }));
+    EXPECT_EQ(2u, pool->stats().spawned);
+
+    g_subprocess_force_exit(process.get());
+}
+
+TEST_F(HelperSessionTest, IdleCap)
+{
+    pool->prewarm("first");
+    ASSERT_TRUE(loopUntil([this]() { return pool->stats().idle == 1; }));
+    pool->prewarm("second");
+    ASSERT_TRUE(loopUntil([this]() { return pool->stats().idle == 2; }));
+
+    /* No room for a third, the one that waited longest goes */
+    pool->prewarm("third");
+    ASSERT_TRUE(loopUntil([this]() { return pool->stats().spawned == 3; }));
+    loop(50);
+    EXPECT_EQ(2u, pool->stats().idle);
+    EXPECT_EQ(1u, pool->stats().evicted);
+
+    /* So "first" has to start one */
+    auto process = pool->acquire("first");
+    EXPECT_NE(nullptr, process);
+    EXPECT_EQ(1u, pool->stats().misses);
+
+    g_subprocess_force_exit(process.get());
+}
+
+TEST_F(HelperSessionTest, Conversation)
+{
+    pool->prewarm(user);
+    ASSERT_TRUE(loopUntil([this]() { return pool->stats().idle == 1; }));
+
+    auto session = buildSession("everyone-loves-cookies");
+    session->initiate();
+    EXPECT_EQ(1u, pool->stats().hits);
+
+    ASSERT_TRUE(loopUntil([this]() { return requests.size() == 1; }));
+    ASSERT_EQ(1u, infos.size());
+    EXPECT_EQ("Stand-in helper for " + user, infos[0]);
+    EXPECT_EQ("Password: ", requests[0].first);
+    EXPECT_TRUE(requests[0].second);
+
+    session->requestResponse("password");
+    ASSERT_TRUE(loopUntil([this]() { return completes.size() == 1; }));
+    EXPECT_TRUE(completes[0]);
+    EXPECT_TRUE(errors.empty());
+}
+
+TEST_F(HelperSessionTest, TwoSteps)
+{
+    auto session = buildSession("two-step-cookie");
+    session->initiate();
+
+    ASSERT_TRUE(loopUntil([this]() { return requests.size() == 1; }));
+    session->requestResponse("password");
+
+    ASSERT_TRUE(loopUntil([this]() { return requests.size() == 2; }));
+    EXPECT_EQ("Verification code: ", requests[1].first);
+    EXPECT_FALSE(requests[1].second);
+
+    session->requestResponse("123456");
+    ASSERT_TRUE(loopUntil([this]() { return completes.size() == 1; }));
+    EXPECT_TRUE(completes[0]);
+}
+
+TEST_F(HelperSessionTest, FailureAndReset)
+{
+    auto session = buildSession("everyone-loves-cookies");
+    session->initiate();
+
+    ASSERT_TRUE(loopUntil([this]() { return requests.size() == 1; }));
+    session->requestResponse("not-the-password");
+
+    ASSERT_TRUE(loopUntil([this]() { return completes.size() == 1; }));
+    EXPECT_FALSE(completes[0]);
+    ASSERT_EQ(1u, errors.size());
+    EXPECT_EQ("Sorry, that didn't work", errors[0]);
+
+    /* Tries again with another helper */
+    session->resetSession();
+    ASSERT_TRUE(loopUntil([this]() { return requests.size() == 2; }));
+    session->requestResponse("password");
+
+    ASSERT_TRUE(loopUntil([this]() { return completes.size() == 2; }));
+    EXPECT_TRUE(completes[1]);
+}
+
+TEST_F(HelperSessionTest, DestroyWaiting)
+{
+    auto session = buildSession("everyone-loves-cookies");
+    session->initiate();
+    ASSERT_TRUE(loopUntil([this]() { return requests.size() == 1; }));
+
+    /* Stops the helper, nothing comes in after */
+    session.reset();
+    loop(100);
+    EXPECT_TRUE(completes.empty());
+}
+
+TEST_F(HelperSessionTest, NoHelper)
+{
+    pool = HelperPool::create("/this/helper/does/not/exist", 2);
+
+    auto session = buildSession("everyone-loves-cookies");
+    session->initiate();
+
+    /* Not from inside initiate() */
+    EXPECT_TRUE(completes.empty());
+    ASSERT_TRUE(loopUntil([this]() { return completes.size() == 1; }));
+    EXPECT_FALSE(completes[0]);
+    EXPECT_LE(1u, pool->stats().failures);
+}
+
+TEST_F(HelperSessionTest, NotAUser)
+{
+    EXPECT_EQ("", HelperSession::userName(Identity("unix-group:nobody")));
+    EXPECT_EQ(user, HelperSession::userName(Identity("unix-user:" + user)));
+
+    auto session = std::make_shared<HelperSession>(pool, Identity("unix-group:nobody"), "everyone-loves-cookies");
+    bool complete = false;
+    bool success = true;
+    session->complete().connect([&complete, &success](bool result) {
+        complete = true;
+        success = result;
+    });
+    session->initiate();
+
+    ASSERT_TRUE(loopUntil([&complete]() { return complete; }));
+    EXPECT_FALSE(success);
+    EXPECT_EQ(0u, pool->stats().spawned);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+/* Speaks like polkit-agent-helper-1 without PAM or PolicyKit, so the
+   helper pool can be tested. Takes the user on the command line and
+   the cookie on stdin, says who it is, asks for a password and
+   succeeds if it is "password". A cookie starting with "two-step"
+   asks for a verification code after the password, "123456". */
+
+#include <iostream>
+#include <string>
+
+/* The helper escapes what it says so it is always one line */
+static std::string escape(const std::string& text)
+{
+    std::string escaped;
+    for (auto c : text)
+    {
+        switch (c)
+        {
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            default:
+                escaped += c;
+                break;
+        }
+    }
+    return escaped;
+}
+
+static bool ask(const std::string& prompt, bool hidden, const std::string& expected)
+{
+    std::cout << (hidden ? "PAM_PROMPT_ECHO_OFF " : "PAM_PROMPT_ECHO_ON ") << escape(prompt) << std::endl;
+
+    std::string response;
+    return std::getline(std::cin, response) && response == expected;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <user>" << std::endl;
+        return 1;
+    }
+
+    std::string cookie;
+    if (!std::getline(std::cin, cookie) || cookie.empty())
+    {
+        return 1;
+    }
+
+    std::cout << "PAM_TEXT_INFO " << escape(std::string("Stand-in helper for ") + argv[1]) << std::endl;
+
+    bool success = ask("Password: ", true, "password");
+    if (success && cookie.compare(0, 8, "two-step") == 0)
+    {
+        success = ask("Verification code: ", false, "123456");
+    }
+
+    if (!success)
+    {
+        std::cout << "PAM_ERROR_MSG " << escape("Sorry, that didn't work") << std::endl;
+    }
+
+    std::cout << (success ? "SUCCESS" : "FAILURE") << std::endl;
+    return success ? 0 : 1;
+}
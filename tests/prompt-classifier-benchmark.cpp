@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+/* Micro benchmark for classifying PAM prompts. It isn't run as part
+   of the test suite, run it by hand and compare the numbers:
+
+       ./tests/prompt-classifier-benchmark [rounds]
+
+   The "regex" numbers are the way Authentication used to spot a
+   password prompt, a std::regex that only knew English. The
+   "classifier" numbers are PromptClassifier, which is looking for
+   every kind of prompt in all of its languages. */
+
+/* Local Headers */
+#include "prompt-classifier.h"
+
+/* System Libs */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <regex>
+#include <string>
+#include <vector>
+
+/** The old detector, kept here so that we can compare against it */
+static const std::regex passwordDetector{"\\s*[Pp]assword:?\\s*"};
+
+/** Prompts that PAM modules send */
+static const std::vector<std::string> prompts = {
+    "Password:",
+    "Password for ted:",
+    "Passwort:",
+    "Mot de passe : ",
+    "Пароль:",
+    "密码：",
+    "Enter PIN for 'Smart Card':",
+    "Verification code: ",
+    "One-time password (OATH) for `ted':",
+    "Swipe your right index finger across the fingerprint reader",
+    "login:",
+    "Are you sure you want to continue connecting (yes/no)?",
+};
+
+/** Classifies every prompt \p rounds times with \p classify and
+    returns the number of prompts per second. The count of matches is
+    kept so the work can't be optimized away. */
+template <typename Classify>
+double measure(unsigned int rounds, Classify classify, unsigned int& matches)
+{
+    matches = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < rounds; i++)
+    {
+        for (const auto& prompt : prompts)
+        {
+            if (classify(prompt))
+            {
+                matches++;
+            }
+        }
+    }
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    return rounds * prompts.size() / elapsed.count();
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned int rounds = argc > 1 ? std::atoi(argv[1]) : 100000;
+    unsigned int matches = 0;
+
+    std::printf("Classifying %zu prompts %u times\n", prompts.size(), rounds);
+
+    auto regex = measure(rounds, [](const std::string& prompt) { return std::regex_match(prompt, passwordDetector); },
+                         matches);
+    std::printf("  regex:      %12.0f prompts/sec, %u recognized\n", regex, matches);
+
+    auto classifier = measure(rounds,
+                              [](const std::string& prompt) {
+                                  return PromptClassifier::classify(prompt).type != PromptClassifier::Type::UNKNOWN;
+                              },
+                              matches);
+    std::printf("  classifier: %12.0f prompts/sec, %u recognized\n", classifier, matches);
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright © 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Authors:
+ *     Ted Gould <ted.gould@canonical.com>
+ */
+
+/* Test Libraries */
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#pragma GCC diagnostic pop
+
+/* Local Headers */
+#include "prompt-classifier.h"
+
+/* System Libs */
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+/* Count every allocation so we can check classifying makes none */
+static std::atomic<unsigned long> allocations{0};
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    auto ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+    std::free(ptr);
+}
+
+typedef PromptClassifier::Type Type;
+
+static Type typeOf(const std::string& prompt)
+{
+    return PromptClassifier::classify(prompt).type;
+}
+
+TEST(PromptClassifierTest, Password)
+{
+    EXPECT_EQ(Type::PASSWORD, typeOf("Password:"));
+    EXPECT_EQ(Type::PASSWORD, typeOf("  password  "));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Password for ted:"));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Current password: "));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Enter passphrase for key:"));
+
+    /* Translations */
+    EXPECT_EQ(Type::PASSWORD, typeOf("Passwort:"));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Mot de passe : "));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Contraseña:"));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Senha:"));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Hasło:"));
+    EXPECT_EQ(Type::PASSWORD, typeOf("Пароль:"));
+    EXPECT_EQ(Type::PASSWORD, typeOf("密码："));
+    EXPECT_EQ(Type::PASSWORD, typeOf("パスワード:"));
+}
+
+TEST(PromptClassifierTest, Others)
+{
+    EXPECT_EQ(Type::PIN, typeOf("PIN:"));
+    EXPECT_EQ(Type::PIN, typeOf("Enter PIN for 'Smart Card':"));
+    EXPECT_EQ(Type::OTP, typeOf("Verification code: "));
+    EXPECT_EQ(Type::OTP, typeOf("One-time password (OATH) for `ted':"));
+    EXPECT_EQ(Type::OTP, typeOf("Token code:"));
+    EXPECT_EQ(Type::FINGERPRINT, typeOf("Swipe your right index finger across the fingerprint reader"));
+    EXPECT_EQ(Type::FINGERPRINT, typeOf("Place your finger on the reader"));
+    EXPECT_EQ(Type::USERNAME, typeOf("login:"));
+    EXPECT_EQ(Type::USERNAME, typeOf("Username:"));
+
+    /* Not inside other words */
+    EXPECT_EQ(Type::UNKNOWN, typeOf("Typing"));
+    EXPECT_EQ(Type::UNKNOWN, typeOf("Loginator"));
+    EXPECT_EQ(Type::UNKNOWN, typeOf("Are you sure?"));
+    EXPECT_EQ(Type::UNKNOWN, typeOf(""));
+}
+
+TEST(PromptClassifierTest, Bare)
+{
+    EXPECT_TRUE(PromptClassifier::classify("Password:").bare);
+    EXPECT_TRUE(PromptClassifier::classify(" Password : ").bare);
+    EXPECT_TRUE(PromptClassifier::classify("密码：").bare);
+    EXPECT_FALSE(PromptClassifier::classify("Password for ted:").bare);
+    EXPECT_FALSE(PromptClassifier::classify("New password:").bare);
+    EXPECT_FALSE(PromptClassifier::classify("Are you sure?").bare);
+}
+
+TEST(PromptClassifierTest, NoAllocations)
+{
+    std::string prompt("Enter PIN for 'Smart Card' or your password:");
+
+    auto before = allocations.load();
+    auto result = PromptClassifier::classify(prompt);
+    auto after = allocations.load();
+
+    EXPECT_EQ(Type::PIN, result.type);
+    EXPECT_EQ(before, after);
+}